@@ -7,6 +7,10 @@
  *
  *     nextTime -- next time the activity should run
  *
+ *     sequence -- number the manager gave the schedule operation that
+ *         last scheduled the activity; numbers increase with each schedule,
+ *         so activities scheduled for the same time run in sequence order
+ *
  *     manager -- the activity manager that manages this activity
  *
  *     main -- main element for the activity, which use the special
@@ -20,6 +24,12 @@
  *         delivered immediately instead of being deferred
  *
  *     posting -- notification queue for this activity
+ *
+ *     coroutine -- coroutine to resume the next time the activity runs,
+ *         if any (only when compiled with coroutine support)
+ *
+ *     waitingCoroutine -- coroutine of this activity that is waiting for
+ *         a notification, if any (only when compiled with coroutine support)
  */
 
 #ifndef FWK_ACTIVITY_H
@@ -99,6 +109,23 @@ public:
     virtual void nextTimeIsOffset(const Time offset) = 0;
 
 
+    /** Sequence number of the schedule operation that last scheduled it. */
+    virtual U64 sequence() = 0;
+
+    /** Modify the sequence number. Only the activity manager does this. */
+    virtual void sequenceIs(const U64 sequence) = 0;
+
+    /**
+     * Entry for the activity in its manager's queue, or null if it has
+     * none. Only an activity manager that finds its entries this way,
+     * rather than by a lookup, uses it.
+     */
+    virtual void* queueEntry() = 0;
+
+    /** Modify the queue entry. Only the activity manager does this. */
+    virtual void queueEntryIs(void* const entry) = 0;
+
+
     /** Manager for this activity. */
     virtual Ptr<ActivityManager> manager() = 0;
 
@@ -124,9 +151,25 @@ public:
         const Ptr<ActivityElement>& reactor, const Reaction& reaction
     ) = 0;
 
+#ifdef __cpp_impl_coroutine
+
+    /** Return the coroutine to resume the next time the activity runs. */
+    virtual std::coroutine_handle<> coroutine() = 0;
+
+    /** Modify the coroutine to resume the next time the activity runs. */
+    virtual void coroutineIs(const std::coroutine_handle<> h) = 0;
+
+    /** Return the coroutine that is waiting for a notification. */
+    virtual std::coroutine_handle<> waitingCoroutine() = 0;
+
+    /** Modify the coroutine that is waiting for a notification. */
+    virtual void waitingCoroutineIs(const std::coroutine_handle<> h) = 0;
+
+#endif
+
 protected:
 
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef BaseNotifieeList<Activity> NotifieeList;
 
 public:
 
@@ -136,7 +179,8 @@ public:
 
 protected:
 
-    static Ptr<Activity> current_;
+    /** Each thread running activities has its own current activity. */
+    static thread_local Ptr<Activity> current_;
 
 
     NotifieeList notifiees_;
@@ -150,7 +194,7 @@ protected:
 
 };
 
-Ptr<Activity> Activity::current_;
+thread_local Ptr<Activity> Activity::current_;
 
 
 ActivityElement::ActivityElement() :
@@ -58,10 +58,32 @@ public:
      */
     virtual void nowIs(const Time& t) = 0;
 
+
+    /**
+     * A manager is referenced by activities running on every thread of
+     * a partitioned manager, so it keeps an atomic reference count in place
+     * of the one in PtrInterface. Ptr<T> for any manager type uses these.
+     */
+    unsigned long references() const {
+        return references_.load(std::memory_order_relaxed);
+    }
+
+    void newRef() {
+        references_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void deleteRef() {
+        if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            onZeroReferences();
+        }
+    }
+
 protected:
 
     static Ptr<ActivityManager> instance_;
 
+    std::atomic<unsigned long> references_{0};
+
 };
 
 Ptr<ActivityManager> ActivityManager::instance_;
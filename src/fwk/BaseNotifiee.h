@@ -6,11 +6,14 @@
 #ifndef FWK_BASENOTIFIEE_H
 #define FWK_BASENOTIFIEE_H
 
+template <class Notifier> class BaseNotifieeList;
+
 /**
  * BaseNotifiee is a template that implements the connection between
  * a notifiee and a notifier. The notifier class must implement a
- * notifiees attribute that is a collection supporting STL-style
- * push_back(notifiee), begin(), end(), and erase(iterator). The notifier
+ * notifiees attribute of type BaseNotifieeList<Notifier>, which links
+ * notifiees through the notifieePrev_ and notifieeNext_ fields here
+ * so that connect and disconnect take constant time. The notifier
  * defines a Notifiee subclass that extends BaseNotifiee<Notifier>, and
  * this subclass defines a notifierIs method in addition to the notifications.
  * The notifierIs method simply calls the protected connect method:
@@ -32,7 +35,10 @@ protected:
     Ptr<Notifier> notifier_;
 
 
-    BaseNotifiee() {
+    BaseNotifiee() :
+        notifieePrev_(null),
+        notifieeNext_(null)
+    {
         // Nothing else to do.
     }
 
@@ -71,16 +77,17 @@ protected:
     _noinline
     void disconnect() {
         if (notifier_ != null) {
-            auto& notifiees = notifier_->notifiees();
-            for (auto i = notifiees.begin(); i != notifiees.end(); ++i) {
-                if (*i == this) {
-                    notifiees.erase(i);
-                    break;
-                }
-            }
+            notifier_->notifiees().erase(this);
         }
     }
 
+private:
+
+    friend class BaseNotifieeList<Notifier>;
+
+    BaseNotifiee* notifieePrev_;
+    BaseNotifiee* notifieeNext_;
+
 };
 
 #endif
@@ -0,0 +1,156 @@
+#ifndef FWK_BASENOTIFIEELIST_H
+#define FWK_BASENOTIFIEELIST_H
+
+/**
+ * BaseNotifieeList is the collection a notifier uses for its notifiees
+ * attribute. The links live in BaseNotifiee itself, so connecting and
+ * disconnecting a notifiee is constant time and never allocates.
+ * A notifiee can be on at most one list, which matches BaseNotifiee
+ * having a single notifier.
+ *
+ * A notifier declares the list as
+ *
+ *     typedef fwk::BaseNotifieeList<Notifier> NotifieeList;
+ *
+ * Iterating over the list yields Notifier::Notifiee pointers. Notifications
+ * should iterate over a snapshot (see NotifierLib) because reactions
+ * may connect or disconnect notifiees while the notification is delivered.
+ */
+template <class Notifier>
+class BaseNotifieeList {
+public:
+
+    typedef typename Notifier::Notifiee Notifiee;
+    typedef BaseNotifiee<Notifier> Link;
+    typedef unsigned long size_type;
+
+
+    class iterator {
+    public:
+
+        iterator(Link* const link = null) :
+            link_(link)
+        {
+            // Nothing else to do.
+        }
+
+
+        Notifiee* operator *() const {
+            return static_cast<Notifiee*>(link_);
+        }
+
+        void operator ++() {
+            link_ = link_->notifieeNext_;
+        }
+
+        bool operator ==(const iterator& i) const {
+            return link_ == i.link_;
+        }
+
+        bool operator !=(const iterator& i) const {
+            return link_ != i.link_;
+        }
+
+    private:
+
+        friend class BaseNotifieeList;
+
+        Link* link_;
+
+    };
+
+
+    BaseNotifieeList() :
+        head_(null),
+        tail_(null),
+        size_(0)
+    {
+        // Nothing else to do.
+    }
+
+    ~BaseNotifieeList() {
+        clear();
+    }
+
+    // The links are owned by the notifiees, so the list can't be copied.
+    BaseNotifieeList(const BaseNotifieeList&) = delete;
+    void operator =(const BaseNotifieeList&) = delete;
+
+
+    size_type size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    iterator begin() const {
+        return head_;
+    }
+
+    iterator end() const {
+        return null;
+    }
+
+
+    void push_back(Link* const n) {
+        n->notifieePrev_ = tail_;
+        n->notifieeNext_ = null;
+
+        if (tail_ != null) {
+            tail_->notifieeNext_ = n;
+        } else {
+            head_ = n;
+        }
+
+        tail_ = n;
+        ++size_;
+    }
+
+    iterator erase(const iterator i) {
+        const auto next = i.link_->notifieeNext_;
+        erase(i.link_);
+        return next;
+    }
+
+    /**
+     * Unlink the given notifiee if it is on this list.
+     */
+    void erase(Link* const n) {
+        if (n->notifieePrev_ == null && head_ != n) {
+            return;
+        }
+
+        if (n->notifieePrev_ != null) {
+            n->notifieePrev_->notifieeNext_ = n->notifieeNext_;
+        } else {
+            head_ = n->notifieeNext_;
+        }
+
+        if (n->notifieeNext_ != null) {
+            n->notifieeNext_->notifieePrev_ = n->notifieePrev_;
+        } else {
+            tail_ = n->notifieePrev_;
+        }
+
+        n->notifieePrev_ = null;
+        n->notifieeNext_ = null;
+        --size_;
+    }
+
+    void clear() {
+        while (head_ != null) {
+            erase(head_);
+        }
+    }
+
+private:
+
+    Link* head_;
+    Link* tail_;
+    size_type size_;
+
+};
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * BatchManager implements ActivityManager like SequentialManager, but runs
+ * all the activities scheduled at the same time as one batch on a pool of
+ * worker threads.
+ *
+ * Each activity in a batch is a task, and an activity scheduled more than
+ * once at that time runs that many times in its task, so the runs of one
+ * activity are never concurrent and stay in order. The tasks are split
+ * evenly across the workers' queues. A worker takes tasks from the back of
+ * its own queue and, once that is empty, steals from the front of the
+ * others' queues.
+ *
+ * Each task runs with its own EffectBuffer active. Notifications to
+ * notifiees of other activities or of no activity, and schedules made with
+ * activityAdd, are collected in the buffer instead of taking effect. Once
+ * the batch is done, the buffers are applied on the calling thread in the
+ * order the activities were scheduled. The result therefore does not
+ * depend on the number of workers or on which worker ran which task, and
+ * effects on shared notifiers are applied one at a time.
+ *
+ * A reaction may otherwise only touch state owned by its own activity.
+ * Reactions that copy Ptrs to objects shared with other activities need
+ * a build with FWK_ATOMIC_PTR once there is more than one worker.
+ */
+
+#ifndef FWK_BATCHMANAGER_H
+#define FWK_BATCHMANAGER_H
+
+class BatchManager : public ActivityManager {
+public:
+
+    static Ptr<ActivityManager> instance() {
+        if (instance_ == null) {
+            instance_ = instanceNew(std::thread::hardware_concurrency());
+        }
+
+        return instance_;
+    }
+
+    /** Return a new manager with the given number of workers. */
+    static Ptr<BatchManager> instanceNew(const unsigned long workers) {
+        const Ptr<BatchManager> mgr = new BatchManager();
+        mgr->workerCountIs(workers);
+        return mgr;
+    }
+
+
+    bool verbose() {
+        return verbose_;
+    }
+
+    void verboseIs(const bool verbose) {
+        verbose_ = verbose;
+    }
+
+
+    /**
+     * Return the number of workers, including the thread that calls nowIs.
+     */
+    unsigned long workerCount() {
+        return queues_.size();
+    }
+
+    /** Modify the number of workers. */
+    _noinline
+    void workerCountIs(const unsigned long workers) {
+        workersDel();
+
+        queues_.clear();
+        for (unsigned long i = 0; i < (workers > 0 ? workers : 1); ++i) {
+            queues_.emplace_back();
+        }
+
+        for (unsigned long i = 1; i < queues_.size(); ++i) {
+            workers_.push_back(
+                std::thread(&BatchManager::work, this, i, workBatch_)
+            );
+        }
+    }
+
+    /**
+     * Return the smallest batch that is run on the pool. Smaller batches
+     * run on the calling thread, but still apply their effects at the end.
+     */
+    unsigned long minBatchSize() {
+        return minBatchSize_;
+    }
+
+    /** Modify the smallest batch that is run on the pool. */
+    void minBatchSizeIs(const unsigned long size) {
+        minBatchSize_ = size;
+    }
+
+
+    /** Return the number of batches run so far. */
+    unsigned long batchCount() {
+        return batches_;
+    }
+
+    /** Return the number of tasks run so far. */
+    unsigned long taskCount() {
+        return tasks_;
+    }
+
+    /**
+     * Return the number of activity runs so far. A task runs its activity
+     * once for each time it was scheduled in the batch.
+     */
+    U64 runCount() {
+        return runs_;
+    }
+
+    /** Return the number of tasks a worker took from another's queue. */
+    unsigned long stealCount() {
+        return steals_;
+    }
+
+
+    _noinline
+    Ptr<Activity> activity(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            return i->second;
+        }
+
+        return null;
+    }
+
+    _noinline
+    Ptr<Activity> activityNew(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (activities_[name] != null) {
+            throw NameInUseException(name);
+        }
+
+        const Ptr<Activity> a = SequentialActivity::instanceNew(name, this);
+
+        activities_[name] = a;
+
+        return a;
+    }
+
+    _noinline
+    void activityDel(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            activities_.erase(i);
+        }
+    }
+
+    /**
+     * Schedule the activity at activity->nextTime(). Called from a task,
+     * the schedule takes effect when the batch is done.
+     */
+    _noinline
+    void activityAdd(const Ptr<Activity>& activity) {
+        const auto t = activity->nextTime();
+        if (EffectBuffer::current() != null) {
+            EffectBuffer::effectNew([this, activity, t]() { enqueue(activity, t); });
+            return;
+        }
+
+        enqueue(activity, t);
+    }
+
+
+    Time now() {
+        return now_;
+    }
+
+    /**
+     * Move to the given time, running the activities scheduled at each
+     * time up to and including t as one batch.
+     */
+    _noinline
+    void nowIs(const Time& t) {
+        while (!queue_.empty()) {
+            const auto nextTimeToRun = queue_.front().time;
+
+            if (nextTimeToRun > t) {
+                // Finished running everything before or at time t.
+                break;
+            }
+
+            if (nextTimeToRun > now_) {
+                now_ = nextTimeToRun;
+            }
+
+            batchNew(nextTimeToRun);
+            runBatch();
+            applyBatch();
+        }
+
+        //
+        // Move the time up to specified time in case the last scheduled
+        // activity ran before t and the next one runs after t.
+        //
+        now_ = t;
+    }
+
+protected:
+
+    struct Entry {
+        Time time;
+        U64 sequence;
+        Ptr<Activity> activity;
+    };
+
+    class Later {
+    public:
+
+        bool operator()(const Entry& e1, const Entry& e2) const {
+            if (e1.time != e2.time) {
+                return e1.time > e2.time;
+            }
+
+            return e1.sequence > e2.sequence;
+        }
+
+    };
+
+    /** Runs of one activity in a batch and the effects they made. */
+    struct Task {
+        Ptr<Activity> activity;
+        unsigned long runs;
+        EffectBuffer effects;
+    };
+
+    /** Task indices for one worker, guarded by its mutex. */
+    struct Queue {
+        std::mutex mutex;
+        std::deque<unsigned long> tasks;
+    };
+
+    typedef std::unordered_map< string, Ptr<Activity> > ActivityMap;
+
+
+    bool verbose_;
+    Time now_;
+    U64 sequence_;
+    std::vector<Entry> queue_;
+
+    /** Guards activities_. */
+    std::mutex mutex_;
+    ActivityMap activities_;
+
+    std::deque<Task> batch_;
+    std::unordered_map<Activity*, unsigned long> batchIndex_;
+    unsigned long minBatchSize_;
+    unsigned long batches_;
+    unsigned long tasks_;
+    U64 runs_;
+    std::atomic<unsigned long> steals_;
+
+    std::deque<Queue> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex workMutex_;
+    std::condition_variable workStart_;
+    std::condition_variable workDone_;
+    U64 workBatch_;
+    unsigned long workRunning_;
+    bool workStopping_;
+
+
+    BatchManager() :
+        verbose_(false),
+        now_(0.0),
+        sequence_(0),
+        minBatchSize_(2),
+        batches_(0),
+        tasks_(0),
+        runs_(0),
+        steals_(0),
+        workBatch_(0),
+        workRunning_(0),
+        workStopping_(false)
+    {
+        // Nothing else to do.
+    }
+
+    ~BatchManager() {
+        workersDel();
+    }
+
+
+    void enqueue(const Ptr<Activity>& activity, const Time t) {
+        Entry e;
+        e.time = t;
+        e.sequence = sequence_++;
+        e.activity = activity;
+        activity->sequenceIs(e.sequence);
+        queue_.push_back(e);
+        std::push_heap(queue_.begin(), queue_.end(), Later());
+    }
+
+    /**
+     * Move the activities scheduled at time t from the queue into tasks,
+     * in the order they were scheduled.
+     */
+    void batchNew(const Time t) {
+        batch_.clear();
+        batchIndex_.clear();
+
+        while (!queue_.empty() && queue_.front().time == t) {
+            const auto activity = queue_.front().activity;
+            const auto sequence = queue_.front().sequence;
+            std::pop_heap(queue_.begin(), queue_.end(), Later());
+            queue_.pop_back();
+
+            ++runs_;
+            const auto i = batchIndex_.find(activity.ptr());
+            if (i != batchIndex_.end()) {
+                ++batch_[i->second].runs;
+                continue;
+            }
+
+            batchIndex_[activity.ptr()] = batch_.size();
+            batch_.emplace_back();
+            batch_.back().activity = activity;
+            batch_.back().runs = 1;
+
+            if (verbose_) {
+                std::cout << timeAsString(t) << " ";
+                std::cout << "Activity: " << activity->name();
+                std::cout << " (sequence " << sequence << ")" << std::endl;
+            }
+        }
+
+        ++batches_;
+        tasks_ += batch_.size();
+    }
+
+    void runBatch() {
+        if (workers_.empty() || batch_.size() < minBatchSize_) {
+            for (unsigned long i = 0; i < batch_.size(); ++i) {
+                runTask(i);
+            }
+            return;
+        }
+
+        const auto n = batch_.size();
+        const auto w = queues_.size();
+        for (unsigned long q = 0; q < w; ++q) {
+            for (auto i = q * n / w; i < (q + 1) * n / w; ++i) {
+                queues_[q].tasks.push_back(i);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(workMutex_);
+            workRunning_ = workers_.size();
+            ++workBatch_;
+        }
+        workStart_.notify_all();
+
+        runTasks(0);
+
+        std::unique_lock<std::mutex> lock(workMutex_);
+        workDone_.wait(lock, [this]() { return workRunning_ == 0; });
+    }
+
+    /** Apply the effects of each task in the order of the batch. */
+    void applyBatch() {
+        for (auto& task : batch_) {
+            task.effects.applyAll();
+        }
+    }
+
+    void runTask(const unsigned long i) {
+        auto& task = batch_[i];
+        EffectBuffer::currentIs(&task.effects);
+        for (unsigned long r = 0; r < task.runs; ++r) {
+            task.activity->statusIs(Activity::running);
+        }
+        EffectBuffer::currentIs(null);
+    }
+
+    /**
+     * Run tasks from worker q's queue, then steal from the other workers,
+     * until every queue is empty. Tasks never add tasks, so an empty
+     * queue stays empty for the rest of the batch.
+     */
+    void runTasks(const unsigned long q) {
+        for (;;) {
+            unsigned long i;
+            if (taskTaken(q, false, i)) {
+                runTask(i);
+                continue;
+            }
+
+            auto stolen = false;
+            for (unsigned long v = 1; v < queues_.size() && !stolen; ++v) {
+                stolen = taskTaken((q + v) % queues_.size(), true, i);
+            }
+
+            if (!stolen) {
+                return;
+            }
+
+            ++steals_;
+            runTask(i);
+        }
+    }
+
+    /** Take a task from the back of queue q, or its front if stealing. */
+    bool taskTaken(const unsigned long q, const bool steal, unsigned long& i) {
+        auto& queue = queues_[q];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+
+        if (steal) {
+            i = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            i = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+
+        return true;
+    }
+
+    /** Worker thread loop: run tasks for each batch after the given one. */
+    void work(const unsigned long q, U64 batch) {
+        std::unique_lock<std::mutex> lock(workMutex_);
+        for (;;) {
+            workStart_.wait(lock, [&]() {
+                return workBatch_ != batch || workStopping_;
+            });
+            if (workStopping_) {
+                return;
+            }
+
+            batch = workBatch_;
+            lock.unlock();
+            runTasks(q);
+            lock.lock();
+
+            if (--workRunning_ == 0) {
+                workDone_.notify_one();
+            }
+        }
+    }
+
+    void workersDel() {
+        {
+            std::lock_guard<std::mutex> lock(workMutex_);
+            workStopping_ = true;
+        }
+        workStart_.notify_all();
+
+        for (auto& w : workers_) {
+            w.join();
+        }
+
+        workers_.clear();
+        workStopping_ = false;
+    }
+
+};
+
+#endif
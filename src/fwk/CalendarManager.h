@@ -0,0 +1,462 @@
+/**
+ * CalendarManager implements ActivityManager like SequentialManager,
+ * running all activities sequentially, but keeps the scheduled activities
+ * in a calendar queue (R. Brown, CACM 1988) instead of a binary heap.
+ *
+ * The queue is an array of buckets, each covering a fixed width of time,
+ * that wraps around like the days of a calendar year. Each bucket is a
+ * doubly-linked list sorted by time, with ties in the order they were
+ * scheduled. The time is cached in the entry when the activity is added,
+ * so ordering never calls back into the activity.
+ *
+ * An activity is in the queue at most once. Adding an activity that is
+ * already scheduled moves it to its new time. The entry for a scheduled
+ * activity is kept in the activity's queueEntry, so finding it is a field
+ * access rather than a lookup, and is available as a Handle, which
+ * supports constant-time cancel and reschedule. A handle is only valid
+ * until the activity runs or is cancelled.
+ */
+
+#ifndef FWK_CALENDARMANAGER_H
+#define FWK_CALENDARMANAGER_H
+
+class CalendarManager : public ActivityManager {
+protected:
+
+    struct Entry;
+
+public:
+
+    typedef Entry* Handle;
+
+
+    static Ptr<ActivityManager> instance() {
+        if (instance_ == null) {
+            instance_ = instanceNew();
+        }
+
+        return instance_;
+    }
+
+    /**
+     * Return a new manager that is not the singleton instance,
+     * e.g., to compare managers in the same process.
+     */
+    static Ptr<CalendarManager> instanceNew() {
+        return new CalendarManager();
+    }
+
+
+    bool verbose() {
+        return verbose_;
+    }
+
+    void verboseIs(const bool verbose) {
+        verbose_ = verbose;
+    }
+
+
+    _noinline
+    Ptr<Activity> activity(const string& name) {
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            return i->second;
+        }
+
+        return null;
+    }
+
+    _noinline
+    Ptr<Activity> activityNew(const string& name) {
+        if (activities_[name] != null) {
+            throw NameInUseException(name);
+        }
+
+        const Ptr<Activity> a = SequentialActivity::instanceNew(name, this);
+
+        activities_[name] = a;
+
+        return a;
+    }
+
+    _noinline
+    void activityDel(const string& name) {
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            activities_.erase(i);
+        }
+    }
+
+    /**
+     * Schedule the activity at activity->nextTime(), moving it
+     * if it is already scheduled.
+     */
+    _noinline
+    void activityAdd(const Ptr<Activity>& activity) {
+        activity->sequenceIs(sequence_++);
+
+        const auto h = handle(activity);
+        if (h != null) {
+            unlink(h);
+            h->time = activity->nextTime();
+            link(h);
+            return;
+        }
+
+        const auto e = entryNew(activity, activity->nextTime());
+        activity->queueEntryIs(e);
+        link(e);
+        ++size_;
+
+        if (size_ > 2 * buckets_.size()) {
+            bucketCountIs(2 * buckets_.size());
+        }
+    }
+
+
+    /**
+     * Return the handle for the given activity, or null if it isn't
+     * scheduled.
+     */
+    Handle handle(const Ptr<Activity>& activity) {
+        return static_cast<Entry*>(activity->queueEntry());
+    }
+
+    /** Return the time at which the activity for the handle will run. */
+    Time handleTime(const Handle h) {
+        return h->time;
+    }
+
+    /**
+     * Move the scheduled activity for the handle to run at the given time.
+     * This also sets the activity's nextTime.
+     */
+    _noinline
+    void handleTimeIs(const Handle h, const Time t) {
+        const auto activity = h->activity;
+        activity->nextTimeIs(t);
+
+        // Notifiees of nextTime may have rescheduled or cancelled it.
+        if (handle(activity) == h) {
+            unlink(h);
+            h->time = t;
+            link(h);
+        }
+    }
+
+    /**
+     * Remove the scheduled activity for the handle from the queue.
+     */
+    _noinline
+    void handleDel(const Handle h) {
+        unlink(h);
+        h->activity->queueEntryIs(null);
+        entryDel(h);
+        --size_;
+
+        if (size_ < buckets_.size() / 2 && buckets_.size() > minBuckets) {
+            bucketCountIs(buckets_.size() / 2);
+        }
+    }
+
+
+    /** Return the number of scheduled activities. */
+    unsigned long scheduledCount() {
+        return size_;
+    }
+
+    /** Return the number of activity runs so far. */
+    U64 runCount() {
+        return runs_;
+    }
+
+
+    Time now() {
+        return now_;
+    }
+
+    /**
+     * Move to the given time, running any scheduled activites with nextTime
+     * less than or equal to given time (and run them in chronological order).
+     */
+    _noinline
+    void nowIs(const Time& t) {
+        while (size_ > 0) {
+            const auto e = front();
+            const auto nextTimeToRun = e->time;
+
+            if (nextTimeToRun > t) {
+                // Finished running everything before or at time t.
+                break;
+            }
+
+            if (nextTimeToRun > now_) {
+                gapIs(nextTimeToRun - now_);
+                now_ = nextTimeToRun;
+            }
+
+            const auto nextToRun = e->activity;
+            handleDel(e);
+
+            if (verbose_) {
+                std::cout << timeAsString(nextTimeToRun) << " ";
+                std::cout << "Activity: " << nextToRun->name();
+                std::cout << " (sequence " << nextToRun->sequence() << ")" << std::endl;
+            }
+
+            ++runs_;
+            nextToRun->statusIs(Activity::running);
+        }
+
+        //
+        // Move the time up to specified time in case the last scheduled
+        // activity ran before t and the next one runs after t.
+        //
+        now_ = t;
+    }
+
+protected:
+
+    typedef std::unordered_map< string, Ptr<Activity> > ActivityMap;
+
+    struct Entry {
+        Ptr<Activity> activity;
+        Time time;
+        Entry* prev;
+        Entry* next;
+    };
+
+    struct Bucket {
+        Entry* head = null;
+        Entry* tail = null;
+    };
+
+    typedef std::vector<Bucket> BucketVector;
+
+    static const unsigned long minBuckets = 16;
+
+    bool verbose_;
+    Time now_;
+    U64 sequence_;
+    U64 runs_;
+    ActivityMap activities_;
+    BucketVector buckets_;
+    unsigned long size_;
+
+    /** Width of the time covered by each bucket, in seconds. */
+    double width_;
+
+    /** Bucket-width slot (time / width) where the search for the next entry starts. */
+    U64 slot_;
+
+    /** Average gap between distinct times that have run, and the sum
+     * and count of the gaps since it was last computed. */
+    double averageGap_;
+    double gapSum_;
+    unsigned long gapCount_;
+
+    std::vector<Entry*> freeEntries_;
+
+
+    CalendarManager() :
+        verbose_(false),
+        now_(0.0),
+        sequence_(0),
+        runs_(0),
+        buckets_(minBuckets),
+        size_(0),
+        width_(1.0),
+        slot_(0),
+        averageGap_(0.0),
+        gapSum_(0.0),
+        gapCount_(0)
+    {
+        // Nothing else to do.
+    }
+
+    ~CalendarManager() {
+        for (auto& b : buckets_) {
+            while (b.head != null) {
+                const auto e = b.head;
+                b.head = e->next;
+                e->activity->queueEntryIs(null);
+                delete e;
+            }
+        }
+
+        for (const auto e : freeEntries_) {
+            delete e;
+        }
+    }
+
+
+    Entry* entryNew(const Ptr<Activity>& activity, const Time t) {
+        Entry* e;
+        if (freeEntries_.empty()) {
+            e = new Entry();
+        } else {
+            e = freeEntries_.back();
+            freeEntries_.pop_back();
+        }
+
+        e->activity = activity;
+        e->time = t;
+        return e;
+    }
+
+    void entryDel(Entry* const e) {
+        e->activity = null;
+        freeEntries_.push_back(e);
+    }
+
+
+    U64 slot(const Time t) const {
+        return U64(t.value() / width_);
+    }
+
+    Bucket& bucket(const U64 slot) {
+        return buckets_[slot & (buckets_.size() - 1)];
+    }
+
+    /**
+     * Insert the entry into its bucket after any entries with the same
+     * or an earlier time. Entries usually arrive in increasing time order,
+     * so the search starts at the tail.
+     */
+    void link(Entry* const e) {
+        const auto s = slot(e->time);
+        auto& b = bucket(s);
+
+        auto after = b.tail;
+        while (after != null && after->time > e->time) {
+            after = after->prev;
+        }
+
+        e->prev = after;
+        if (after != null) {
+            e->next = after->next;
+            after->next = e;
+        } else {
+            e->next = b.head;
+            b.head = e;
+        }
+
+        if (e->next != null) {
+            e->next->prev = e;
+        } else {
+            b.tail = e;
+        }
+
+        // Restart the search earlier if this entry is before it.
+        if (s < slot_) {
+            slot_ = s;
+        }
+    }
+
+    void unlink(Entry* const e) {
+        auto& b = bucket(slot(e->time));
+
+        if (e->prev != null) {
+            e->prev->next = e->next;
+        } else {
+            b.head = e->next;
+        }
+
+        if (e->next != null) {
+            e->next->prev = e->prev;
+        } else {
+            b.tail = e->prev;
+        }
+
+        e->prev = null;
+        e->next = null;
+    }
+
+    /**
+     * Return the entry with the earliest time. Scans one "year" of buckets
+     * starting at the current slot; if none of them has an entry in that
+     * year, falls back to a direct search of the bucket heads.
+     */
+    Entry* front() {
+        for (U64 i = 0; i < buckets_.size(); ++i) {
+            const auto s = slot_ + i;
+            const auto e = bucket(s).head;
+            if (e != null && slot(e->time) <= s) {
+                slot_ = s;
+                return e;
+            }
+        }
+
+        Entry* first = null;
+        for (const auto& b : buckets_) {
+            if (b.head != null && (first == null || b.head->time < first->time)) {
+                first = b.head;
+            }
+        }
+
+        slot_ = slot(first->time);
+        return first;
+    }
+
+    /**
+     * Record the gap between two distinct times that have run. Once per
+     * calendar year's worth of gaps, the bucket width is compared with the
+     * average gap and the calendar is rebuilt if the width is far off,
+     * e.g., because the activities were scheduled before anything ran.
+     */
+    void gapIs(const Time gap) {
+        gapSum_ += gap.value();
+        if (++gapCount_ < buckets_.size()) {
+            return;
+        }
+
+        averageGap_ = gapSum_ / gapCount_;
+        gapSum_ = 0;
+        gapCount_ = 0;
+
+        if (width_ > 12 * averageGap_ || width_ < 0.75 * averageGap_) {
+            bucketCountIs(buckets_.size());
+        }
+    }
+
+    /**
+     * Rebuild the calendar with the given number of buckets, using a width
+     * of a few average gaps so each bucket holds a handful of entries
+     * in the current year.
+     */
+    _noinline
+    void bucketCountIs(const unsigned long count) {
+        std::vector<Entry*> entries;
+        entries.reserve(size_);
+        for (auto& b : buckets_) {
+            for (auto e = b.head; e != null; e = e->next) {
+                entries.push_back(e);
+            }
+        }
+
+        if (averageGap_ > 0) {
+            width_ = 3 * averageGap_;
+        } else if (entries.size() > 1) {
+            // Nothing has run yet, so use the spread of the scheduled times.
+            auto first = entries[0]->time;
+            auto last = first;
+            for (const auto e : entries) {
+                first = e->time < first ? e->time : first;
+                last = e->time > last ? e->time : last;
+            }
+
+            if (last > first) {
+                width_ = 3 * (last - first).value() / entries.size();
+            }
+        }
+
+        buckets_.assign(count, Bucket());
+        slot_ = slot(now_);
+        for (const auto e : entries) {
+            link(e);
+        }
+    }
+
+};
+
+#endif
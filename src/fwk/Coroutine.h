@@ -0,0 +1,322 @@
+/**
+ * Coroutine lets an activity's logic be written as a C++20 coroutine
+ * instead of a notifiee that works out where it left off on each run:
+ *
+ *     Coroutine run() {
+ *         co_await after(setupTime);
+ *         ...
+ *         co_await notification(trip, &Trip::Notifiee::onStatus);
+ *         ...
+ *     }
+ *
+ *     coroutine_ = run();
+ *     coroutine_.activityIs(activity);
+ *
+ * The coroutine starts suspended and first runs when its activity next
+ * runs. co_await after(offset) schedules the activity offset from now and
+ * suspends; the activity resumes the coroutine directly when it runs,
+ * before delivering its notifications. co_await notification(notifier,
+ * func) suspends until the notifier next posts func and then resumes in
+ * the activity with the other notifications it posts.
+ *
+ * Frames are allocated from per-thread free lists, so sims that start many
+ * short coroutines reuse frames instead of going to the heap each time.
+ *
+ * The Coroutine object owns the frame and destroys it. Destroying it
+ * cancels whatever the coroutine is waiting for, so a later run of the
+ * activity or a later notification doesn't resume a destroyed frame, but
+ * the activity must outlive it. Waiting for a notification works under
+ * every manager, since the waiters are shared by all threads under a
+ * lock. Coroutine state is not saved for rollback, though, so coroutine
+ * activities can only run under OptimisticManager with one worker, where
+ * nothing is rolled back.
+ *
+ * Only compiled when the compiler supports coroutines.
+ */
+
+#ifndef FWK_COROUTINE_H
+#define FWK_COROUTINE_H
+
+class Coroutine {
+public:
+
+    class promise_type {
+    public:
+
+        Coroutine get_return_object() {
+            return Coroutine(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return std::suspend_always();
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return std::suspend_always();
+        }
+
+        void return_void() {
+            // Nothing to do.
+        }
+
+        /**
+         * Pass the exception on to whatever resumed the coroutine, which
+         * reports it like an exception from a reaction.
+         */
+        void unhandled_exception() {
+            throw;
+        }
+
+
+        static void* operator new(const size_t size) {
+            return frameNew(size);
+        }
+
+        static void operator delete(void* const frame, const size_t size) {
+            frameDel(frame, size);
+        }
+
+    private:
+
+        friend class Coroutine;
+
+        Activity* activity_ = null;
+
+        /** Removes the coroutine's waiters, if it has waited for any. */
+        void (*waitersDel_)(const void* owner) = null;
+
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+
+    /** Awaitable that resumes the coroutine a time offset from now. */
+    class Delay {
+    public:
+
+        explicit Delay(const Time offset) :
+            offset_(offset)
+        {
+            // Nothing else to do.
+        }
+
+        bool await_ready() const {
+            return false;
+        }
+
+        void await_suspend(const Handle h) const {
+            const auto a = h.promise().activity_;
+            a->coroutineIs(h);
+            a->nextTimeIsOffset(offset_);
+        }
+
+        void await_resume() const {
+            // Nothing to do.
+        }
+
+    private:
+
+        Time offset_;
+
+    };
+
+    /** Awaitable that resumes the coroutine after a notification. */
+    template <class T, class Func>
+    class Notification {
+    public:
+
+        Notification(const Ptr<T>& notifier, const Func func) :
+            notifier_(notifier),
+            func_(func)
+        {
+            // Nothing else to do.
+        }
+
+        bool await_ready() const {
+            return false;
+        }
+
+        /**
+         * Wait as the activity's waiting coroutine. The reaction only
+         * resumes the coroutine if it is still waiting, so one that was
+         * destroyed after being woken isn't resumed.
+         */
+        void await_suspend(const Handle h) const {
+            const auto a = h.promise().activity_;
+            a->waitingCoroutineIs(h);
+            h.promise().waitersDel_ = &NotifierLib::waitersDel<Func>;
+
+            NotifierLib::Waiter<Func> w;
+            w.notifier = static_cast<const void*>(notifier_.ptr());
+            w.func = func_;
+            w.activity = a;
+            w.owner = h.address();
+            w.reaction = [a, h]() {
+                if (a->waitingCoroutine().address() == h.address()) {
+                    a->waitingCoroutineIs(null);
+                    h.promise().waitersDel_ = null;
+                    h.resume();
+                }
+            };
+            NotifierLib::waiterNew(std::move(w));
+        }
+
+        void await_resume() const {
+            // Nothing to do.
+        }
+
+    private:
+
+        Ptr<T> notifier_;
+        Func func_;
+
+    };
+
+
+    Coroutine(Coroutine&& c) :
+        handle_(c.handle_)
+    {
+        c.handle_ = null;
+    }
+
+    Coroutine& operator =(Coroutine&& c) {
+        if (this != &c) {
+            handleDel();
+            handle_ = c.handle_;
+            c.handle_ = null;
+        }
+
+        return *this;
+    }
+
+    ~Coroutine() {
+        handleDel();
+    }
+
+
+    /** Return the activity that runs the coroutine. */
+    Ptr<Activity> activity() const {
+        return handle_.promise().activity_;
+    }
+
+    /**
+     * Modify the activity that runs the coroutine. The coroutine starts
+     * the next time the activity runs.
+     */
+    void activityIs(const Ptr<Activity>& activity) {
+        handle_.promise().activity_ = activity.ptr();
+        activity->coroutineIs(handle_);
+    }
+
+    /** Return whether the coroutine has finished. */
+    bool done() const {
+        return handle_.address() == null || handle_.done();
+    }
+
+private:
+
+    /** Frames are pooled in multiples of this size, up to maxPooled. */
+    static const size_t frameQuantum = 64;
+    static const size_t maxPooled = 32 * frameQuantum;
+
+    /** Free frames by size class, freed when the thread exits. */
+    class FreeFrames {
+    public:
+
+        std::vector<void*> lists[maxPooled / frameQuantum];
+
+        ~FreeFrames() {
+            for (auto& list : lists) {
+                for (const auto frame : list) {
+                    ::operator delete(frame);
+                }
+            }
+        }
+
+    };
+
+    static thread_local FreeFrames freeFrames_;
+
+    Handle handle_;
+
+
+    explicit Coroutine(const Handle h) :
+        handle_(h)
+    {
+        // Nothing else to do.
+    }
+
+    Coroutine(const Coroutine&) = delete;
+    void operator =(const Coroutine&) = delete;
+
+    /**
+     * Destroy the frame, first taking it off its activity and out of the
+     * waiters so nothing resumes it afterward.
+     */
+    void handleDel() {
+        if (handle_.address() == null) {
+            return;
+        }
+
+        auto& promise = handle_.promise();
+        const auto a = promise.activity_;
+        if (a != null) {
+            if (a->coroutine().address() == handle_.address()) {
+                a->coroutineIs(null);
+            }
+            if (a->waitingCoroutine().address() == handle_.address()) {
+                a->waitingCoroutineIs(null);
+            }
+        }
+        if (promise.waitersDel_ != null) {
+            promise.waitersDel_(handle_.address());
+        }
+
+        handle_.destroy();
+        handle_ = null;
+    }
+
+    static void* frameNew(const size_t size) {
+        if (size > maxPooled) {
+            return ::operator new(size);
+        }
+
+        auto& list = freeFrames_.lists[(size - 1) / frameQuantum];
+        if (list.empty()) {
+            return ::operator new((size + frameQuantum - 1) / frameQuantum * frameQuantum);
+        }
+
+        const auto frame = list.back();
+        list.pop_back();
+        return frame;
+    }
+
+    static void frameDel(void* const frame, const size_t size) {
+        if (size > maxPooled) {
+            ::operator delete(frame);
+            return;
+        }
+
+        freeFrames_.lists[(size - 1) / frameQuantum].push_back(frame);
+    }
+
+};
+
+thread_local Coroutine::FreeFrames Coroutine::freeFrames_;
+
+
+/** Return an awaitable that resumes the coroutine offset from now. */
+inline Coroutine::Delay after(const Time offset) {
+    return Coroutine::Delay(offset);
+}
+
+/**
+ * Return an awaitable that resumes the coroutine the next time the
+ * notifier posts func.
+ */
+template <class T, class Func>
+Coroutine::Notification<T, Func> notification(const Ptr<T>& notifier, const Func func) {
+    return Coroutine::Notification<T, Func>(notifier, func);
+}
+
+#endif
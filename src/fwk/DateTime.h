@@ -271,37 +271,21 @@ char* timeAsBuffer(char* const buffer, char* const end, const DateTime& d) {
     return p;
 }
 
+/**
+ * Write d's date and time, as CCYY-MM-DD HH:MM:SS, to the buffer and return
+ * the end of what was written, or null if the buffer is too small.
+ */
 _noinline
-string timeAsString(const DateTime& d) {
-    const auto hh = d.hour().value();
-    const auto mm = d.minute().value();
-    const auto ss = d.second().value();
-
-    char* const buffer = new char[32];
-    char* p = buffer;
-    *p++ = '0' + char(hh / 10);
-    *p++ = '0' + char(hh % 10);
-    *p++ = ':';
-    *p++ = '0' + char(mm / 10);
-    *p++ = '0' + char(mm % 10);
-    *p++ = ':';
-    *p++ = '0' + char(ss / 10);
-    *p++ = '0' + char(ss % 10);
-    *p = 0;
-    return buffer;
-}
+char* dateTimeAsBuffer(char* const buffer, char* const end, const DateTime& d) {
+    if (buffer + 20 >= end) {
+        return null;
+    }
 
-_noinline
-string dateTimeAsString(const DateTime& d) {
     const auto cc = d.century().value();
     const auto yy = d.year().value();
     const auto mo = d.month().value();
     const auto dd = d.day().value();
-    const auto hh = d.hour().value();
-    const auto mm = d.minute().value();
-    const auto ss = d.second().value();
 
-    char* buffer = new char[32];
     char* p = buffer;
     *p++ = '0' + char(cc / 10);
     *p++ = '0' + char(cc % 10);
@@ -314,39 +298,103 @@ string dateTimeAsString(const DateTime& d) {
     *p++ = '0' + char(dd / 10);
     *p++ = '0' + char(dd % 10);
     *p++ = ' ';
-
-    *p++ = '0' + char(hh / 10);
-    *p++ = '0' + char(hh % 10);
-    *p++ = ':';
-    *p++ = '0' + char(mm / 10);
-    *p++ = '0' + char(mm % 10);
-    *p++ = ':';
-    *p++ = '0' + char(ss / 10);
-    *p++ = '0' + char(ss % 10);
-    *p = 0;
-    return buffer;
+    return timeAsBuffer(p, end, d);
 }
 
+/**
+ * Write d's time of day with milliseconds, as HH:MM:SS.mmm, to the buffer
+ * and return the end of what was written, or null if the buffer is too
+ * small.
+ */
 _noinline
-string timeAsString(const Time sec) {
-    return timeAsString(DateTime(sec));
-}
-
-_noinline
-string timeMilliAsString(const DateTime& d) {
-    char* const buffer = new char[32];
-    char* p = timeAsBuffer(buffer, buffer + 32, d);
+char* timeMilliAsBuffer(char* const buffer, char* const end, const DateTime& d) {
+    if (buffer + 13 >= end) {
+        return null;
+    }
 
+    char* p = timeAsBuffer(buffer, end, d);
     const auto ms = d.millisecond().value();
-
-    *p++ = '.';
     const auto hs = ms % 100;
+    *p++ = '.';
     *p++ = '0' + char(ms / 100);
     *p++ = '0' + char(hs / 10);
     *p++ = '0' + char(hs % 10);
+    *p = '\0';
+    return p;
+}
+
+/**
+ * TimeFormatter writes Times as HH:MM:SS.mmm like timeMilliAsBuffer, but
+ * keeps the text of the last second it converted, so a run of times in
+ * the same second skips the conversion to local time. Each thread should
+ * use its own formatter.
+ */
+class TimeFormatter {
+public:
+
+    /**
+     * Write t to the buffer and return the end of what was written, or
+     * null if the buffer is too small.
+     */
+    char* timeMilliAsBuffer(char* const buffer, char* const end, const Time t) {
+        if (buffer + 13 >= end) {
+            return null;
+        }
+
+        const auto ms = U64(t.value() * 1000 + 0.5);
+        const auto second = ms / 1000;
+        if (!valid_ || second != second_) {
+            timeAsBuffer(secondText_, secondText_ + sizeof(secondText_), DateTime(SystemTime(ms)));
+            second_ = second;
+            valid_ = true;
+        }
+
+        std::memcpy(buffer, secondText_, 8);
+        char* p = buffer + 8;
+        const auto milli = unsigned(ms % 1000);
+        *p++ = '.';
+        *p++ = '0' + char(milli / 100);
+        *p++ = '0' + char(milli / 10 % 10);
+        *p++ = '0' + char(milli % 10);
+        *p = '\0';
+        return p;
+    }
+
+private:
+
+    bool valid_ = false;
+    U64 second_ = 0;
+    char secondText_[16];
 
-    *p = 0;
-    return buffer;
+};
+
+// The string forms below format into a stack buffer. Times of day fit in
+// std::string's small-buffer storage, so they don't allocate at all.
+
+_noinline
+string timeAsString(const DateTime& d) {
+    char buffer[32];
+    const auto end = timeAsBuffer(buffer, buffer + sizeof(buffer), d);
+    return string(buffer, end);
+}
+
+_noinline
+string dateTimeAsString(const DateTime& d) {
+    char buffer[32];
+    const auto end = dateTimeAsBuffer(buffer, buffer + sizeof(buffer), d);
+    return string(buffer, end);
+}
+
+_noinline
+string timeAsString(const Time sec) {
+    return timeAsString(DateTime(sec));
+}
+
+_noinline
+string timeMilliAsString(const DateTime& d) {
+    char buffer[32];
+    const auto end = timeMilliAsBuffer(buffer, buffer + sizeof(buffer), d);
+    return string(buffer, end);
 }
 
 string dateTimeAsString(const Time sec) {
@@ -0,0 +1,80 @@
+/**
+ * EffectBuffer collects the side effects a reaction makes outside its own
+ * activity while it runs in a parallel batch, so they can be applied later
+ * on one thread in a deterministic order.
+ *
+ * While a buffer is active on a thread, NotifierLib defers notifications
+ * to notifiees of other activities or of no activity, and BatchManager
+ * defers scheduling. Other code that touches shared state from a reaction
+ * can do the same with effectNew. With no buffer active, which is the case
+ * outside of a batch, effectNew runs the effect immediately.
+ */
+
+#ifndef FWK_EFFECTBUFFER_H
+#define FWK_EFFECTBUFFER_H
+
+class EffectBuffer {
+public:
+
+    typedef std::function<void()> Effect;
+
+
+    EffectBuffer() {
+        // Nothing else to do.
+    }
+
+    EffectBuffer(const EffectBuffer&) = delete;
+    void operator =(const EffectBuffer&) = delete;
+
+
+    /** Return the buffer active on this thread, if any. */
+    static EffectBuffer* current() {
+        return current_;
+    }
+
+    /** Modify the buffer active on this thread. */
+    static void currentIs(EffectBuffer* const buffer) {
+        current_ = buffer;
+    }
+
+
+    /**
+     * Add the effect to the active buffer, or run it now if there is none.
+     */
+    static void effectNew(const Effect& effect) {
+        const auto buffer = current_;
+        if (buffer != null) {
+            buffer->effects_.push_back(effect);
+        } else {
+            effect();
+        }
+    }
+
+
+    /** Return the number of effects in the buffer. */
+    unsigned long size() const {
+        return effects_.size();
+    }
+
+    /**
+     * Run the effects in the order they were added and clear the buffer.
+     * This should be called with no buffer active.
+     */
+    void applyAll() {
+        for (const auto& effect : effects_) {
+            effect();
+        }
+        effects_.clear();
+    }
+
+private:
+
+    static thread_local EffectBuffer* current_;
+
+    std::vector<Effect> effects_;
+
+};
+
+thread_local EffectBuffer* EffectBuffer::current_ = null;
+
+#endif
@@ -160,6 +160,30 @@ public:
 };
 
 
+class ReplayException : public Exception {
+public:
+
+    ReplayException(const string& what) :
+        Exception(what)
+    {
+        // Nothing else to do.
+    }
+
+};
+
+
+class LookaheadException : public Exception {
+public:
+
+    LookaheadException(const string& what) :
+        Exception(what)
+    {
+        // Nothing else to do.
+    }
+
+};
+
+
 class NameInUseException : public Exception {
 public:
 
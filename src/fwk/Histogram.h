@@ -0,0 +1,248 @@
+/**
+ * Histogram is a streaming quantile sketch, which keeps a distribution of
+ * values in fixed memory: simulated times in Stats and measured durations
+ * in Timer.
+ *
+ * It is a log-linear histogram in the style of an HDR histogram. Each
+ * power of two from minValue up is split into subBuckets equal buckets,
+ * so any quantile is reported to within a relative error of 1/subBuckets
+ * of the true value, however many values are recorded. Values at or below
+ * minValue share the first bucket. Count, sum, min and max are exact.
+ *
+ * Memory grows only with the largest value recorded (one bucket array per
+ * octave), never with the number of values. Two histograms merge by adding
+ * their buckets, so a window can be summed from histograms of its parts,
+ * as WindowedHistogram does.
+ */
+
+#ifndef FWK_HISTOGRAM_H
+#define FWK_HISTOGRAM_H
+
+class Histogram {
+public:
+
+    static const unsigned subBuckets = 32;
+
+    /** The smallest value told apart from zero, in the recorded unit. */
+    static constexpr double minValue = 1.0 / 1024;
+
+
+    /** Record value once. */
+    void valueIs(const double value) {
+        const size_t i = bucket(value);
+        if (i >= counts_.size()) {
+            counts_.resize((i / subBuckets + 1) * subBuckets, 0);
+        }
+        ++counts_[i];
+        ++count_;
+        sum_ += value;
+        if (value < min_) {
+            min_ = value;
+        }
+        if (value > max_) {
+            max_ = value;
+        }
+    }
+
+    /** Add the values recorded in h to this histogram. */
+    void merge(const Histogram& h) {
+        if (h.counts_.size() > counts_.size()) {
+            counts_.resize(h.counts_.size(), 0);
+        }
+        for (size_t i = 0; i < h.counts_.size(); ++i) {
+            counts_[i] += h.counts_[i];
+        }
+        count_ += h.count_;
+        sum_ += h.sum_;
+        if (h.min_ < min_) {
+            min_ = h.min_;
+        }
+        if (h.max_ > max_) {
+            max_ = h.max_;
+        }
+    }
+
+    /** Forget every value recorded, keeping the bucket memory. */
+    void clear() {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = 0;
+        sum_ = 0;
+        min_ = std::numeric_limits<double>::infinity();
+        max_ = -std::numeric_limits<double>::infinity();
+    }
+
+
+    U64 count() const {
+        return count_;
+    }
+
+    double mean() const {
+        return count_ == 0 ? 0 : sum_ / count_;
+    }
+
+    double min() const {
+        return count_ == 0 ? 0 : min_;
+    }
+
+    double max() const {
+        return count_ == 0 ? 0 : max_;
+    }
+
+    /**
+     * Return the value at quantile q in [0, 1]: the midpoint of the bucket
+     * holding the ceil(q * count())th smallest value, clamped to the exact
+     * min and max. An empty histogram returns 0.
+     */
+    double quantile(const double q) const {
+        if (count_ == 0) {
+            return 0;
+        }
+        if (q <= 0) {
+            return min_;
+        }
+        if (q >= 1) {
+            return max_;
+        }
+
+        const U64 rank = U64(std::ceil(q * count_));
+        U64 seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                const double value = (lowerBound(i) + lowerBound(i + 1)) / 2;
+                return value < min_ ? min_ : value > max_ ? max_ : value;
+            }
+        }
+        return max_;
+    }
+
+protected:
+
+    std::vector<U64> counts_;
+    U64 count_ = 0;
+    double sum_ = 0;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+
+
+    /**
+     * Return the bucket of the value. Bucket i covers [lowerBound(i),
+     * lowerBound(i + 1)), and octave k of the buckets covers
+     * [minValue * 2^k, minValue * 2^(k+1)).
+     */
+    static size_t bucket(const double value) {
+        if (!(value > minValue)) {
+            return 0;
+        }
+        int exponent;
+        const double mantissa = std::frexp(value / minValue, &exponent);
+        const size_t octave = size_t(exponent - 1);
+        const size_t sub = size_t((mantissa * 2 - 1) * subBuckets);
+        return octave * subBuckets + (sub < subBuckets ? sub : subBuckets - 1);
+    }
+
+    static double lowerBound(const size_t i) {
+        const size_t octave = i / subBuckets;
+        const double sub = double(i % subBuckets) / subBuckets;
+        return std::ldexp(minValue * (1 + sub), int(octave));
+    }
+
+};
+
+/**
+ * WindowedHistogram keeps a histogram of the values recorded over the last
+ * numPanes * paneLength of time. Time is divided into tumbling panes of
+ * paneLength, each with its own histogram; the sliding window is the
+ * merge of the panes still inside it. A pane's histogram is cleared and
+ * reused when time moves past the window, so memory is fixed by numPanes.
+ *
+ * Times are in whatever unit the caller uses, typically simulated seconds,
+ * and must not go backwards.
+ */
+class WindowedHistogram {
+public:
+
+    explicit WindowedHistogram(const double paneLength = 600, const size_t numPanes = 6) :
+        paneLength_(paneLength),
+        panes_(numPanes == 0 ? 1 : numPanes)
+    {
+        // Nothing else to do.
+    }
+
+
+    double paneLength() const {
+        return paneLength_;
+    }
+
+    size_t numPanes() const {
+        return panes_.size();
+    }
+
+
+    /** Record value at time now. */
+    void valueIs(const double now, const double value) {
+        nowIs(now);
+        panes_[current_].valueIs(value);
+    }
+
+    /** Return the values recorded in the sliding window ending at now. */
+    Histogram window(const double now) {
+        nowIs(now);
+        Histogram h;
+        for (const auto& pane : panes_) {
+            h.merge(pane);
+        }
+        return h;
+    }
+
+    /**
+     * Return the values recorded in the last tumbling pane to close before
+     * now. Only the current pane is still open.
+     */
+    Histogram lastPane(const double now) {
+        nowIs(now);
+        if (panes_.size() == 1) {
+            return Histogram();
+        }
+        return panes_[(current_ + panes_.size() - 1) % panes_.size()];
+    }
+
+protected:
+
+    double paneLength_;
+    std::vector<Histogram> panes_;
+    size_t current_ = 0;
+    S64 currentPane_ = std::numeric_limits<S64>::min();
+
+
+    /**
+     * Advance the current pane to the one holding now, clearing the panes
+     * that have slid out of the window on the way.
+     */
+    void nowIs(const double now) {
+        const S64 pane = S64(std::floor(now / paneLength_));
+        if (currentPane_ == std::numeric_limits<S64>::min()) {
+            currentPane_ = pane;
+            return;
+        }
+        if (pane <= currentPane_) {
+            return;
+        }
+
+        const S64 steps = pane - currentPane_;
+        if (steps >= S64(panes_.size())) {
+            for (auto& p : panes_) {
+                p.clear();
+            }
+        } else {
+            for (S64 i = 0; i < steps; ++i) {
+                current_ = (current_ + 1) % panes_.size();
+                panes_[current_].clear();
+            }
+        }
+        currentPane_ = pane;
+    }
+
+};
+
+#endif
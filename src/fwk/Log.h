@@ -0,0 +1,670 @@
+/**
+ * Log writes timestamped lines to standard output for the components of
+ * a program, each with its own level, without formatting or writing on
+ * the thread that logs:
+ *
+ *     const auto tripLog = Log::instance()->componentNew("TripSim");
+ *     ...
+ *     Log::instance()->entryNew(tripLog, Log::info, now, "[", name, "]: ",
+ *         n, " on board. (Expected: ", arrival, ").");
+ *
+ * A line is dropped at once if its level is below its component's. The
+ * arguments are otherwise copied, unformatted, into a fixed-size Record:
+ * strings as their bytes, integers and doubles as their binary values,
+ * and Times as seconds. The record goes on a bounded lock-free queue that
+ * any number of threads can add to, and a background thread formats the
+ * records and writes them out in large batches with write(2). Integers
+ * and strings are formatted as cout would, doubles as std::to_string
+ * would, and Times as timeMilliAsString would, so switching a log line
+ * from string concatenation to arguments doesn't change its text.
+ *
+ * Other output to cout can be routed through the log with
+ * coutCapturedIs(true), so it comes out in the same order as the lines
+ * logged around it. flush waits until everything logged so far is
+ * written, and the log flushes and stops its thread when it is destroyed
+ * at exit. With asyncIs(false), records are formatted on the thread that
+ * logs instead, into the same batched output.
+ */
+
+#ifndef FWK_LOG_H
+#define FWK_LOG_H
+
+class Log : public PtrInterface {
+public:
+
+    enum Level {
+        debug,
+        info,
+        warning,
+        error,
+        off
+    };
+
+    typedef U16 Component;
+
+    /** Components that can be registered. */
+    static const Component maxComponents = 64;
+
+    /** Returned by component for a name that isn't registered. */
+    static const Component noComponent = maxComponents;
+
+
+    /**
+     * Record holds one log line as its component, level, time and
+     * encoded arguments. A string too long for what is left of the record
+     * is copied to the heap and freed when the record is formatted.
+     */
+    class Record {
+    public:
+
+        Record() {
+            // Nothing else to do.
+        }
+
+        template <class... Args>
+        Record(const Component component, const Level level, const Time t, const Args&... args) :
+            time_(t.value()),
+            component_(component),
+            level_(U8(level)),
+            kind_(entryKind)
+        {
+            argsIs(args...);
+        }
+
+        /** Return a record of raw text, which is written as it is. */
+        static Record textNew(const char* const text, const size_t size) {
+            Record r;
+            r.kind_ = textKind;
+            r.size_ = U16(size < sizeof(r.data_) ? size : sizeof(r.data_));
+            std::memcpy(r.data_, text, r.size_);
+            return r;
+        }
+
+        /** The most text a raw text record holds. */
+        static size_t textCapacity() {
+            return sizeof(data_);
+        }
+
+        Component component() const {
+            return component_;
+        }
+
+        Level level() const {
+            return Level(level_);
+        }
+
+        /**
+         * Append the record's line to out, freeing any strings it put on
+         * the heap. A record must be formatted at most once.
+         */
+        void formatted(string& out) const {
+            if (kind_ == textKind) {
+                out.append(data_, size_);
+                return;
+            }
+
+            timeFormatted(out, time_);
+            out += ' ';
+            size_t i = 0;
+            while (i < size_) {
+                const char tag = data_[i++];
+                switch (tag) {
+                    case 's': {
+                        U16 n;
+                        std::memcpy(&n, data_ + i, sizeof(n));
+                        i += sizeof(n);
+                        out.append(data_ + i, n);
+                        i += n;
+                        break;
+                    }
+                    case 'h': {
+                        string* s;
+                        std::memcpy(&s, data_ + i, sizeof(s));
+                        i += sizeof(s);
+                        out += *s;
+                        delete s;
+                        break;
+                    }
+                    case 'c':
+                        out += data_[i++];
+                        break;
+                    case 'i': {
+                        long long v;
+                        std::memcpy(&v, data_ + i, sizeof(v));
+                        i += sizeof(v);
+                        numberFormatted(out, "%lld", v);
+                        break;
+                    }
+                    case 'u': {
+                        unsigned long long v;
+                        std::memcpy(&v, data_ + i, sizeof(v));
+                        i += sizeof(v);
+                        numberFormatted(out, "%llu", v);
+                        break;
+                    }
+                    case 'd': {
+                        double v;
+                        std::memcpy(&v, data_ + i, sizeof(v));
+                        i += sizeof(v);
+                        numberFormatted(out, "%f", v);
+                        break;
+                    }
+                    case 't': {
+                        double v;
+                        std::memcpy(&v, data_ + i, sizeof(v));
+                        i += sizeof(v);
+                        timeFormatted(out, v);
+                        break;
+                    }
+                    default:
+                        i = size_;
+                        break;
+                }
+            }
+            if (truncated_) {
+                out += "...";
+            }
+            out += '\n';
+        }
+
+    private:
+
+        enum Kind {
+            entryKind,
+            textKind
+        };
+
+        double time_ = 0;
+        Component component_ = 0;
+        U8 level_ = 0;
+        U8 kind_ = entryKind;
+        U16 size_ = 0;
+        bool truncated_ = false;
+        char data_[498];
+
+
+        void argsIs() {
+            // Nothing to do.
+        }
+
+        template <class Arg, class... Rest>
+        void argsIs(const Arg& arg, const Rest&... rest) {
+            argIs(arg);
+            argsIs(rest...);
+        }
+
+        bool room(const size_t n) {
+            if (size_ + n <= sizeof(data_)) {
+                return true;
+            }
+
+            truncated_ = true;
+            return false;
+        }
+
+        template <class T>
+        void valueIs(const char tag, const T& v) {
+            if (room(1 + sizeof(v))) {
+                data_[size_++] = tag;
+                std::memcpy(data_ + size_, &v, sizeof(v));
+                size_ += U16(sizeof(v));
+            }
+        }
+
+        void argIs(const char* const s) {
+            bytesIs(s, std::strlen(s));
+        }
+
+        void argIs(const string& s) {
+            bytesIs(s.data(), s.size());
+        }
+
+        void argIs(const char c) {
+            if (room(2)) {
+                data_[size_++] = 'c';
+                data_[size_++] = c;
+            }
+        }
+
+        void argIs(const double v) {
+            valueIs('d', v);
+        }
+
+        void argIs(const Time t) {
+            valueIs('t', t.value());
+        }
+
+        template <class T>
+        typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+        argIs(const T v) {
+            valueIs('i', (long long)(v));
+        }
+
+        template <class T>
+        typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+        argIs(const T v) {
+            valueIs('u', (unsigned long long)(v));
+        }
+
+        void bytesIs(const char* const s, const size_t n) {
+            if (n <= 0xffff && room(1 + sizeof(U16) + n)) {
+                data_[size_++] = 's';
+                const U16 n16 = U16(n);
+                std::memcpy(data_ + size_, &n16, sizeof(n16));
+                size_ += U16(sizeof(n16));
+                std::memcpy(data_ + size_, s, n);
+                size_ += U16(n);
+                return;
+            }
+
+            string* const heap = new string(s, n);
+            if (room(1 + sizeof(heap))) {
+                valueIs('h', heap);
+            } else {
+                delete heap;
+            }
+        }
+
+        template <class T>
+        static void numberFormatted(string& out, const char* const format, const T v) {
+            char buffer[64];
+            const auto n = std::snprintf(buffer, sizeof(buffer), format, v);
+            if (n > 0) {
+                out.append(buffer, size_t(n) < sizeof(buffer) ? size_t(n) : sizeof(buffer) - 1);
+            }
+        }
+
+        static void timeFormatted(string& out, const double t) {
+            static thread_local TimeFormatter formatter;
+            char buffer[32];
+            char* const end = formatter.timeMilliAsBuffer(buffer, buffer + sizeof(buffer), t);
+            if (end != null) {
+                out.append(buffer, size_t(end - buffer));
+            }
+        }
+
+    };
+
+
+    /** Return the log for the process. */
+    static Ptr<Log> instance() {
+        static const Ptr<Log> log = new Log();
+        return log;
+    }
+
+    Log(const Log&) = delete;
+    void operator =(const Log&) = delete;
+
+
+    /**
+     * Return the component with the given name, registering it if it is
+     * new. Components start at level debug, or at the level last set for
+     * every component.
+     */
+    Component componentNew(const string& name) {
+        std::lock_guard<std::mutex> lock(componentMutex_);
+        for (Component c = 0; c < numComponents_; ++c) {
+            if (componentNames_[c] == name) {
+                return c;
+            }
+        }
+
+        if (numComponents_ == maxComponents) {
+            throw RangeException("too many log components: " + name);
+        }
+
+        componentNames_[numComponents_] = name;
+        return numComponents_++;
+    }
+
+    /** Return the component with the given name, or noComponent. */
+    Component component(const string& name) {
+        std::lock_guard<std::mutex> lock(componentMutex_);
+        for (Component c = 0; c < numComponents_; ++c) {
+            if (componentNames_[c] == name) {
+                return c;
+            }
+        }
+
+        return noComponent;
+    }
+
+    Component numComponents() {
+        std::lock_guard<std::mutex> lock(componentMutex_);
+        return numComponents_;
+    }
+
+    string componentName(const Component c) {
+        std::lock_guard<std::mutex> lock(componentMutex_);
+        return c < numComponents_ ? componentNames_[c] : string();
+    }
+
+    /** Return the lowest level the component writes. */
+    Level level(const Component c) const {
+        return c < maxComponents ? Level(levels_[c].load(std::memory_order_relaxed)) : off;
+    }
+
+    void levelIs(const Component c, const Level level) {
+        if (c < maxComponents) {
+            levels_[c].store(U8(level), std::memory_order_relaxed);
+        }
+    }
+
+    /** Modify the level of every component registered so far. */
+    void levelIs(const Level level) {
+        for (Component c = 0; c < maxComponents; ++c) {
+            levelIs(c, level);
+        }
+    }
+
+    /** Return whether a line of the component at level is written. */
+    bool enabled(const Component c, const Level level) const {
+        return level != off && level >= this->level(c);
+    }
+
+    /** Log a line, if its component writes its level. */
+    template <class... Args>
+    void entryNew(const Component c, const Level level, const Time t, const Args&... args) {
+        if (enabled(c, level)) {
+            recordNew(Record(c, level, t, args...));
+        }
+    }
+
+    /** Log a record built earlier, e.g., to write it after a batch. */
+    void recordNew(const Record& record) {
+        if (!async_) {
+            std::lock_guard<std::mutex> lock(syncMutex_);
+            record.formatted(out_);
+            if (out_.size() >= batchBytes) {
+                outWritten();
+            }
+            return;
+        }
+
+        while (!pushed(record)) {
+            std::this_thread::yield();
+        }
+    }
+
+    /** Write text as it is, in order with the lines logged around it. */
+    void textNew(const char* text, size_t size) {
+        const auto capacity = Record::textCapacity();
+        while (size > 0) {
+            const auto n = size < capacity ? size : capacity;
+            recordNew(Record::textNew(text, n));
+            text += n;
+            size -= n;
+        }
+    }
+
+    /** Wait until everything logged so far has been written. */
+    void flush() {
+        if (!async_) {
+            std::lock_guard<std::mutex> lock(syncMutex_);
+            outWritten();
+            return;
+        }
+
+        const auto target = enqueue_.load(std::memory_order_acquire);
+        while (written_.load(std::memory_order_acquire) < target) {
+            wake_.notify_one();
+            std::this_thread::yield();
+        }
+    }
+
+    /** Return whether records are formatted by a background thread. */
+    bool async() const {
+        return async_;
+    }
+
+    /**
+     * Modify whether records are formatted by a background thread. This
+     * must not be called while other threads are logging.
+     */
+    void asyncIs(const bool async) {
+        if (async == async_) {
+            return;
+        }
+
+        if (async) {
+            flush();
+            stopping_ = false;
+            async_ = true;
+            thread_ = std::thread([this]() { drained(); });
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        async_ = false;
+    }
+
+    /** Return whether output to cout goes through the log. */
+    bool coutCaptured() const {
+        return coutBuf_ != null;
+    }
+
+    void coutCapturedIs(const bool captured) {
+        if (captured == coutCaptured()) {
+            return;
+        }
+
+        std::cout.flush();
+        if (captured) {
+            coutBuf_ = new CoutBuf(this);
+            coutPrevious_ = std::cout.rdbuf(coutBuf_);
+            return;
+        }
+
+        std::cout.rdbuf(coutPrevious_);
+        delete coutBuf_;
+        coutBuf_ = null;
+        coutPrevious_ = null;
+    }
+
+private:
+
+    /** Output is written once this much is formatted. */
+    static const size_t batchBytes = 64 * 1024;
+
+    /** Records the queue holds; a power of two. */
+    static const size_t capacity = 2048;
+
+    /**
+     * A streambuf that sends cout's output to the log a line at a time,
+     * so the lines keep their place among the log's. It has no put area,
+     * so every character comes through overflow or xsputn, which lock so
+     * threads writing to cout at once don't corrupt the line.
+     */
+    class CoutBuf : public std::streambuf {
+    public:
+
+        explicit CoutBuf(Log* const log) :
+            log_(log)
+        {
+            // Nothing else to do.
+        }
+
+    protected:
+
+        int overflow(const int c) {
+            if (c != EOF) {
+                const char ch = char(c);
+                xsputn(&ch, 1);
+            }
+            return c == EOF ? 0 : c;
+        }
+
+        std::streamsize xsputn(const char* const s, const std::streamsize n) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::streamsize i = 0; i < n; ++i) {
+                buffer_[size_++] = s[i];
+                if (s[i] == '\n' || size_ == sizeof(buffer_)) {
+                    lineWritten();
+                }
+            }
+            return n;
+        }
+
+        int sync() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            lineWritten();
+            return 0;
+        }
+
+    private:
+
+        Log* const log_;
+        std::mutex mutex_;
+        char buffer_[1024];
+        size_t size_ = 0;
+
+        void lineWritten() {
+            if (size_ > 0) {
+                log_->textNew(buffer_, size_);
+                size_ = 0;
+            }
+        }
+
+    };
+
+    /** A queue slot, whose sequence says whether it is full or free. */
+    struct Slot {
+        std::atomic<U64> sequence;
+        Record record;
+    };
+
+    string componentNames_[maxComponents];
+    std::atomic<U8> levels_[maxComponents];
+    Component numComponents_ = 0;
+    std::mutex componentMutex_;
+
+    bool async_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+    std::mutex wakeMutex_;
+    std::condition_variable wake_;
+
+    /** Formatted output not yet written. */
+    string out_;
+    std::mutex syncMutex_;
+
+    /** The queue, with the next positions to add and remove. */
+    std::vector<Slot> slots_;
+    std::atomic<U64> enqueue_;
+    U64 dequeue_ = 0;
+
+    /** Records before this position have been written. */
+    std::atomic<U64> written_;
+
+    CoutBuf* coutBuf_ = null;
+    std::streambuf* coutPrevious_ = null;
+
+
+    Log() :
+        slots_(capacity),
+        enqueue_(0),
+        written_(0)
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            slots_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        for (auto& level : levels_) {
+            level.store(U8(debug), std::memory_order_relaxed);
+        }
+        out_.reserve(2 * batchBytes);
+    }
+
+    ~Log() {
+        coutCapturedIs(false);
+        asyncIs(false);
+        flush();
+    }
+
+    /**
+     * Add the record to the queue, or return false if it is full. This is
+     * the bounded queue of D. Vyukov, in which producers claim a position
+     * with a compare-and-swap and publish the slot by its sequence.
+     */
+    bool pushed(const Record& record) {
+        auto pos = enqueue_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & (capacity - 1)];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto diff = S64(sequence) - S64(pos);
+            if (diff == 0) {
+                if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.record = record;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /** Remove the next record, or return false if there is none yet. */
+    bool popped(Record& record) {
+        Slot& slot = slots_[dequeue_ & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue_ + 1) {
+            return false;
+        }
+
+        record = slot.record;
+        slot.sequence.store(dequeue_ + capacity, std::memory_order_release);
+        ++dequeue_;
+        return true;
+    }
+
+    /** The background thread: format and write records until stopped. */
+    void drained() {
+        Record record;
+        for (;;) {
+            bool any = false;
+            while (popped(record)) {
+                record.formatted(out_);
+                any = true;
+                if (out_.size() >= batchBytes) {
+                    outWritten();
+                }
+            }
+            outWritten();
+            written_.store(dequeue_, std::memory_order_release);
+
+            std::unique_lock<std::mutex> lock(wakeMutex_);
+            if (stopping_ && dequeue_ == enqueue_.load(std::memory_order_acquire)) {
+                return;
+            }
+            if (!any) {
+                wake_.wait_for(lock, std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    /** Write out the formatted output. */
+    void outWritten() {
+        size_t done = 0;
+        while (done < out_.size()) {
+        #ifdef _WIN32
+            const auto n = _write(1, out_.data() + done, unsigned(out_.size() - done));
+        #else
+            const auto n = ::write(1, out_.data() + done, out_.size() - done);
+        #endif
+            if (n <= 0) {
+                break;
+            }
+            done += size_t(n);
+        }
+        out_.clear();
+    }
+
+};
+
+#endif
@@ -9,22 +9,166 @@
 
 namespace NotifierLib {
 
+    /**
+     * Copy the current notifiees so reactions can connect or disconnect
+     * notifiees without disturbing the delivery loop.
+     */
+    template <class Notifier>
+    std::vector<typename Notifier::Notifiee*> snapshot(
+        const BaseNotifieeList<Notifier>& notifiees
+    ) {
+        std::vector<typename Notifier::Notifiee*> list;
+        list.reserve(notifiees.size());
+        for (const auto n : notifiees) {
+            list.push_back(n);
+        }
+        return list;
+    }
+
+    /**
+     * Call the notifiee now if it delivers immediately, otherwise post
+     * the call to its activity.
+     */
+    template <class Notifiee, class Call>
+    void deliver(Notifiee* const n, const Call& call) {
+        const auto a = n->activity();
+        if (a == null || a->immediateDeliveryFlag()) {
+            const Profiler::Scope scope([n] { return Profiler::typeFrame(typeid(*n)); });
+            try {
+                call();
+            } catch (...) {
+                n->onNotificationException();
+            }
+        } else {
+            a->postingNew(n, call);
+        }
+    }
+
+    /**
+     * Deliver the call to the notifiee, deferring it to the active
+     * EffectBuffer unless it is a notification from the running activity
+     * itself or to a notifiee that belongs to it.
+     */
+    template <class T, class Notifiee, class Call>
+    void notify(T* const notifier, Notifiee* const n, const Call& call) {
+        if (EffectBuffer::current() != null) {
+            const auto current = Activity::current();
+            if (static_cast<const void*>(notifier) != current.ptr() &&
+                n->activity() != current
+            ) {
+                EffectBuffer::effectNew([=]() { deliver(n, call); });
+                return;
+            }
+        }
+
+        deliver(n, call);
+    }
+
+    /**
+     * A waiter is a reaction that runs once, in its own activity, the next
+     * time the notifier posts the notification func. Coroutines use this
+     * to wait for a notification without a notifiee of their own.
+     * Waiters are kept by notification, since a notifier may post as
+     * a subclass of the type the waiter knows it by, and each has an
+     * owner, e.g., a coroutine frame, so it can be removed before then.
+     */
+    template <class Func>
+    struct Waiter {
+        const void* notifier;
+        Func func;
+        Ptr<Activity> activity;
+        Activity::Reaction reaction;
+        const void* owner;
+    };
+
+    /**
+     * The waiters for notifications of type Func, which are shared by all
+     * threads. The count lets a post check for waiters without the lock.
+     */
+    template <class Func>
+    struct WaiterList {
+        std::mutex mutex;
+        std::atomic<size_t> count{0};
+        std::vector< Waiter<Func> > list;
+    };
+
+    template <class Func>
+    WaiterList<Func>& waiters() {
+        static WaiterList<Func> w;
+        return w;
+    }
+
+    template <class Func>
+    void waiterNew(Waiter<Func>&& waiter) {
+        auto& w = waiters<Func>();
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.list.push_back(std::move(waiter));
+        w.count.store(w.list.size(), std::memory_order_relaxed);
+    }
+
+    /** Remove the owner's waiters for notifications of type Func. */
+    template <class Func>
+    void waitersDel(const void* const owner) {
+        auto& w = waiters<Func>();
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.list.erase(
+            std::remove_if(w.list.begin(), w.list.end(),
+                [owner](const Waiter<Func>& waiter) { return waiter.owner == owner; }
+            ),
+            w.list.end()
+        );
+        w.count.store(w.list.size(), std::memory_order_relaxed);
+    }
+
+    /**
+     * Post the reactions of the notifier's waiters for func to their
+     * activities and remove them. A posting to another activity is
+     * deferred to the active EffectBuffer, as notify defers notifications.
+     */
+    template <class T, class Func>
+    void wake(T* const notifier, const Func func) {
+        auto& w = waiters<Func>();
+        if (w.count.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+
+        std::vector< Waiter<Func> > woken;
+        {
+            std::lock_guard<std::mutex> lock(w.mutex);
+            for (auto i = w.list.begin(); i != w.list.end();) {
+                if (i->notifier == static_cast<const void*>(notifier) &&
+                    i->func == func
+                ) {
+                    woken.push_back(std::move(*i));
+                    i = w.list.erase(i);
+                } else {
+                    ++i;
+                }
+            }
+            w.count.store(w.list.size(), std::memory_order_relaxed);
+        }
+
+        for (const auto& waiter : woken) {
+            const auto activity = waiter.activity;
+            const auto reaction = waiter.reaction;
+            if (EffectBuffer::current() != null && activity != Activity::current()) {
+                EffectBuffer::effectNew([activity, reaction]() {
+                    activity->postingNew(null, reaction);
+                });
+            } else {
+                activity->postingNew(null, reaction);
+            }
+        }
+    }
+
     template <class T>
     _noinline
     void post(T* const notifier, void (T::Notifiee::*func)()) {
-        const auto list = notifier->notifiees();
+        const auto list = snapshot(notifier->notifiees());
         for (const auto n : list) {
-            const auto a = n->activity();
-            if (a == null || a->immediateDeliveryFlag()) {
-                try {
-                    (n->*func)();
-                } catch (...) {
-                    n->onNotificationException();
-                }
-            } else {
-                a->postingNew(n, [=]() { (n->*func)(); });
-            }
+            notify(notifier, n, [=]() { (n->*func)(); });
         }
+        wake(notifier, func);
     }
 
     template <class T, typename P1>
@@ -33,19 +177,11 @@ namespace NotifierLib {
         T* const notifier, void (T::Notifiee::*func)(const P1 a1),
         const P1 a1
     ) {
-        const auto list = notifier->notifiees();
+        const auto list = snapshot(notifier->notifiees());
         for (const auto n : list) {
-            const auto a = n->activity();
-            if (a == null || a->immediateDeliveryFlag()) {
-                try {
-                    (n->*func)(a1);
-                } catch (...) {
-                    n->onNotificationException();
-                }
-            } else {
-                a->postingNew(n, [=]() { (n->*func)(a1); });
-            }
+            notify(notifier, n, [=]() { (n->*func)(a1); });
         }
+        wake(notifier, func);
     }
 
     template <class T, typename P1>
@@ -54,19 +190,11 @@ namespace NotifierLib {
         T* const notifier, void (T::Notifiee::*func)(const P1& a1),
         const P1& a1
     ) {
-        const auto list = notifier->notifiees();
+        const auto list = snapshot(notifier->notifiees());
         for (const auto n : list) {
-            const auto a = n->activity();
-            if (a == null || a->immediateDeliveryFlag()) {
-                try {
-                    (n->*func)(a1);
-                } catch (...) {
-                    n->onNotificationException();
-                }
-            } else {
-                a->postingNew(n, [=]() { (n->*func)(a1); });
-            }
+            notify(notifier, n, [=]() { (n->*func)(a1); });
         }
+        wake(notifier, func);
     }
 }
 
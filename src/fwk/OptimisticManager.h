@@ -0,0 +1,826 @@
+/**
+ * OptimisticManager implements ActivityManager with optimistic (Time Warp)
+ * synchronization (D. Jefferson, TOPLAS 1985).
+ *
+ * Activities are partitioned as in ParallelManager, but partitions do not
+ * wait for each other. Each worker thread repeatedly runs the earliest
+ * activity in any of its partitions, speculating that no earlier schedule
+ * will arrive from another partition. Scheduling an activity that belongs
+ * to another partition sends it a message. A message earlier than the
+ * time a partition has reached (a straggler) rolls the partition back.
+ *
+ * Rolling back an activity run undoes it:
+ *
+ *     - State: the run executes with a StateLog active, so every mutator
+ *       that calls StateLog::saved (the SequentialActivity attributes,
+ *       and any model attributes that opt in) is checkpointed
+ *       incrementally and restored.
+ *
+ *     - Schedules in the same partition are removed.
+ *
+ *     - Messages to other partitions are cancelled by anti-messages,
+ *       which may roll those partitions back in turn.
+ *
+ * Runs are ordered as SequentialManager orders them, by time and then by
+ * when they were scheduled. A schedule made by a run is placed by that
+ * run and by its order within the run, which a rolled back run makes
+ * again in the same order, so the order doesn't depend on the number of
+ * workers or on what was rolled back. A straggler rolls back every run
+ * that comes after it in this order, including runs at the same time.
+ *
+ * Workers pause every roundEventCount runs, or once they reach
+ * optimismWindow past the last GVT, to compute global virtual time
+ * (GVT), the earliest time that can still be scheduled. Runs before GVT
+ * can never be rolled back, so they are committed and their checkpoints
+ * are freed. This bounds memory, and verbose output is printed at commit,
+ * so it never shows a run that was rolled back.
+ *
+ * Reactions must only modify state owned by their partition, and every
+ * such modification must be saved in the StateLog. Output written by a
+ * reaction is not undone. Postings to activities that are not delivering
+ * immediately are not checkpointed either. With one worker, the earliest
+ * run of all partitions always runs next, so nothing is ever rolled back.
+ * With any number, the committed runs are those of a sequential run, in
+ * the same order.
+ */
+
+#ifndef FWK_OPTIMISTICMANAGER_H
+#define FWK_OPTIMISTICMANAGER_H
+
+class OptimisticManager : public ActivityManager {
+public:
+
+    static Ptr<ActivityManager> instance() {
+        if (instance_ == null) {
+            instance_ = instanceNew(std::thread::hardware_concurrency());
+        }
+
+        return instance_;
+    }
+
+    /**
+     * Return a new manager with the given number of partitions and one
+     * worker per partition.
+     */
+    static Ptr<OptimisticManager> instanceNew(const unsigned long partitions) {
+        return new OptimisticManager(partitions > 0 ? partitions : 1);
+    }
+
+
+    bool verbose() {
+        return verbose_;
+    }
+
+    void verboseIs(const bool verbose) {
+        verbose_ = verbose;
+    }
+
+
+    /** Return the number of partitions. */
+    unsigned long partitionCount() {
+        return partitions_.size();
+    }
+
+    /** Return the partition of the given activity. */
+    unsigned long partition(const Ptr<Activity>& activity) {
+        return optimistic(activity)->partition_;
+    }
+
+    /**
+     * Move the given activity, which must have nothing scheduled, to the
+     * given partition, e.g., right after creating it.
+     */
+    void partitionIs(const Ptr<Activity>& activity, const unsigned long p) {
+        const auto a = optimistic(activity);
+        StateLog::saved(a->partition_);
+        a->partition_ = p % partitions_.size();
+    }
+
+
+    /** Return the number of worker threads running partitions. */
+    unsigned long workerCount() {
+        return workerCount_;
+    }
+
+    /**
+     * Modify the number of worker threads. With one worker, the partitions
+     * run on the thread that calls nowIs.
+     */
+    _noinline
+    void workerCountIs(const unsigned long workers) {
+        workersDel();
+        workerCount_ = workers > 0 ? workers : 1;
+        if (workerCount_ > 1) {
+            for (unsigned long i = 0; i < workerCount_; ++i) {
+                workers_.push_back(
+                    std::thread(&OptimisticManager::work, this, i, workRound_)
+                );
+            }
+        }
+    }
+
+    /**
+     * Return the number of runs each worker makes between GVT
+     * computations, which bounds how far it can speculate.
+     */
+    unsigned long roundEventCount() {
+        return roundEvents_;
+    }
+
+    /** Modify the number of runs each worker makes between GVT computations. */
+    void roundEventCountIs(const unsigned long events) {
+        roundEvents_ = events > 0 ? events : 1;
+    }
+
+
+    /**
+     * Return how far past GVT a worker may speculate, or zero if it is
+     * only bounded by roundEventCount.
+     */
+    Time optimismWindow() {
+        return window_;
+    }
+
+    /** Modify how far past GVT a worker may speculate. */
+    void optimismWindowIs(const Time window) {
+        window_ = window;
+    }
+
+
+    /** Return the global virtual time as of the last GVT computation. */
+    Time gvt() {
+        return gvt_;
+    }
+
+    /** Return the number of activity runs, including those rolled back. */
+    unsigned long eventCount() {
+        return events_;
+    }
+
+    /** Return the number of activity runs that were rolled back. */
+    unsigned long rollbackCount() {
+        return rollbacks_;
+    }
+
+    /** Return the number of anti-messages sent. */
+    unsigned long antiMessageCount() {
+        return antiMessages_;
+    }
+
+    /** Return the number of activity runs committed. */
+    unsigned long commitCount() {
+        return commits_;
+    }
+
+
+    _noinline
+    Ptr<Activity> activity(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            return i->second;
+        }
+
+        return null;
+    }
+
+    /**
+     * Create a new activity. An activity created by a reaction starts out
+     * in the partition of that reaction, otherwise in partition 0.
+     */
+    _noinline
+    Ptr<Activity> activityNew(const string& name) {
+        const auto p = current();
+        const Ptr<Activity> a = new OptimisticActivity(
+            name, this, p != null ? p->index : 0
+        );
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (activities_[name] != null) {
+            throw NameInUseException(name);
+        }
+
+        activities_[name] = a;
+        StateLog::undoNew([this, name]() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            retire(name);
+        });
+
+        return a;
+    }
+
+    _noinline
+    void activityDel(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            const auto a = i->second;
+            retire(name);
+            StateLog::undoNew([this, name, a]() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                activities_[name] = a;
+            });
+        }
+    }
+
+    /**
+     * Schedule the activity at activity->nextTime(). Each call schedules
+     * one run, as with SequentialManager, and a time that has already
+     * passed is scheduled for the current time.
+     */
+    _noinline
+    void activityAdd(const Ptr<Activity>& activity) {
+        const auto a = optimistic(activity);
+        const auto t = activity->nextTime();
+        const auto p = current();
+
+        if (p == null || p->running == null) {
+            // Not called from a reaction, so nothing to undo.
+            const KeyPtr key(new Key());
+            key->time = std::max(t, now_);
+            key->ranked = false;
+            key->parent.reset(new Key());
+            key->parent->time = now_;
+            key->parent->ranked = true;
+            key->parent->rank = rank_++;
+            key->index = 0;
+            eventNew(partitions_[a->partition_], a, key, 0);
+            return;
+        }
+
+        const KeyPtr key(new Key());
+        key->time = std::max(t, p->now);
+        key->ranked = false;
+        key->parent = p->running->key;
+        key->index = p->runSchedules++;
+
+        if (p->index == a->partition_) {
+            p->running->scheduled.push_back(eventNew(*p, a, key, 0));
+            return;
+        }
+
+        Message m;
+        m.id = (U64(p->index) << 40) | ++p->messages;
+        m.key = key;
+        m.activity = a;
+        m.partition = a->partition_;
+        m.anti = false;
+        p->running->sent.push_back(m);
+        send(m);
+    }
+
+
+    /**
+     * Return the current time, which is the time of the running activity
+     * when called from a reaction.
+     */
+    Time now() {
+        const auto p = current();
+        if (p != null) {
+            return p->now;
+        }
+
+        return now_;
+    }
+
+    /**
+     * Move to the given time, running any scheduled activites with nextTime
+     * less than or equal to given time. Returns once every run up to that
+     * time has been committed.
+     */
+    _noinline
+    void nowIs(const Time& t) {
+        limit_ = t;
+
+        for (;;) {
+            Time next;
+            const auto found = gvtCompute(next);
+            if (!found || next > t) {
+                commit(t, true);
+                break;
+            }
+
+            gvt_ = next;
+            commit(next, false);
+            runRound();
+        }
+
+        gvt_ = t;
+        now_ = t;
+    }
+
+protected:
+
+    /**
+     * SequentialActivity that records its partition.
+     */
+    class OptimisticActivity : public SequentialActivity {
+    public:
+
+        OptimisticActivity(
+            const string& name, const Ptr<ActivityManager>& mgr,
+            const unsigned long partition
+        ) :
+            SequentialActivity(name, mgr),
+            partition_(partition)
+        {
+            // Nothing else to do.
+        }
+
+        unsigned long partition_;
+
+    };
+
+    /**
+     * Place of a run in the order runs are made in: by time, then by the
+     * run that scheduled it, and then by the order of the schedule within
+     * that run. A schedule not made by a run has a parent that stands for
+     * all that came before it. Once a run is committed, its place is
+     * final, so it is ranked and forgets its parent, which keeps chains of
+     * parents as short as the runs that are not yet committed.
+     */
+    struct Key {
+        Time time;
+        bool ranked;
+        U64 rank;
+        std::shared_ptr<Key> parent;
+        U64 index;
+    };
+
+    typedef std::shared_ptr<Key> KeyPtr;
+
+    /**
+     * Whether k1 comes before k2. Runs before GVT are ranked and runs at
+     * or after it are not, so at the same time a ranked key comes first.
+     */
+    static bool before(const Key* k1, const Key* k2) {
+        for (;;) {
+            if (k1 == k2) {
+                return false;
+            }
+            if (k1->time != k2->time) {
+                return k1->time < k2->time;
+            }
+            if (k1->ranked || k2->ranked) {
+                if (k1->ranked && k2->ranked) {
+                    return k1->rank < k2->rank;
+                }
+                return k1->ranked;
+            }
+            if (k1->parent == k2->parent) {
+                return k1->index < k2->index;
+            }
+
+            k1 = k1->parent.get();
+            k2 = k2->parent.get();
+        }
+    }
+
+    /**
+     * Schedule sent to another partition, or the anti-message that
+     * cancels it. This holds a raw pointer so the sender's thread never
+     * touches the reference count of another partition's activity.
+     */
+    struct Message {
+        U64 id;
+        KeyPtr key;
+        OptimisticActivity* activity;
+        unsigned long partition;
+        bool anti;
+    };
+
+    typedef std::vector<Message> MessageVector;
+
+    /**
+     * One scheduled run of an activity. Once it has run, it holds what is
+     * needed to undo the run until the run is committed.
+     */
+    struct Event {
+        Time time;
+        KeyPtr key;
+        U64 serial;
+        Ptr<OptimisticActivity> activity;
+
+        /** Id of the message that scheduled it, or 0 if it was local. */
+        U64 message;
+
+        bool processed = false;
+        StateLog log;
+        std::vector<Event*> scheduled;
+        MessageVector sent;
+    };
+
+    class Earlier {
+    public:
+
+        bool operator()(const Event* e1, const Event* e2) const {
+            if (e1->key != e2->key) {
+                return before(e1->key.get(), e2->key.get());
+            }
+
+            return e1->serial < e2->serial;
+        }
+
+    };
+
+    typedef std::set<Event*, Earlier> EventSet;
+
+    struct Partition {
+        unsigned long index;
+        OptimisticManager* manager;
+        EventSet pending;
+
+        /** Runs not yet committed, in the order they ran. */
+        std::deque<Event*> processed;
+
+        /** Events scheduled by messages, by message id. */
+        std::unordered_map<U64, Event*> received;
+
+        /** Time of the last run, and of the last committed run. */
+        Time now;
+        Time floor;
+
+        /** Schedules made so far by the running event. */
+        U64 runSchedules = 0;
+
+        /** Counters for event serials and message ids, never restored. */
+        U64 serial = 0;
+        U64 messages = 0;
+
+        Event* running = null;
+
+        std::mutex inboxMutex;
+        MessageVector inbox;
+    };
+
+    typedef std::unordered_map< string, Ptr<Activity> > ActivityMap;
+
+
+    /** Partition running on this thread, if any. */
+    static thread_local Partition* current_;
+
+    bool verbose_;
+    Time now_;
+    Time limit_;
+    Time gvt_;
+    Time window_;
+    unsigned long roundEvents_;
+    std::atomic<unsigned long> events_;
+    std::atomic<unsigned long> rollbacks_;
+    std::atomic<unsigned long> antiMessages_;
+    unsigned long commits_;
+    U64 rank_;
+    std::vector<Partition> partitions_;
+
+    /** Guards activities_ and retired_. */
+    std::mutex mutex_;
+    ActivityMap activities_;
+
+    /**
+     * Activities removed from activities_ since the last commit. Messages
+     * in transit may still point to them, so they are released at commit.
+     */
+    std::vector< Ptr<Activity> > retired_;
+
+    unsigned long workerCount_;
+    std::vector<std::thread> workers_;
+    std::mutex workMutex_;
+    std::condition_variable workStart_;
+    std::condition_variable workDone_;
+    U64 workRound_;
+    unsigned long workRunning_;
+    bool workStopping_;
+
+
+    OptimisticManager(const unsigned long partitions) :
+        verbose_(false),
+        now_(0.0),
+        limit_(0.0),
+        gvt_(0.0),
+        window_(0.0),
+        roundEvents_(1000),
+        events_(0),
+        rollbacks_(0),
+        antiMessages_(0),
+        commits_(0),
+        rank_(0),
+        partitions_(partitions),
+        workerCount_(1),
+        workRound_(0),
+        workRunning_(0),
+        workStopping_(false)
+    {
+        for (unsigned long i = 0; i < partitions; ++i) {
+            partitions_[i].index = i;
+            partitions_[i].manager = this;
+        }
+
+        workerCountIs(partitions);
+    }
+
+    ~OptimisticManager() {
+        workersDel();
+
+        for (auto& p : partitions_) {
+            for (const auto e : p.pending) {
+                delete e;
+            }
+            for (const auto e : p.processed) {
+                delete e;
+            }
+        }
+    }
+
+
+    Partition* current() {
+        const auto p = current_;
+        if (p != null && p->manager == this) {
+            return p;
+        }
+
+        return null;
+    }
+
+    static OptimisticActivity* optimistic(const Ptr<Activity>& activity) {
+        return static_cast<OptimisticActivity*>(activity.ptr());
+    }
+
+    void retire(const string& name) {
+        const auto i = activities_.find(name);
+        retired_.push_back(i->second);
+        activities_.erase(i);
+    }
+
+    Event* eventNew(
+        Partition& p, OptimisticActivity* const a, const KeyPtr& key, const U64 message
+    ) {
+        const auto e = new Event();
+        e->time = key->time;
+        e->key = key;
+        e->serial = p.serial++;
+        e->activity = a;
+        e->message = message;
+        p.pending.insert(e);
+        return e;
+    }
+
+    void send(const Message& m) {
+        auto& p = partitions_[m.partition];
+        std::lock_guard<std::mutex> lock(p.inboxMutex);
+        p.inbox.push_back(m);
+    }
+
+    /**
+     * Run the event, with its log active so the run can be undone.
+     */
+    void process(Partition& p, Event* const e) {
+        p.pending.erase(e);
+        p.processed.push_back(e);
+        e->processed = true;
+        p.now = e->time;
+        p.running = e;
+        p.runSchedules = 0;
+        ++events_;
+
+        current_ = &p;
+        StateLog::currentIs(&e->log);
+
+        e->activity->statusIs(Activity::running);
+
+        StateLog::currentIs(null);
+        current_ = null;
+        p.running = null;
+    }
+
+    /**
+     * Undo the partition's latest run and put it back in the queue.
+     */
+    void undo(Partition& p) {
+        const auto e = p.processed.back();
+        p.processed.pop_back();
+
+        e->log.undoAll();
+
+        // Runs it scheduled come after it, so they are already undone.
+        for (auto i = e->scheduled.rbegin(); i != e->scheduled.rend(); ++i) {
+            p.pending.erase(*i);
+            delete *i;
+        }
+        e->scheduled.clear();
+
+        for (auto m : e->sent) {
+            m.anti = true;
+            send(m);
+            ++antiMessages_;
+        }
+        e->sent.clear();
+
+        e->processed = false;
+        p.pending.insert(e);
+        p.now = p.processed.empty() ? p.floor : p.processed.back()->time;
+        ++rollbacks_;
+    }
+
+    void receive(Partition& p, const Message& m) {
+        if (!m.anti) {
+            const auto e = eventNew(p, m.activity, m.key, m.id);
+            while (!p.processed.empty() && Earlier()(e, p.processed.back())) {
+                undo(p);
+            }
+
+            p.received[m.id] = e;
+            return;
+        }
+
+        const auto i = p.received.find(m.id);
+        const auto e = i->second;
+        p.received.erase(i);
+
+        while (e->processed) {
+            undo(p);
+        }
+
+        p.pending.erase(e);
+        delete e;
+    }
+
+    void drain(Partition& p) {
+        MessageVector messages;
+        {
+            std::lock_guard<std::mutex> lock(p.inboxMutex);
+            messages.swap(p.inbox);
+        }
+
+        for (const auto& m : messages) {
+            receive(p, m);
+        }
+    }
+
+    /**
+     * With the workers paused, deliver every message in transit and
+     * return the earliest scheduled time in t, or false if nothing is
+     * scheduled.
+     */
+    bool gvtCompute(Time& t) {
+        for (auto delivered = true; delivered; ) {
+            delivered = false;
+            for (auto& p : partitions_) {
+                if (!p.inbox.empty()) {
+                    drain(p);
+                    delivered = true;
+                }
+            }
+        }
+
+        auto found = false;
+        for (auto& p : partitions_) {
+            if (!p.pending.empty()) {
+                const auto next = (*p.pending.begin())->time;
+                if (!found || next < t) {
+                    t = next;
+                    found = true;
+                }
+            }
+        }
+
+        return found;
+    }
+
+    /**
+     * Commit the runs before time t, or at it too if atT, which can no
+     * longer be rolled back, rank them in the order they were made, and
+     * free their checkpoints.
+     */
+    void commit(const Time t, const bool atT) {
+        std::vector<Event*> committed;
+        for (auto& p : partitions_) {
+            while (!p.processed.empty() &&
+                (p.processed.front()->time < t || (atT && p.processed.front()->time == t))
+            ) {
+                const auto e = p.processed.front();
+                p.processed.pop_front();
+                p.floor = e->time;
+                if (e->message != 0) {
+                    p.received.erase(e->message);
+                }
+                committed.push_back(e);
+            }
+        }
+
+        std::sort(committed.begin(), committed.end(), Earlier());
+        for (const auto e : committed) {
+            e->key->ranked = true;
+            e->key->rank = rank_++;
+            e->key->parent.reset();
+        }
+
+        if (verbose_) {
+            for (const auto e : committed) {
+                std::cout << timeAsString(e->time) << " ";
+                std::cout << "Activity: " << e->activity->name();
+                std::cout << " (partition " << e->activity->partition_ << ")";
+                std::cout << std::endl;
+            }
+        }
+
+        commits_ += committed.size();
+        for (const auto e : committed) {
+            delete e;
+        }
+
+        retired_.clear();
+    }
+
+    void runRound() {
+        if (workers_.empty()) {
+            round(0);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(workMutex_);
+        workRunning_ = workers_.size();
+        ++workRound_;
+        workStart_.notify_all();
+        workDone_.wait(lock, [this]() { return workRunning_ == 0; });
+    }
+
+    /**
+     * Make up to roundEventCount runs in the partitions of worker i,
+     * always running the earliest of them next.
+     */
+    void round(const unsigned long i) {
+        auto limit = limit_;
+        if (window_ > 0 && gvt_ + window_ < limit) {
+            limit = gvt_ + window_;
+        }
+
+        for (unsigned long n = 0; n < roundEvents_; ++n) {
+            Partition* next = null;
+            for (auto j = i; j < partitions_.size(); j += workerCount_) {
+                auto& p = partitions_[j];
+                drain(p);
+                if (p.pending.empty()) {
+                    continue;
+                }
+
+                const auto e = *p.pending.begin();
+                if (e->time <= limit &&
+                    (next == null || Earlier()(e, *next->pending.begin()))
+                ) {
+                    next = &p;
+                }
+            }
+
+            if (next == null) {
+                break;
+            }
+
+            process(*next, *next->pending.begin());
+        }
+    }
+
+    /**
+     * Worker thread loop: run a round for partitions i, i + workers,
+     * i + 2 * workers, ... after the given one.
+     */
+    void work(const unsigned long i, U64 round) {
+        std::unique_lock<std::mutex> lock(workMutex_);
+        for (;;) {
+            workStart_.wait(lock, [&]() {
+                return workRound_ != round || workStopping_;
+            });
+            if (workStopping_) {
+                return;
+            }
+
+            round = workRound_;
+            lock.unlock();
+            this->round(i);
+            lock.lock();
+
+            if (--workRunning_ == 0) {
+                workDone_.notify_one();
+            }
+        }
+    }
+
+    void workersDel() {
+        {
+            std::lock_guard<std::mutex> lock(workMutex_);
+            workStopping_ = true;
+        }
+        workStart_.notify_all();
+
+        for (auto& w : workers_) {
+            w.join();
+        }
+
+        workers_.clear();
+        workStopping_ = false;
+    }
+
+};
+
+thread_local OptimisticManager::Partition* OptimisticManager::current_ = null;
+
+#endif
@@ -0,0 +1,790 @@
+/**
+ * ParallelManager implements ActivityManager by partitioning activities
+ * across worker threads and advancing virtual time in conservative
+ * windows (YAWNS).
+ *
+ * Each activity belongs to one partition, and each partition keeps its own
+ * queue ordered by time and then by the order activities were scheduled,
+ * which is numbered across all partitions. As in SequentialManager, an
+ * activity scheduled for a time that has already passed runs at the
+ * current time, after the activities already due then.
+ *
+ * With one worker, the partitions' queues are merged and activities run
+ * one at a time in exactly the order SequentialManager runs them.
+ *
+ * With more, time advances in windows: if T is the earliest scheduled time
+ * in any partition, every partition runs its activities scheduled before
+ * T + lookahead, in parallel, and then all partitions synchronize. The
+ * lookahead is the model's promise that a reaction running at time t only
+ * affects another partition at time t + lookahead or later. It must be
+ * the real minimum delay, which is zero when one partition can schedule
+ * another for the current time, and with a lookahead of zero a window only
+ * holds the activities scheduled at the same time. The only effect the
+ * manager sees is scheduling an activity that belongs to another partition,
+ * which is held in a per-partition outbox and delivered when the window
+ * ends. Reactions must not otherwise touch state owned by another
+ * partition during a window.
+ *
+ * A cross-partition schedule that lands inside the current window would
+ * run after its partition has moved past it, so nowIs throws a
+ * LookaheadException at the end of that window instead of running it,
+ * and the run can't go on.
+ *
+ * Each schedule made during a window is numbered when it is made by the
+ * run that made it, and the numbers are made global at the end of the
+ * window in the order SequentialManager would have made them: by the
+ * time and number of the run, then by the order within the run. Under
+ * the promise, the result is therefore the same as SequentialManager's,
+ * whatever the number of workers.
+ *
+ * A new manager has one worker; workerCountIs adds more.
+ */
+
+#ifndef FWK_PARALLELMANAGER_H
+#define FWK_PARALLELMANAGER_H
+
+class ParallelManager : public ActivityManager {
+public:
+
+    static Ptr<ActivityManager> instance() {
+        if (instance_ == null) {
+            instance_ = instanceNew(std::thread::hardware_concurrency());
+        }
+
+        return instance_;
+    }
+
+    /**
+     * Return a new manager with the given number of partitions and one
+     * worker.
+     */
+    static Ptr<ParallelManager> instanceNew(const unsigned long partitions) {
+        return new ParallelManager(partitions > 0 ? partitions : 1);
+    }
+
+
+    bool verbose() {
+        return verbose_;
+    }
+
+    void verboseIs(const bool verbose) {
+        verbose_ = verbose;
+    }
+
+
+    /** Return the number of partitions. */
+    unsigned long partitionCount() {
+        return partitions_.size();
+    }
+
+    /** Return the partition of the given activity. */
+    unsigned long partition(const Ptr<Activity>& activity) {
+        return parallel(activity)->partition_;
+    }
+
+    /**
+     * Move the given activity to the given partition, along with its
+     * schedule if it is scheduled. Called from a reaction, the move
+     * reaches the new partition at the end of the window, like any other
+     * cross-partition schedule.
+     */
+    _noinline
+    void partitionIs(const Ptr<Activity>& activity, const unsigned long p) {
+        const auto a = parallel(activity);
+        const auto partition = p % partitions_.size();
+        if (a->partition_ == partition) {
+            return;
+        }
+
+        const auto scheduled = a->queued_;
+        const auto t = a->queuedTime_;
+        a->queued_ = false;
+        ++a->generation_;
+        a->partition_ = partition;
+
+        if (scheduled) {
+            schedule(a, t);
+        }
+    }
+
+
+    /** Return the lookahead used to size each window. */
+    Time lookahead() {
+        return lookahead_;
+    }
+
+    /** Modify the lookahead used to size each window. */
+    void lookaheadIs(const Time lookahead) {
+        lookahead_ = lookahead;
+    }
+
+
+    /** Return the number of worker threads running partitions. */
+    unsigned long workerCount() {
+        return workerCount_;
+    }
+
+    /**
+     * Modify the number of worker threads. With one worker, the partitions
+     * run on the thread that calls nowIs.
+     */
+    _noinline
+    void workerCountIs(const unsigned long workers) {
+        workersDel();
+        workerCount_ = workers > 0 ? workers : 1;
+        if (workerCount_ > 1) {
+            for (unsigned long i = 0; i < workerCount_; ++i) {
+                workers_.push_back(
+                    std::thread(&ParallelManager::work, this, i, workWindow_)
+                );
+            }
+        }
+    }
+
+
+    /** Return the number of windows run so far. */
+    unsigned long windowCount() {
+        return windowCount_;
+    }
+
+    /**
+     * Return the number of activity runs so far, which is only up to date
+     * between calls to nowIs.
+     */
+    U64 runCount() {
+        U64 runs = 0;
+        for (const auto& p : partitions_) {
+            runs += p.runs;
+        }
+        return runs;
+    }
+
+
+    _noinline
+    Ptr<Activity> activity(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            return i->second;
+        }
+
+        return null;
+    }
+
+    /**
+     * Create a new activity. An activity created by a reaction starts out
+     * in the partition of that reaction, otherwise in partition 0.
+     */
+    _noinline
+    Ptr<Activity> activityNew(const string& name) {
+        const auto p = current();
+        const Ptr<Activity> a = new ParallelActivity(
+            name, this, p != null ? p->index : 0
+        );
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (activities_[name] != null) {
+            throw NameInUseException(name);
+        }
+
+        activities_[name] = a;
+
+        return a;
+    }
+
+    _noinline
+    void activityDel(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto i = activities_.find(name);
+        if (i != activities_.end()) {
+            activities_.erase(i);
+        }
+    }
+
+    /**
+     * Schedule the activity at activity->nextTime(), moving it
+     * if it is already scheduled.
+     */
+    _noinline
+    void activityAdd(const Ptr<Activity>& activity) {
+        schedule(parallel(activity), activity->nextTime());
+    }
+
+
+    /**
+     * Return the current time, which is the time of the running activity
+     * when called from a reaction.
+     */
+    Time now() {
+        const auto p = current();
+        if (p != null) {
+            return p->now;
+        }
+
+        return now_;
+    }
+
+    /**
+     * Move to the given time, running any scheduled activites with nextTime
+     * less than or equal to given time, one at a time with one worker and
+     * one window at a time with more.
+     */
+    _noinline
+    void nowIs(const Time& t) {
+        if (workers_.empty()) {
+            runInOrder(t);
+            now_ = t;
+            return;
+        }
+
+        for (;;) {
+            deliverOutboxes();
+
+            Time start;
+            if (!nextTime(start) || start > t) {
+                // Finished running everything before or at time t.
+                break;
+            }
+
+            if (start > now_) {
+                now_ = start;
+            }
+
+            windowStart_ = start;
+            windowEnd_ = start + lookahead_;
+            windowLimit_ = t;
+            windowSequence_ = sequence_;
+            ++windowCount_;
+
+            runWindow();
+            if (lookaheadViolation_) {
+                throw LookaheadException(
+                    "Cross-partition schedule for " + timeAsString(lookaheadViolationTime_) +
+                    " lands inside the window ending at " + timeAsString(windowEnd_)
+                );
+            }
+        }
+
+        //
+        // Move the time up to specified time in case the last scheduled
+        // activity ran before t and the next one runs after t.
+        //
+        now_ = t;
+    }
+
+protected:
+
+    /**
+     * SequentialActivity that records its partition and its place
+     * in that partition's queue.
+     */
+    class ParallelActivity : public SequentialActivity {
+    public:
+
+        ParallelActivity(
+            const string& name, const Ptr<ActivityManager>& mgr,
+            const unsigned long partition
+        ) :
+            SequentialActivity(name, mgr),
+            partition_(partition),
+            queued_(false),
+            queuedTime_(0.0),
+            generation_(0)
+        {
+            // Nothing else to do.
+        }
+
+        unsigned long partition_;
+
+        /** Whether the activity is in a queue, at what time, and the
+         * generation of the queue entry that is still current. */
+        bool queued_;
+        Time queuedTime_;
+        U64 generation_;
+
+    };
+
+    /**
+     * Queue entry. An activity that is scheduled again gets a new entry
+     * and a new generation, and entries of older generations are skipped.
+     */
+    struct Entry {
+        Time time;
+        U64 sequence;
+        U64 generation;
+        Ptr<ParallelActivity> activity;
+    };
+
+    class Later {
+    public:
+
+        bool operator()(const Entry& e1, const Entry& e2) const {
+            if (e1.time != e2.time) {
+                return e1.time > e2.time;
+            }
+
+            return e1.sequence > e2.sequence;
+        }
+
+    };
+
+    /**
+     * Cross-partition schedule. This holds a raw pointer so the sender's
+     * thread never touches the reference count of another partition's
+     * activity, and the index of its schedule in the sender's made.
+     */
+    struct Message {
+        Message(ParallelActivity* const a, const Time t, const size_t m) :
+            activity(a),
+            time(t),
+            made(m)
+        {
+            // Nothing else to do.
+        }
+
+        ParallelActivity* activity;
+        Time time;
+        size_t made;
+    };
+
+    typedef std::vector<Message> MessageVector;
+
+    /**
+     * Schedule made during a window by the run of the partition at time
+     * runTime: the index-th schedule of that run. The run's own number is
+     * runSequence if it was scheduled before the window, and otherwise
+     * that of the schedule at runMade in the same partition. sequence is
+     * the global number, once the window is over.
+     */
+    struct Made {
+        Time runTime;
+        U64 runSequence;
+        size_t runMade;
+        bool runInWindow;
+        U64 index;
+        U64 sequence;
+    };
+
+    struct Partition {
+        unsigned long index;
+        ParallelManager* manager;
+        std::vector<Entry> queue;
+        U64 runs = 0;
+        Time now;
+
+        /** The running entry's number and its schedules so far. */
+        U64 runSequence = 0;
+        U64 runSchedules = 0;
+
+        /**
+         * Schedules made in this window. Until the window is over, the
+         * entries they added to this partition's queue are numbered
+         * windowSequence_ plus their index here.
+         */
+        std::vector<Made> made;
+
+        /** Schedules for each other partition made in this window. */
+        std::vector<MessageVector> outbox;
+    };
+
+    typedef std::unordered_map< string, Ptr<Activity> > ActivityMap;
+
+
+    /** Partition whose window is running on this thread, if any. */
+    static thread_local Partition* current_;
+
+    bool verbose_;
+    Time now_;
+    Time lookahead_;
+    Time windowStart_;
+    Time windowEnd_;
+    Time windowLimit_;
+    unsigned long windowCount_;
+    U64 sequence_;
+
+    /** The first number of the schedules made in the current window. */
+    U64 windowSequence_;
+    std::vector<Partition> partitions_;
+
+    /** Guards the first lookahead violation of the window. */
+    std::mutex violationMutex_;
+    bool lookaheadViolation_;
+    Time lookaheadViolationTime_;
+
+    /** Guards activities_ and verbose output. */
+    std::mutex mutex_;
+    ActivityMap activities_;
+
+    unsigned long workerCount_;
+    std::vector<std::thread> workers_;
+    std::mutex workMutex_;
+    std::condition_variable workStart_;
+    std::condition_variable workDone_;
+    U64 workWindow_;
+    unsigned long workRunning_;
+    bool workStopping_;
+
+
+    ParallelManager(const unsigned long partitions) :
+        verbose_(false),
+        now_(0.0),
+        lookahead_(0.0),
+        windowCount_(0),
+        sequence_(0),
+        windowSequence_(0),
+        partitions_(partitions),
+        lookaheadViolation_(false),
+        workerCount_(1),
+        workWindow_(0),
+        workRunning_(0),
+        workStopping_(false)
+    {
+        for (unsigned long i = 0; i < partitions; ++i) {
+            partitions_[i].index = i;
+            partitions_[i].manager = this;
+            partitions_[i].outbox.resize(partitions);
+        }
+    }
+
+    ~ParallelManager() {
+        workersDel();
+    }
+
+
+    Partition* current() {
+        const auto p = current_;
+        if (p != null && p->manager == this) {
+            return p;
+        }
+
+        return null;
+    }
+
+    static ParallelActivity* parallel(const Ptr<Activity>& activity) {
+        return static_cast<ParallelActivity*>(activity.ptr());
+    }
+
+    /**
+     * Schedule the activity at the given time, directly if only one thread
+     * runs partitions or none is running. Otherwise the schedule is
+     * numbered within the window, and queued directly if the activity is
+     * in the partition that is running on this thread and through this
+     * partition's outbox if not.
+     */
+    void schedule(ParallelActivity* const a, const Time t) {
+        const auto p = current();
+        if (p == null || workers_.empty()) {
+            enqueue(a, t, sequence_++);
+            return;
+        }
+
+        const auto m = madeNew(*p);
+        if (p->index == a->partition_) {
+            enqueue(a, t, windowSequence_ + m);
+            return;
+        }
+
+        if (std::max(t, p->now) < windowEnd_) {
+            std::lock_guard<std::mutex> lock(violationMutex_);
+            if (!lookaheadViolation_) {
+                lookaheadViolation_ = true;
+                lookaheadViolationTime_ = t;
+            }
+        }
+
+        p->outbox[a->partition_].push_back(Message(a, t, m));
+    }
+
+    /**
+     * Record a schedule by the partition's running entry and return its
+     * index in the partition's made.
+     */
+    size_t madeNew(Partition& p) {
+        Made m;
+        m.runTime = p.now;
+        m.runInWindow = p.runSequence >= windowSequence_;
+        m.runSequence = p.runSequence;
+        m.runMade = m.runInWindow ? size_t(p.runSequence - windowSequence_) : 0;
+        m.index = p.runSchedules++;
+        m.sequence = 0;
+        p.made.push_back(m);
+        return p.made.size() - 1;
+    }
+
+    /**
+     * Add a queue entry for the activity. A time that has already passed
+     * is queued as the current time, so the activity runs after those
+     * already due, as it would under SequentialManager.
+     */
+    void enqueue(ParallelActivity* const a, const Time t, const U64 sequence) {
+        auto& p = partitions_[a->partition_];
+
+        a->queued_ = true;
+        a->queuedTime_ = t;
+        ++a->generation_;
+
+        Entry e;
+        e.time = std::max(t, now());
+        e.sequence = sequence;
+        a->sequenceIs(e.sequence);
+        e.generation = a->generation_;
+        e.activity = a;
+        p.queue.push_back(e);
+        std::push_heap(p.queue.begin(), p.queue.end(), Later());
+    }
+
+    /**
+     * Return the earliest current entry in the partition's queue, dropping
+     * entries that were superseded, or null if there are none.
+     */
+    static const Entry* front(Partition& p) {
+        while (!p.queue.empty()) {
+            const auto& e = p.queue.front();
+            if (e.activity->queued_ && e.generation == e.activity->generation_) {
+                return &e;
+            }
+
+            std::pop_heap(p.queue.begin(), p.queue.end(), Later());
+            p.queue.pop_back();
+        }
+
+        return null;
+    }
+
+    bool nextTime(Time& t) {
+        auto found = false;
+        for (auto& p : partitions_) {
+            const auto e = front(p);
+            if (e != null && (!found || e->time < t)) {
+                t = e->time;
+                found = true;
+            }
+        }
+
+        return found;
+    }
+
+    /**
+     * Whether schedule x of partition px was made before schedule y of
+     * partition py under SequentialManager: by an earlier run, or by the
+     * same run and earlier in it. Runs are ordered by time and number,
+     * and the number of a run scheduled in the window is that of its
+     * schedule.
+     */
+    bool madeBefore(
+        const unsigned long px, const Made& x, const unsigned long py, const Made& y
+    ) {
+        if (x.runTime != y.runTime) {
+            return x.runTime < y.runTime;
+        }
+        if (x.runInWindow != y.runInWindow) {
+            return y.runInWindow;
+        }
+        if (!x.runInWindow) {
+            if (x.runSequence != y.runSequence) {
+                return x.runSequence < y.runSequence;
+            }
+        } else if (px != py || x.runMade != y.runMade) {
+            return madeBefore(
+                px, partitions_[px].made[x.runMade], py, partitions_[py].made[y.runMade]
+            );
+        }
+
+        return x.index < y.index;
+    }
+
+    /**
+     * Number the schedules made in the window in the order they would
+     * have been made one at a time, renumber the queue entries they added,
+     * and deliver the schedules held in the outboxes.
+     */
+    void deliverOutboxes() {
+        if (std::all_of(partitions_.begin(), partitions_.end(),
+            [](const Partition& p) { return p.made.empty(); }
+        )) {
+            return;
+        }
+
+        typedef std::pair<unsigned long, size_t> MadeRef;
+        std::vector<MadeRef> made;
+        for (auto& p : partitions_) {
+            for (size_t i = 0; i < p.made.size(); ++i) {
+                made.push_back(MadeRef(p.index, i));
+            }
+        }
+        std::sort(made.begin(), made.end(), [this](const MadeRef& x, const MadeRef& y) {
+            return madeBefore(
+                x.first, partitions_[x.first].made[x.second],
+                y.first, partitions_[y.first].made[y.second]
+            );
+        });
+        for (const auto& m : made) {
+            partitions_[m.first].made[m.second].sequence = sequence_++;
+        }
+
+        // Renumbering keeps the order of each queue's entries, so the
+        // queue stays a heap.
+        for (auto& p : partitions_) {
+            for (auto& e : p.queue) {
+                if (e.sequence >= windowSequence_) {
+                    e.sequence = p.made[e.sequence - windowSequence_].sequence;
+                    if (e.generation == e.activity->generation_) {
+                        e.activity->sequenceIs(e.sequence);
+                    }
+                }
+            }
+        }
+
+        for (auto& p : partitions_) {
+            for (auto& messages : p.outbox) {
+                for (const auto& m : messages) {
+                    enqueue(m.activity, m.time, p.made[m.made].sequence);
+                }
+                messages.clear();
+            }
+        }
+
+        for (auto& p : partitions_) {
+            p.made.clear();
+        }
+    }
+
+    void runWindow() {
+        if (workers_.empty()) {
+            for (auto& p : partitions_) {
+                run(p);
+            }
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(workMutex_);
+        workRunning_ = workers_.size();
+        ++workWindow_;
+        workStart_.notify_all();
+        workDone_.wait(lock, [this]() { return workRunning_ == 0; });
+    }
+
+    /**
+     * Run the activities scheduled up to time t one at a time, taking the
+     * earliest entry of any partition each time, which is the order
+     * SequentialManager runs them in.
+     */
+    void runInOrder(const Time& t) {
+        for (;;) {
+            Partition* next = null;
+            const Entry* first = null;
+            for (auto& p : partitions_) {
+                const auto e = front(p);
+                if (e != null && (first == null || Later()(*first, *e))) {
+                    first = e;
+                    next = &p;
+                }
+            }
+
+            if (first == null || first->time > t) {
+                break;
+            }
+
+            if (first->time > now_) {
+                now_ = first->time;
+            }
+
+            current_ = next;
+            next->now = now_;
+            frontRun(*next);
+            current_ = null;
+        }
+    }
+
+    /**
+     * Run the partition's activities that fall in the current window.
+     */
+    void run(Partition& p) {
+        current_ = &p;
+        p.now = now_;
+
+        for (;;) {
+            const auto e = front(p);
+            if (e == null || e->time > windowLimit_ ||
+                (e->time >= windowEnd_ && e->time > windowStart_)
+            ) {
+                break;
+            }
+
+            if (e->time > p.now) {
+                p.now = e->time;
+            }
+            frontRun(p);
+        }
+
+        current_ = null;
+    }
+
+    /** Run the activity at the front of the partition's queue. */
+    void frontRun(Partition& p) {
+        const Ptr<ParallelActivity> a = p.queue.front().activity;
+        p.runSequence = p.queue.front().sequence;
+        p.runSchedules = 0;
+        std::pop_heap(p.queue.begin(), p.queue.end(), Later());
+        p.queue.pop_back();
+        a->queued_ = false;
+
+        if (verbose_) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::cout << timeAsString(p.now) << " ";
+            std::cout << "Activity: " << a->name();
+            std::cout << " (partition " << p.index;
+            std::cout << ", sequence " << a->sequence() << ")" << std::endl;
+        }
+
+        ++p.runs;
+        a->statusIs(Activity::running);
+    }
+
+    /**
+     * Worker thread loop: run partitions i, i + workers, i + 2 * workers,
+     * ... each window after the given one.
+     */
+    void work(const unsigned long i, U64 window) {
+        std::unique_lock<std::mutex> lock(workMutex_);
+        for (;;) {
+            workStart_.wait(lock, [&]() {
+                return workWindow_ != window || workStopping_;
+            });
+            if (workStopping_) {
+                return;
+            }
+
+            window = workWindow_;
+            lock.unlock();
+            for (auto p = i; p < partitions_.size(); p += workerCount_) {
+                run(partitions_[p]);
+            }
+            lock.lock();
+
+            if (--workRunning_ == 0) {
+                workDone_.notify_one();
+            }
+        }
+    }
+
+    void workersDel() {
+        {
+            std::lock_guard<std::mutex> lock(workMutex_);
+            workStopping_ = true;
+        }
+        workStart_.notify_all();
+
+        for (auto& w : workers_) {
+            w.join();
+        }
+
+        workers_.clear();
+        workStopping_ = false;
+    }
+
+};
+
+thread_local ParallelManager::Partition* ParallelManager::current_ = null;
+
+#endif
@@ -0,0 +1,457 @@
+/**
+ * Profiler attributes wall time, postings delivered and allocations to
+ * the activities that run and to the types of the reactors they deliver
+ * to, as a call tree of frames:
+ *
+ *     [trip#Sim];TripSim                     a run of a trip's activity
+ *                                            delivering a posting to a
+ *                                            TripSim
+ *     [ServiceSim];ServiceSim::TripTracker   a reaction to a notification
+ *                                            delivered immediately
+ *
+ * SequentialActivity opens a frame for each run of an activity and for
+ * each posting it delivers, and NotifierLib opens one for each
+ * notification it delivers immediately, so every manager is covered.
+ * Activities' frames are their names in brackets, with digits grouped as
+ * '#', so the runs of trip12Sim and trip13Sim add up in [trip#Sim]. A
+ * frame's postings are those delivered to a reactor, or during an
+ * activity's runs.
+ *
+ * Profiling is off until enabledIs(true), and while it is off a frame
+ * costs a relaxed load and a branch. Each thread keeps its own call tree,
+ * so recording takes no locks. foldedStacksWritten writes the merged trees
+ * in the folded-stacks format flamegraph.pl and speedscope read, and
+ * reportWritten writes a table of the frames that take the most time.
+ * Both read every thread's tree, so they belong at shutdown, after the
+ * activities have stopped running.
+ *
+ * Allocations are counted by the replacement operator new that fwk.h
+ * defines when FWK_PROFILE_ALLOCATIONS is defined before it is included,
+ * which must be in only one translation unit of a program. Otherwise the
+ * allocation counts are 0.
+ */
+
+#ifndef FWK_PROFILER_H
+#define FWK_PROFILER_H
+
+class Profiler {
+public:
+
+    typedef U32 Frame;
+
+    /** The frame of no frame. */
+    static const Frame none = 0xffffffff;
+
+    enum Metric {
+        nanosecondsMetric,
+        allocationsMetric
+    };
+
+    /**
+     * Scope opens a frame for its lifetime if profiling is enabled. The
+     * frame is only computed then, by calling frame(), and none opens no
+     * frame. A posted frame counts as a posting delivered.
+     */
+    class Scope {
+    public:
+
+        template <class FrameFunc>
+        explicit Scope(const FrameFunc& frame, const bool posted = false) :
+            open_(false)
+        {
+            if (enabled()) {
+                const Frame f = frame();
+                if (f != none) {
+                    enter(f, posted);
+                    open_ = true;
+                }
+            }
+        }
+
+        Scope(const Scope&) = delete;
+        void operator =(const Scope&) = delete;
+
+        ~Scope() {
+            if (open_) {
+                leave();
+            }
+        }
+
+    protected:
+
+        bool open_;
+
+    };
+
+
+    static bool enabled() {
+        return enabledFlag().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Turn profiling on or off. Turning it on calibrates SystemTime's
+     * ticks first, so the calibration isn't charged to the first frame.
+     */
+    static void enabledIs(const bool on) {
+        if (on) {
+            SystemTime::nanosecondsPerTick();
+        }
+        enabledFlag().store(on, std::memory_order_relaxed);
+    }
+
+    /** Return the frame with the given name, registering it if it is new. */
+    _noinline
+    static Frame frameNew(const string& name) {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        const auto i = r.frames.find(name);
+        if (i != r.frames.end()) {
+            return i->second;
+        }
+
+        const auto frame = Frame(r.names.size());
+        r.names.push_back(name);
+        r.frames[name] = frame;
+        return frame;
+    }
+
+    /**
+     * Return the frame of an activity, its name in brackets with digits
+     * grouped as '#'.
+     */
+    _noinline
+    static Frame activityFrame(const string& activityName) {
+        string name = "[";
+        for (size_t i = 0; i < activityName.size(); ++i) {
+            if (!isDigit(activityName[i])) {
+                name += activityName[i];
+            } else if (i == 0 || !isDigit(activityName[i - 1])) {
+                name += '#';
+            }
+        }
+        return frameNew(name + "]");
+    }
+
+    /** Return the frame of a reactor of the given type. */
+    static Frame typeFrame(const std::type_info& type) {
+        auto& frames = threadProfile().typeFrames;
+        const auto i = frames.find(&type);
+        if (i != frames.end()) {
+            return i->second;
+        }
+
+        const auto frame = frameNew(typeName(type));
+        frames[&type] = frame;
+        return frame;
+    }
+
+    /** Return the number of allocations made by this thread. */
+    static U64 allocations() {
+        return allocationCount();
+    }
+
+    /** Count an allocation made by this thread. */
+    static void allocationNew() {
+        ++allocationCount();
+    }
+
+    /**
+     * Write one line per call path, with the frames from the outermost in
+     * and the nanoseconds or allocations spent in the innermost frame
+     * itself, e.g., "[trip#Sim];TripSim 18230". Paths with none are left out.
+     */
+    _noinline
+    static void foldedStacksWritten(std::ostream& out, const Metric metric = nanosecondsMetric) {
+        const auto nodes = merged();
+        const auto names = frameNames();
+        const auto nsPerTick = SystemTime::nanosecondsPerTick();
+
+        std::vector<Frame> path;
+        for (size_t i = 1; i < nodes.size(); ++i) {
+            const auto& node = nodes[i];
+            const auto value = metric == nanosecondsMetric
+                ? U64(double(node.ticks - node.childTicks) * nsPerTick + 0.5)
+                : node.allocations - node.childAllocations;
+            if (value == 0) {
+                continue;
+            }
+
+            path.clear();
+            for (auto j = U32(i); j != 0; j = nodes[j].parent) {
+                path.push_back(nodes[j].frame);
+            }
+            for (auto j = path.size(); j > 0; --j) {
+                for (const auto c : names[path[j - 1]]) {
+                    out << (c == ';' ? ',' : c);
+                }
+                out << (j > 1 ? ';' : ' ');
+            }
+            out << value << '\n';
+        }
+        out.flush();
+    }
+
+    /**
+     * Write a table of the n frames with the most time spent in the frame
+     * itself: the number of times each was entered, its postings, the
+     * milliseconds spent in it itself and in total, and the allocations
+     * made in it itself and in total. Totals don't count a frame again
+     * when it is entered within itself.
+     */
+    _noinline
+    static void reportWritten(std::ostream& out, const size_t n = 20) {
+        const auto nodes = merged();
+        const auto names = frameNames();
+        const auto msPerTick = SystemTime::nanosecondsPerTick() / 1e6;
+
+        std::vector<Totals> totals(names.size());
+        for (size_t i = 1; i < nodes.size(); ++i) {
+            const auto& node = nodes[i];
+            auto& t = totals[node.frame];
+            t.frame = node.frame;
+            t.calls += node.calls;
+            t.postings += node.postings;
+            t.selfTicks += node.ticks - node.childTicks;
+            t.selfAllocations += node.allocations - node.childAllocations;
+
+            auto j = node.parent;
+            while (j != 0 && nodes[j].frame != node.frame) {
+                j = nodes[j].parent;
+            }
+            if (j == 0) {
+                t.ticks += node.ticks;
+                t.allocations += node.allocations;
+            }
+        }
+
+        std::sort(totals.begin(), totals.end(),
+            [](const Totals& a, const Totals& b) { return a.selfTicks > b.selfTicks; }
+        );
+        while (!totals.empty() && totals.back().calls == 0) {
+            totals.pop_back();
+        }
+        if (totals.size() > n) {
+            totals.resize(n);
+        }
+
+        size_t width = 5;
+        for (const auto& t : totals) {
+            width = std::max(width, names[t.frame].size());
+        }
+
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        out << std::left << std::setw(int(width)) << "frame" << std::right
+            << std::setw(10) << "calls"
+            << std::setw(10) << "postings"
+            << std::setw(12) << "self ms"
+            << std::setw(12) << "total ms"
+            << std::setw(12) << "self allocs"
+            << std::setw(13) << "total allocs" << '\n';
+        out << std::fixed << std::setprecision(3);
+        for (const auto& t : totals) {
+            out << std::left << std::setw(int(width)) << names[t.frame] << std::right
+                << std::setw(10) << t.calls
+                << std::setw(10) << t.postings
+                << std::setw(12) << double(t.selfTicks) * msPerTick
+                << std::setw(12) << double(t.ticks) * msPerTick
+                << std::setw(12) << t.selfAllocations
+                << std::setw(13) << t.allocations << '\n';
+        }
+        out.flags(flags);
+        out.precision(precision);
+        out.flush();
+    }
+
+protected:
+
+    /**
+     * A call path, as its innermost frame and the node of the path it
+     * was entered from. Node 0 is the root, with no frame. Ticks and
+     * allocations are totals, including the children's.
+     */
+    struct Node {
+        Frame frame;
+        U32 parent;
+        U64 calls;
+        U64 postings;
+        U64 ticks;
+        U64 childTicks;
+        U64 allocations;
+        U64 childAllocations;
+    };
+
+    struct Open {
+        U32 node;
+        U64 ticks;
+        U64 allocations;
+    };
+
+    /** A thread's call tree, with its nodes' children by parent and frame. */
+    struct ThreadProfile {
+        std::vector<Node> nodes;
+        std::unordered_map<U64, U32> children;
+        std::vector<Open> stack;
+        std::unordered_map<const std::type_info*, Frame> typeFrames;
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        std::unordered_map<string, Frame> frames;
+        std::vector<string> names;
+        std::vector<std::unique_ptr<ThreadProfile>> profiles;
+    };
+
+    struct Totals {
+        Frame frame = 0;
+        U64 calls = 0;
+        U64 postings = 0;
+        U64 selfTicks = 0;
+        U64 ticks = 0;
+        U64 selfAllocations = 0;
+        U64 allocations = 0;
+    };
+
+
+    static std::atomic<bool>& enabledFlag() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+    static U64& allocationCount() {
+        static thread_local U64 count = 0;
+        return count;
+    }
+
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    static bool isDigit(const char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static string typeName(const std::type_info& type) {
+#   ifdef __GNUG__
+        int status = 0;
+        char* const demangled = abi::__cxa_demangle(type.name(), null, null, &status);
+        if (demangled != null) {
+            const string name(demangled);
+            std::free(demangled);
+            return name;
+        }
+        return type.name();
+#   else
+        string name = type.name();
+        for (const auto prefix : { "class ", "struct " }) {
+            if (name.compare(0, std::strlen(prefix), prefix) == 0) {
+                name.erase(0, std::strlen(prefix));
+            }
+        }
+        return name;
+#   endif
+    }
+
+    /** Return this thread's profile, registering it on first use. */
+    static ThreadProfile& threadProfile() {
+        static thread_local ThreadProfile* profile = null;
+        if (profile == null) {
+            auto& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.profiles.emplace_back(new ThreadProfile());
+            profile = r.profiles.back().get();
+            profile->nodes.push_back(Node());
+        }
+        return *profile;
+    }
+
+    /** Return the node for the frame entered from the parent node. */
+    static U32 child(
+        std::vector<Node>& nodes, std::unordered_map<U64, U32>& children,
+        const U32 parent, const Frame frame
+    ) {
+        const auto key = U64(parent) << 32 | frame;
+        const auto i = children.find(key);
+        if (i != children.end()) {
+            return i->second;
+        }
+
+        const auto node = U32(nodes.size());
+        Node n = Node();
+        n.frame = frame;
+        n.parent = parent;
+        nodes.push_back(n);
+        children[key] = node;
+        return node;
+    }
+
+    static void enter(const Frame frame, const bool posted) {
+        auto& p = threadProfile();
+        const auto parent = p.stack.empty() ? 0 : p.stack.back().node;
+        const auto node = child(p.nodes, p.children, parent, frame);
+        ++p.nodes[node].calls;
+        if (posted) {
+            ++p.nodes[node].postings;
+            ++p.nodes[parent].postings;
+        }
+
+        Open open;
+        open.node = node;
+        open.allocations = allocationCount();
+        open.ticks = SystemTime::ticks();
+        p.stack.push_back(open);
+    }
+
+    static void leave() {
+        const auto ticks = SystemTime::ticks();
+        auto& p = threadProfile();
+        const auto open = p.stack.back();
+        p.stack.pop_back();
+
+        auto& node = p.nodes[open.node];
+        node.ticks += ticks - open.ticks;
+        node.allocations += allocationCount() - open.allocations;
+        if (!p.stack.empty()) {
+            auto& parent = p.nodes[p.stack.back().node];
+            parent.childTicks += ticks - open.ticks;
+            parent.childAllocations += allocationCount() - open.allocations;
+        }
+    }
+
+    static std::vector<string> frameNames() {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        return r.names;
+    }
+
+    /**
+     * Return the threads' call trees merged into one, with each node
+     * after its parent.
+     */
+    static std::vector<Node> merged() {
+        std::vector<Node> nodes(1, Node());
+        std::unordered_map<U64, U32> children;
+
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (const auto& p : r.profiles) {
+            std::vector<U32> nodeOf(p->nodes.size(), 0);
+            for (size_t i = 1; i < p->nodes.size(); ++i) {
+                const auto& from = p->nodes[i];
+                nodeOf[i] = child(nodes, children, nodeOf[from.parent], from.frame);
+                auto& to = nodes[nodeOf[i]];
+                to.calls += from.calls;
+                to.postings += from.postings;
+                to.ticks += from.ticks;
+                to.childTicks += from.childTicks;
+                to.allocations += from.allocations;
+                to.childAllocations += from.childAllocations;
+            }
+        }
+        return nodes;
+    }
+
+};
+
+#endif
@@ -7,6 +7,12 @@
 #ifndef FWK_PTRINTERFACE_H
 #define FWK_PTRINTERFACE_H
 
+/**
+ * Define FWK_ATOMIC_PTR to make reference counts atomic, which is needed
+ * when reactions running on different threads (see BatchManager) copy
+ * Ptrs to the same objects. It is off by default because it slows down
+ * every Ptr copy.
+ */
 class PtrInterface {
 public:
 
@@ -21,6 +27,17 @@ public:
         return ref_;
     }
 
+#ifdef FWK_ATOMIC_PTR
+    void newRef() {
+        ref_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void deleteRef() {
+        if (ref_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            onZeroReferences();
+        }
+    }
+#else
     void newRef() {
         ref_ += 1;
     }
@@ -31,6 +48,7 @@ public:
             onZeroReferences();
         }
     }
+#endif
 
 protected:
 
@@ -44,7 +62,11 @@ protected:
 
 private:
 
+#ifdef FWK_ATOMIC_PTR
+    std::atomic<unsigned long> ref_;
+#else
     long unsigned ref_;
+#endif
 
 };
 
@@ -0,0 +1,288 @@
+/**
+ * ReplayLog records a run as the sequence of activity runs and random
+ * draws, in a compact binary file, so the same run can be reproduced.
+ *
+ * When recording, the manager reports each activity it runs with runIs,
+ * and the simulation passes each random draw through draw, which writes
+ * it and returns it unchanged. When replaying, runIs checks that the run
+ * matches the log and throws ReplayException at the first difference,
+ * and draw ignores its argument and returns the recorded value, so the
+ * run does not depend on how random numbers are generated. A manager that
+ * breaks ties between activities scheduled at the same time can use
+ * nextRun to pick the one that ran in the recorded run.
+ *
+ * The file starts with the 8 bytes "FWKRPL01", followed by records that
+ * each start with a one-byte tag:
+ *
+ *     'N' id name -- the first run of the activity with the given name,
+ *         which is referred to by id afterwards
+ *
+ *     'R' id time sequence -- a run of the activity with the given id
+ *
+ *     'D' value -- a random draw
+ *
+ * Ids, lengths, and sequence numbers are unsigned LEB128 varints; times
+ * and draws are 8-byte doubles.
+ */
+
+#ifndef FWK_REPLAYLOG_H
+#define FWK_REPLAYLOG_H
+
+class ReplayLog : public PtrInterface {
+public:
+
+    enum Mode {
+        recording,
+        replaying
+    };
+
+
+    /**
+     * Return a new log that records to or replays from the file with
+     * the given name. Throws StorageException if it can't be opened.
+     */
+    static Ptr<ReplayLog> instanceNew(const string& fileName, const Mode mode) {
+        return new ReplayLog(fileName, mode);
+    }
+
+
+    Mode mode() {
+        return mode_;
+    }
+
+    /** Return the number of activity runs recorded or replayed. */
+    U64 runCount() {
+        return runs_;
+    }
+
+    /** Return the number of random draws recorded or replayed. */
+    U64 drawCount() {
+        return draws_;
+    }
+
+
+    /**
+     * Return the name of the activity that runs next in the recorded run
+     * and its time, or false if the log has no more runs.
+     */
+    _noinline
+    bool nextRun(string& name, Time& t) {
+        if (!pendingValid()) {
+            return false;
+        }
+
+        name = names_[pendingId_];
+        t = pendingTime_;
+        return true;
+    }
+
+    /**
+     * Record the run of the activity at time t, or check it against the
+     * log when replaying.
+     */
+    _noinline
+    void runIs(const Ptr<Activity>& activity, const Time t) {
+        const auto sequence = runs_++;
+
+        if (mode_ == recording) {
+            const auto i = ids_.find(activity->name());
+            U64 id;
+            if (i != ids_.end()) {
+                id = i->second;
+            } else {
+                id = ids_.size();
+                ids_[activity->name()] = id;
+                byteWrite('N');
+                varintWrite(id);
+                varintWrite(activity->name().size());
+                file_.write(activity->name().data(), activity->name().size());
+            }
+
+            byteWrite('R');
+            varintWrite(id);
+            doubleWrite(t.value());
+            varintWrite(sequence);
+            return;
+        }
+
+        if (!pendingValid()) {
+            throw ReplayException(
+                "replay log has no run of " + activity->name() + " next"
+            );
+        }
+
+        if (names_[pendingId_] != activity->name() || pendingTime_ != t ||
+            pendingSequence_ != sequence
+        ) {
+            throw ReplayException(
+                "run " + std::to_string(sequence) + " of " + activity->name() +
+                " does not match the log, which has " + names_[pendingId_]
+            );
+        }
+
+        pending_ = false;
+    }
+
+    /**
+     * Record the random draw and return it, or return the recorded draw
+     * when replaying.
+     */
+    _noinline
+    double draw(const double value) {
+        ++draws_;
+
+        if (mode_ == recording) {
+            byteWrite('D');
+            doubleWrite(value);
+            return value;
+        }
+
+        pendingValid();
+        if (pending_ || tagRead() != 'D') {
+            throw ReplayException(
+                "draw " + std::to_string(draws_ - 1) + " does not match the log"
+            );
+        }
+
+        return doubleRead();
+    }
+
+protected:
+
+    Mode mode_;
+    std::fstream file_;
+    U64 runs_;
+    U64 draws_;
+
+    /** Ids of the activity names written so far, when recording. */
+    std::unordered_map<string, U64> ids_;
+
+    /** Activity names by id, when replaying. */
+    std::vector<string> names_;
+
+    /** The next run in the log, if it has been read but not replayed. */
+    bool pending_;
+    U64 pendingId_;
+    Time pendingTime_;
+    U64 pendingSequence_;
+
+    /** Tag read ahead by pendingValid that was not a run. */
+    int peeked_;
+
+
+    ReplayLog(const string& fileName, const Mode mode) :
+        mode_(mode),
+        runs_(0),
+        draws_(0),
+        pending_(false),
+        pendingId_(0),
+        pendingTime_(0.0),
+        pendingSequence_(0),
+        peeked_(-1)
+    {
+        static const char magic[8] = { 'F', 'W', 'K', 'R', 'P', 'L', '0', '1' };
+
+        if (mode == recording) {
+            file_.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file_) {
+                throw StorageException("can't create replay log " + fileName);
+            }
+            file_.write(magic, sizeof(magic));
+            return;
+        }
+
+        file_.open(fileName, std::ios::in | std::ios::binary);
+        char header[8];
+        if (!file_ || !file_.read(header, sizeof(header)) ||
+            !std::equal(header, header + sizeof(header), magic)
+        ) {
+            throw StorageException("can't read replay log " + fileName);
+        }
+    }
+
+
+    void byteWrite(const U8 b) {
+        file_.put(char(b));
+    }
+
+    void varintWrite(U64 v) {
+        while (v >= 0x80) {
+            byteWrite(U8(v | 0x80));
+            v >>= 7;
+        }
+        byteWrite(U8(v));
+    }
+
+    void doubleWrite(const double d) {
+        file_.write(reinterpret_cast<const char*>(&d), sizeof(d));
+    }
+
+    int tagRead() {
+        if (peeked_ >= 0) {
+            const auto tag = peeked_;
+            peeked_ = -1;
+            return tag;
+        }
+
+        return file_.get();
+    }
+
+    U64 varintRead() {
+        U64 v = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            const auto b = file_.get();
+            if (b == EOF) {
+                throw ReplayException("replay log is truncated");
+            }
+
+            v |= U64(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                break;
+            }
+        }
+
+        return v;
+    }
+
+    double doubleRead() {
+        double d;
+        if (!file_.read(reinterpret_cast<char*>(&d), sizeof(d))) {
+            throw ReplayException("replay log is truncated");
+        }
+
+        return d;
+    }
+
+    /**
+     * Read ahead to the next run, reading any name records before it.
+     * Leaves a draw tag in peeked_. Returns whether a run is pending.
+     */
+    bool pendingValid() {
+        while (!pending_ && peeked_ < 0) {
+            const auto tag = file_.get();
+            if (tag == 'N') {
+                const auto id = varintRead();
+                string name(varintRead(), '\0');
+                file_.read(&name[0], name.size());
+                if (names_.size() <= id) {
+                    names_.resize(id + 1);
+                }
+                names_[id] = name;
+            } else if (tag == 'R') {
+                pendingId_ = varintRead();
+                pendingTime_ = doubleRead();
+                pendingSequence_ = varintRead();
+                pending_ = true;
+            } else if (tag == EOF) {
+                break;
+            } else {
+                peeked_ = tag;
+            }
+        }
+
+        return pending_;
+    }
+
+};
+
+#endif
@@ -19,17 +19,32 @@ public:
     _noinline
     void statusIs(const Status s) {
         if (status_ != s) {
+            // Running also clears scheduled_ and may reset nextTime_.
+            StateLog::saved(status_);
+            StateLog::saved(scheduled_);
+            StateLog::saved(nextTime_);
             status_ = s;
 
+            // The activity is current only while it runs, so a worker
+            // thread doesn't hold on to the last activity it ran.
+            Ptr<Activity> previous;
             if (s == running) {
+                previous = current_;
                 current_ = this;
                 scheduled_ = false;
             }
 
+            const Profiler::Scope scope([this, s] {
+                return s == running ? profileFrame() : Profiler::none;
+            });
             NotifierLib::post(this, &Notifiee::onStatus);
 
             if (s == running) {
+#ifdef __cpp_impl_coroutine
+                resumeCoroutine();
+#endif
                 deliverAll();
+                current_ = previous;
             }
         }
     }
@@ -41,6 +56,8 @@ public:
 
     _noinline
     void nextTimeIs(const Time t) {
+        StateLog::saved(scheduled_);
+        StateLog::saved(nextTime_);
         scheduled_ = true;
         nextTime_ = t;
 
@@ -53,6 +70,25 @@ public:
     }
 
 
+    U64 sequence() {
+        return sequence_;
+    }
+
+    void sequenceIs(const U64 sequence) {
+        StateLog::saved(sequence_);
+        sequence_ = sequence;
+    }
+
+
+    void* queueEntry() {
+        return queueEntry_;
+    }
+
+    void queueEntryIs(void* const entry) {
+        queueEntry_ = entry;
+    }
+
+
     Ptr<ActivityManager> manager() {
         return manager_;
     }
@@ -88,6 +124,26 @@ public:
         immediateDeliveryFlag_ = flag;
     }
 
+#ifdef __cpp_impl_coroutine
+
+    std::coroutine_handle<> coroutine() {
+        return coroutine_;
+    }
+
+    void coroutineIs(const std::coroutine_handle<> h) {
+        coroutine_ = h;
+    }
+
+    std::coroutine_handle<> waitingCoroutine() {
+        return waitingCoroutine_;
+    }
+
+    void waitingCoroutineIs(const std::coroutine_handle<> h) {
+        waitingCoroutine_ = h;
+    }
+
+#endif
+
 protected:
 
     /**
@@ -104,22 +160,41 @@ protected:
         Reaction reaction;
     };
 
-    typedef std::deque<Posting> PostingQueue;
+    /**
+     * Postings made while a reaction runs are delivered before postings
+     * already in the queue, in the order they were made. Rather than
+     * rotating them to the front, each delivery pushes a segment that
+     * collects the postings its reaction makes, so the queue is a stack
+     * of FIFO segments and the next posting is always at the head of the
+     * topmost nonempty segment. Segment 0 holds postings made outside
+     * of a delivery.
+     *
+     * Segments are popped by resetting them rather than destroying them,
+     * so their storage is reused by later deliveries.
+     */
+    struct PostingSegment {
+        std::vector<Posting> postings;
+        std::vector<Posting>::size_type head = 0;
+    };
+
+    typedef std::vector<PostingSegment> PostingQueue;
 
 public:
 
     unsigned long postingCount() {
-        return postingQueue.size();
+        return postingCount_;
     }
 
     _noinline
     void postingNew(const Ptr<ActivityElement>& r, const Reaction& reaction) {
-        Posting posting;
+        auto& segment = postingQueue[delivering_ ? postingDepth_ - 1 : 0];
+        segment.postings.push_back(Posting());
+        auto& posting = segment.postings.back();
         posting.reactor = r;
         posting.reaction = reaction;
-        postingQueue.push_back(posting);
+        ++postingCount_;
 
-        if (status_ == idle && postingQueue.size() == 1) {
+        if (status_ == idle && postingCount_ == 1) {
             status_ = ready;
             manager_->activityAdd(this);
         }
@@ -130,10 +205,20 @@ protected:
     Status status_;
     bool scheduled_;
     Time nextTime_;
+    U64 sequence_;
+    void* queueEntry_;
     Ptr<ActivityElement> main_;
     Ptr<ActivityManager> manager_;
     bool immediateDeliveryFlag_;
+    bool delivering_;
     PostingQueue postingQueue;
+    PostingQueue::size_type postingDepth_;
+    unsigned long postingCount_;
+    Profiler::Frame profileFrame_;
+#ifdef __cpp_impl_coroutine
+    std::coroutine_handle<> coroutine_;
+    std::coroutine_handle<> waitingCoroutine_;
+#endif
 
 
     SequentialActivity(const string& name, const Ptr<ActivityManager>& mgr) :
@@ -141,8 +226,15 @@ protected:
         status_(idle),
         scheduled_(false),
         nextTime_(0.0),
+        sequence_(0),
+        queueEntry_(null),
         manager_(mgr),
-        immediateDeliveryFlag_(true)
+        immediateDeliveryFlag_(true),
+        delivering_(false),
+        postingQueue(1),
+        postingDepth_(1),
+        postingCount_(0),
+        profileFrame_(Profiler::none)
     {
         // Nothing else to do.
     }
@@ -166,32 +258,82 @@ protected:
      * before postings already in the queue.
      */
     bool deliverOne() {
-        if (postingQueue.empty()) {
-            if (scheduled_) {
-                status_ = scheduled;
-                manager_->activityAdd(this);
-            } else {
-                status_ = idle;
-                nextTime_ = 0;
+        FWK_TIMED("SequentialActivity::deliverOne");
+        auto segment = &postingQueue[postingDepth_ - 1];
+        while (segment->head == segment->postings.size()) {
+            segment->postings.clear();
+            segment->head = 0;
+
+            if (postingDepth_ == 1) {
+                if (scheduled_) {
+                    status_ = scheduled;
+                    manager_->activityAdd(this);
+                } else {
+                    status_ = idle;
+                    nextTime_ = 0;
+                }
+                return false;
             }
-            return false;
-        }
 
-        const auto n = postingQueue.size() - 1;
+            --postingDepth_;
+            segment = &postingQueue[postingDepth_ - 1];
+        }
 
-        tryDeliver(postingQueue.front());
-        postingQueue.pop_front();
+        auto& next = segment->postings[segment->head++];
+        const Posting posting = std::move(next);
+        next.reactor = null;
+        --postingCount_;
 
-        const auto nn = postingQueue.size();
-        for (auto i = n; i < nn; ++i) {
-            postingQueue.push_front(postingQueue.back());
-            postingQueue.pop_back();
+        if (postingDepth_ == postingQueue.size()) {
+            postingQueue.emplace_back();
         }
+        ++postingDepth_;
+
+        const auto delivering = delivering_;
+        delivering_ = true;
+        tryDeliver(posting);
+        delivering_ = delivering;
 
         return true;
     }
 
+    /** Return the profiler frame for runs of this activity. */
+    Profiler::Frame profileFrame() {
+        if (profileFrame_ == Profiler::none) {
+            profileFrame_ = Profiler::activityFrame(name());
+        }
+        return profileFrame_;
+    }
+
+#ifdef __cpp_impl_coroutine
+
+    /**
+     * Resume the coroutine waiting for this run, if any. It is cleared
+     * first, since the coroutine sets it again when it next suspends.
+     */
+    void resumeCoroutine() {
+        const auto h = coroutine_;
+        if (h.address() == null) {
+            return;
+        }
+
+        coroutine_ = null;
+        try {
+            h.resume();
+        } catch (const std::exception& e) {
+            undeliverable(e);
+        } catch (...) {
+            undeliverable();
+        }
+    }
+
+#endif
+
     void tryDeliver(const Posting& posting) {
+        const Profiler::Scope scope([&posting] {
+            static const auto reaction = Profiler::frameNew("reaction");
+            return posting.reactor == null ? reaction : Profiler::typeFrame(typeid(*posting.reactor.ptr()));
+        }, true);
         try {
             posting.reaction();
         } catch (const std::exception& e) {
@@ -11,12 +11,20 @@ public:
 
     static Ptr<ActivityManager> instance() {
         if (instance_ == null) {
-            instance_ = new SequentialManager();
+            instance_ = instanceNew();
         }
 
         return instance_;
     }
 
+    /**
+     * Return a new manager that is not the singleton instance,
+     * e.g., to compare managers in the same process.
+     */
+    static Ptr<SequentialManager> instanceNew() {
+        return new SequentialManager();
+    }
+
 
     bool verbose() {
         return verbose_;
@@ -27,6 +35,21 @@ public:
     }
 
 
+    /** Return the log this manager records to or replays from, if any. */
+    Ptr<ReplayLog> replayLog() {
+        return replayLog_;
+    }
+
+    /**
+     * Modify the replay log. When recording, each activity run is written
+     * to it. When replaying, activities scheduled at the same time run in
+     * the recorded order and each run is checked against the log.
+     */
+    void replayLogIs(const Ptr<ReplayLog>& log) {
+        replayLog_ = log;
+    }
+
+
     _noinline
     Ptr<Activity> activity(const string& name) {
         const auto i = activities_.find(name);
@@ -58,9 +81,37 @@ public:
         }
     }
 
+    /**
+     * Schedule the activity at activity->nextTime(). Each schedule gets
+     * the next sequence number, and activities scheduled for the same time
+     * run in sequence order.
+     */
     _noinline
     void activityAdd(const Ptr<Activity>& activity) {
-        scheduledActivities_.push(activity);
+        Entry e;
+        e.time = activity->nextTime();
+        e.sequence = sequence_++;
+        e.activity = activity;
+        activity->sequenceIs(e.sequence);
+
+        if (e.time <= now_) {
+            readyActivities_.push_back(e);
+        } else {
+            scheduledActivities_.push(e);
+        }
+    }
+
+    /**
+     * Return the number of activity runs pending at the current time,
+     * including ones that are already late.
+     */
+    unsigned long readyCount() {
+        return readyActivities_.size();
+    }
+
+    /** Return the number of activity runs so far. */
+    U64 runCount() {
+        return runs_;
     }
 
 
@@ -74,27 +125,31 @@ public:
      */
     _noinline
     void nowIs(const Time& t) {
-        while (!scheduledActivities_.empty()) {
-            const auto nextToRun = scheduledActivities_.top();
-            const auto nextTimeToRun = nextToRun->nextTime();
-
-            if (nextTimeToRun > t) {
-                // Finished running everything before or at time t.
-                break;
+        for (;;) {
+            if (readyActivities_.empty()) {
+                if (scheduledActivities_.empty() ||
+                    scheduledActivities_.top().time > t
+                ) {
+                    // Finished running everything before or at time t.
+                    break;
+                }
+
+                readyIs(scheduledActivities_.top().time);
             }
 
-            if (nextTimeToRun > now_) {
-                now_ = nextTimeToRun;
+            const auto next = nextToRunDel();
+            if (replayLog_ != null) {
+                replayLog_->runIs(next.activity, next.time);
             }
 
-            scheduledActivities_.pop();
-
             if (verbose_) {
-                std::cout << timeAsString(nextTimeToRun) << " ";
-                std::cout << "Activity: " << nextToRun->name() << std::endl;
+                std::cout << timeAsString(next.time) << " ";
+                std::cout << "Activity: " << next.activity->name();
+                std::cout << " (sequence " << next.sequence << ")" << std::endl;
             }
 
-            nextToRun->statusIs(Activity::running);
+            ++runs_;
+            next.activity->statusIs(Activity::running);
         }
 
         //
@@ -109,39 +164,105 @@ protected:
     typedef std::unordered_map< string, Ptr<Activity> > ActivityMap;
 
 
-    typedef std::vector< Ptr<Activity> > Container;
+    /**
+     * A scheduled run. The time is taken when the activity is added, so
+     * ordering never calls back into the activity.
+     */
+    struct Entry {
+        Time time;
+        U64 sequence;
+        Ptr<Activity> activity;
+    };
 
-    class Cmp : public std::binary_function<Ptr<Activity>, Ptr<Activity>, bool> {
+    class Later {
     public:
 
-        Cmp() {
-            // Nothing to do.
-        }
-
+        bool operator()(const Entry& e1, const Entry& e2) const {
+            if (e1.time != e2.time) {
+                return e1.time > e2.time;
+            }
 
-        bool operator()(const Ptr<Activity>& a1, const Ptr<Activity>& a2) const {
-            return a1->nextTime() > a2->nextTime();
+            return e1.sequence > e2.sequence;
         }
 
     };
 
-    typedef std::priority_queue<Ptr<Activity>, Container, Cmp> ActivityQueue;
+    typedef std::priority_queue<Entry, std::vector<Entry>, Later> ActivityQueue;
 
 protected:
 
     bool verbose_;
     Time now_;
+    U64 sequence_;
+    U64 runs_;
     ActivityMap activities_;
+
+    /** Runs scheduled after now_. */
     ActivityQueue scheduledActivities_;
 
+    /** Runs at or before now_, in sequence order. */
+    std::deque<Entry> readyActivities_;
+
+    Ptr<ReplayLog> replayLog_;
+
 
     SequentialManager() :
         verbose_(false),
-        now_(0.0)
+        now_(0.0),
+        sequence_(0),
+        runs_(0)
     {
         // Nothing else to do.
     }
 
+
+    /**
+     * Advance to time t, the earliest scheduled time, and move the runs
+     * scheduled at t to the ready queue. They come off the heap in
+     * sequence order, and runs added at t later have higher numbers.
+     */
+    void readyIs(const Time t) {
+        if (t > now_) {
+            now_ = t;
+        }
+
+        while (!scheduledActivities_.empty() &&
+            scheduledActivities_.top().time == t
+        ) {
+            readyActivities_.push_back(scheduledActivities_.top());
+            scheduledActivities_.pop();
+        }
+    }
+
+    /**
+     * Remove and return the next run from the ready queue. This is its
+     * head, except when replaying, where it is the run of whichever
+     * activity ran next in the recorded run.
+     */
+    Entry nextToRunDel() {
+        auto i = readyActivities_.begin();
+
+        string name;
+        Time t;
+        if (replayLog_ != null && replayLog_->mode() == ReplayLog::replaying &&
+            replayLog_->nextRun(name, t)
+        ) {
+            const auto j = std::find_if(
+                readyActivities_.begin(), readyActivities_.end(),
+                [&name](const Entry& e) { return e.activity->name() == name; }
+            );
+
+            // If it's not there, the replay log reports the difference.
+            if (j != readyActivities_.end()) {
+                i = j;
+            }
+        }
+
+        const auto next = *i;
+        readyActivities_.erase(i);
+        return next;
+    }
+
 };
 
 #endif
@@ -0,0 +1,216 @@
+/**
+ * StateLog is an undo log for incremental state saving. While a log is
+ * active on a thread, attribute mutators that call StateLog::saved record
+ * the old value of the field they are about to change, and undoAll puts
+ * every recorded field back in reverse order. An optimistic manager
+ * activates a log for each reaction it runs speculatively, so a reaction
+ * can be rolled back by undoing only the state it actually modified.
+ *
+ * A mutator participates by saving each field before changing it:
+ *
+ *     void locationIs(const Ptr<Location>& location) {
+ *         StateLog::saved(location_);
+ *         location_ = location;
+ *     }
+ *
+ * With no log active, which is the case under the sequential managers,
+ * saved is a single thread-local test.
+ */
+
+#ifndef FWK_STATELOG_H
+#define FWK_STATELOG_H
+
+class StateLog {
+public:
+
+    StateLog() {
+        // Nothing else to do.
+    }
+
+    StateLog(const StateLog&) = delete;
+    void operator =(const StateLog&) = delete;
+
+    ~StateLog() {
+        clear();
+    }
+
+
+    /** Return the log active on this thread, if any. */
+    static StateLog* current() {
+        return current_;
+    }
+
+    /** Modify the log active on this thread. */
+    static void currentIs(StateLog* const log) {
+        current_ = log;
+    }
+
+
+    /**
+     * Record the current value of the field in the active log, if any.
+     * The field must outlive the log.
+     */
+    template <class T>
+    static void saved(T& field) {
+        const auto log = current_;
+        if (log != null) {
+            log->recordNew<Saved<T>>(field);
+        }
+    }
+
+    /**
+     * Record an arbitrary undo action in the active log, if any, e.g.,
+     * to remove an entry that is being added to a map.
+     */
+    template <class Undo>
+    static void undoNew(const Undo& undo) {
+        const auto log = current_;
+        if (log != null) {
+            log->recordNew<Action<Undo>>(undo);
+        }
+    }
+
+
+    /** Return the number of recorded undo actions. */
+    unsigned long size() const {
+        return records_.size();
+    }
+
+    /** Undo everything recorded, most recent first, and clear the log. */
+    void undoAll() {
+        while (!records_.empty()) {
+            const auto r = records_.back();
+            records_.pop_back();
+            r->undo();
+            r->~Record();
+        }
+        blocksReused();
+    }
+
+    /** Forget everything recorded, e.g., once the changes are final. */
+    void clear() {
+        for (const auto r : records_) {
+            r->~Record();
+        }
+        records_.clear();
+        blocksReused();
+    }
+
+private:
+
+    /**
+     * An undo record. Records are constructed in the log's blocks rather
+     * than allocated one at a time, so saving a field doesn't allocate
+     * once the log has grown to fit a run.
+     */
+    class Record {
+    public:
+
+        virtual ~Record() {
+            // Nothing else to do.
+        }
+
+        virtual void undo() = 0;
+
+    };
+
+    /** Record of a field's old value. */
+    template <class T>
+    class Saved : public Record {
+    public:
+
+        Saved(T& field) :
+            field_(field),
+            old_(field)
+        {
+            // Nothing else to do.
+        }
+
+        void undo() {
+            field_ = std::move(old_);
+        }
+
+    private:
+
+        T& field_;
+        T old_;
+
+    };
+
+    /** Record of an undo action. */
+    template <class Undo>
+    class Action : public Record {
+    public:
+
+        Action(const Undo& undo) :
+            undo_(undo)
+        {
+            // Nothing else to do.
+        }
+
+        void undo() {
+            undo_();
+        }
+
+    private:
+
+        Undo undo_;
+
+    };
+
+    struct Block {
+        std::unique_ptr<char[]> bytes;
+        size_t size;
+    };
+
+    /** Size of the first block; each block after it is twice as big. */
+    static const size_t firstBlockBytes = 256;
+
+    static thread_local StateLog* current_;
+
+    std::vector<Record*> records_;
+    std::vector<Block> blocks_;
+    size_t block_ = 0;
+    size_t used_ = 0;
+
+
+    template <class R, class Arg>
+    void recordNew(Arg& arg) {
+        static_assert(alignof(R) <= alignof(std::max_align_t), "StateLog record is overaligned");
+        records_.push_back(new (bytesNew(sizeof(R), alignof(R))) R(arg));
+    }
+
+    /** Return room for a record, taking it from the next block if need be. */
+    void* bytesNew(const size_t size, const size_t align) {
+        for (;;) {
+            if (block_ == blocks_.size()) {
+                Block b;
+                b.size = blocks_.empty() ? firstBlockBytes : 2 * blocks_.back().size;
+                while (b.size < size) {
+                    b.size *= 2;
+                }
+                b.bytes.reset(new char[b.size]);
+                blocks_.push_back(std::move(b));
+            }
+
+            const auto offset = (used_ + align - 1) / align * align;
+            if (offset + size <= blocks_[block_].size) {
+                used_ = offset + size;
+                return blocks_[block_].bytes.get() + offset;
+            }
+            ++block_;
+            used_ = 0;
+        }
+    }
+
+    /** Start filling the blocks from the beginning again. */
+    void blocksReused() {
+        block_ = 0;
+        used_ = 0;
+    }
+
+};
+
+thread_local StateLog* StateLog::current_ = null;
+
+#endif
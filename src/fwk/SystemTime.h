@@ -19,6 +19,84 @@ public:
 #   endif
     }
 
+    /**
+     * Return a monotonic time in nanoseconds, for measuring intervals. It
+     * has no relation to the time of day and never goes backwards.
+     */
+    static U64 nanoseconds() {
+#   ifdef _WIN32
+        static const auto frequency = [] {
+            LARGE_INTEGER f;
+            ::QueryPerformanceFrequency(&f);
+            return U64(f.QuadPart);
+        }();
+
+        LARGE_INTEGER c;
+        ::QueryPerformanceCounter(&c);
+        const auto counts = U64(c.QuadPart);
+        return counts / frequency * 1000000000 + counts % frequency * 1000000000 / frequency;
+#   else
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return U64(ts.tv_sec) * 1000000000 + U64(ts.tv_nsec);
+#   endif
+    }
+
+    /**
+     * Return a monotonic count of ticks, the cheapest clock to read. Ticks
+     * are the processor's time stamp counter when it runs at a constant
+     * rate across cores and sleep states and tscIs hasn't turned it off,
+     * and are nanoseconds otherwise. Only differences of ticks mean
+     * anything; nanosecondsPerTick converts them.
+     */
+    static U64 ticks() {
+#   ifdef FWK_HAS_TSC
+        if (tsc()) {
+            return U64(__rdtsc());
+        }
+#   endif
+        return nanoseconds();
+    }
+
+    /** Return whether ticks are read from the time stamp counter. */
+    static bool tsc() {
+        return tscFlag().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Turn reading ticks from the time stamp counter on or off. It can
+     * only be turned on where the counter is invariant. Intervals that
+     * span the change are meaningless, so this belongs at startup.
+     */
+    static void tscIs(const bool on) {
+        tscFlag().store(on && invariantTsc(), std::memory_order_relaxed);
+    }
+
+    /**
+     * Return the length of a tick in nanoseconds. The time stamp counter
+     * is calibrated against nanoseconds the first time this is called,
+     * which takes about calibrationNanoseconds.
+     */
+    static double nanosecondsPerTick() {
+        if (!tsc()) {
+            return 1.0;
+        }
+
+        static const double perTick = [] {
+            const auto ns0 = nanoseconds();
+            const auto ticks0 = ticks();
+            U64 ns1;
+            while ((ns1 = nanoseconds()) - ns0 < calibrationNanoseconds);
+            const auto ticks1 = ticks();
+            return double(ns1 - ns0) / double(ticks1 - ticks0);
+        }();
+        return perTick;
+    }
+
+    static const U64 calibrationNanoseconds = 10000000;
+
+
     _noinline
     static void sleep(const SystemTime ms) {
 #       ifdef _WIN32
@@ -83,11 +161,49 @@ protected:
 
     U64 value_;
 
+
+    static std::atomic<bool>& tscFlag() {
+        static std::atomic<bool> flag(invariantTsc());
+        return flag;
+    }
+
+    /**
+     * Return whether the processor's time stamp counter ticks at the same
+     * constant rate on every core, whatever the power state.
+     */
+    static bool invariantTsc() {
+#   if defined(FWK_HAS_TSC) && defined(_MSC_VER)
+        int regs[4];
+        ::__cpuid(regs, 0x80000000);
+        if (unsigned(regs[0]) < 0x80000007) {
+            return false;
+        }
+        ::__cpuid(regs, 0x80000007);
+        return (regs[3] & (1 << 8)) != 0;
+#   elif defined(FWK_HAS_TSC)
+        unsigned eax, ebx, ecx, edx;
+        if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+            return false;
+        }
+        return (edx & (1 << 8)) != 0;
+#   else
+        return false;
+#   endif
+    }
+
 };
 
 
+/**
+ * Write t's time of day in UTC, as HH:MM:SS, to the buffer and return the
+ * end of what was written, or null if the buffer is too small.
+ */
 _noinline
-string to_string(const SystemTime t) {
+char* systemTimeAsBuffer(char* const buffer, char* const end, const SystemTime t) {
+    if (buffer + 9 >= end) {
+        return null;
+    }
+
     const auto ms = t.value();
     const auto seconds = ms / 1000;
     const auto minutes = seconds / 60;
@@ -96,7 +212,6 @@ string to_string(const SystemTime t) {
     const auto mm = U8(minutes % 60);
     const auto ss = U8(seconds % 60);
 
-    char* buffer = new char[32];
     auto p = buffer;
     *p++ = '0' + char(hh / 10);
     *p++ = '0' + char(hh % 10);
@@ -107,7 +222,14 @@ string to_string(const SystemTime t) {
     *p++ = '0' + char(ss / 10);
     *p++ = '0' + char(ss % 10);
     *p = 0;
-    return buffer;
+    return p;
+}
+
+_noinline
+string to_string(const SystemTime t) {
+    char buffer[32];
+    const auto end = systemTimeAsBuffer(buffer, buffer + sizeof(buffer), t);
+    return string(buffer, end);
 }
 
 #endif
@@ -0,0 +1,222 @@
+/**
+ * Timer measures how long a region of code takes and adds the duration to
+ * a histogram kept for its call site, so a run can end with a table of
+ * where the time went:
+ *
+ *     pair<vector<Ptr<Segment>>, double> findShortestPath(...) {
+ *         FWK_TIMED("Conn::findShortestPath");
+ *         ...
+ *     }
+ *     ...
+ *     Timer::enabledIs(true);
+ *     ...
+ *     Timer::reportWritten(cout);
+ *
+ * FWK_TIMED registers its site the first time it runs and times the rest
+ * of the enclosing scope. Durations are read with SystemTime::ticks and
+ * kept in nanoseconds. Timing is off until enabledIs(true), and while it
+ * is off a timed scope costs a relaxed load and a branch. Sites are
+ * shared by every thread, each with its own lock, and are never freed.
+ */
+
+#ifndef FWK_TIMER_H
+#define FWK_TIMER_H
+
+#define FWK_TIMED_NAME2(prefix, line) prefix##line
+#define FWK_TIMED_NAME(prefix, line) FWK_TIMED_NAME2(prefix, line)
+
+#define FWK_TIMED(name) \
+    static fwk::Timer::Site* const FWK_TIMED_NAME(fwkTimerSite, __LINE__) = \
+        fwk::Timer::siteNew(name); \
+    const fwk::Timer FWK_TIMED_NAME(fwkTimer, __LINE__)(FWK_TIMED_NAME(fwkTimerSite, __LINE__))
+
+class Timer {
+public:
+
+    /** Site holds the durations timed at one call site. */
+    class Site {
+    public:
+
+        Site(const string& name) :
+            name_(name)
+        {
+            // Nothing else to do.
+        }
+
+        Site(const Site&) = delete;
+        void operator =(const Site&) = delete;
+
+        string name() const {
+            return name_;
+        }
+
+        /** Return the durations timed so far, in nanoseconds. */
+        Histogram nanoseconds() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return nanoseconds_;
+        }
+
+        /** Add a duration of the given number of SystemTime ticks. */
+        void durationIs(const U64 ticks) {
+            const auto ns = double(ticks) * SystemTime::nanosecondsPerTick();
+            std::lock_guard<std::mutex> lock(mutex_);
+            nanoseconds_.valueIs(ns);
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nanoseconds_.clear();
+        }
+
+    protected:
+
+        const string name_;
+        mutable std::mutex mutex_;
+        Histogram nanoseconds_;
+
+    };
+
+
+    /**
+     * Return the site with the given name, registering it if it is new.
+     * Sites with the same name share their durations.
+     */
+    _noinline
+    static Site* siteNew(const string& name) {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto& site : r.sites) {
+            if (site.name() == name) {
+                return &site;
+            }
+        }
+        r.sites.emplace_back(name);
+        return &r.sites.back();
+    }
+
+    static bool enabled() {
+        return enabledFlag().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Turn timing on or off. Turning it on calibrates SystemTime's ticks
+     * first, so the calibration isn't charged to the first timed scope.
+     */
+    static void enabledIs(const bool on) {
+        if (on) {
+            SystemTime::nanosecondsPerTick();
+        }
+        enabledFlag().store(on, std::memory_order_relaxed);
+    }
+
+    /** Forget the durations timed at every site so far. */
+    static void sitesCleared() {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (auto& site : r.sites) {
+            site.clear();
+        }
+    }
+
+    /**
+     * Write a table of the sites that have timed anything, with the most
+     * total time first: the number of times each was timed, the total in
+     * milliseconds, and the mean, median, 90th and 99th percentile and
+     * maximum in microseconds.
+     */
+    _noinline
+    static void reportWritten(std::ostream& out) {
+        std::vector<std::pair<string, Histogram>> rows;
+        {
+            auto& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            for (const auto& site : r.sites) {
+                const auto h = site.nanoseconds();
+                if (h.count() > 0) {
+                    rows.push_back(std::make_pair(site.name(), h));
+                }
+            }
+        }
+
+        std::sort(rows.begin(), rows.end(),
+            [](const std::pair<string, Histogram>& a, const std::pair<string, Histogram>& b) {
+                return a.second.mean() * double(a.second.count()) > b.second.mean() * double(b.second.count());
+            }
+        );
+
+        size_t width = 4;
+        for (const auto& row : rows) {
+            width = std::max(width, row.first.size());
+        }
+
+        const auto flags = out.flags();
+        const auto precision = out.precision();
+        out << std::left << std::setw(int(width)) << "site" << std::right
+            << std::setw(12) << "count"
+            << std::setw(12) << "total ms"
+            << std::setw(10) << "mean us"
+            << std::setw(10) << "p50 us"
+            << std::setw(10) << "p90 us"
+            << std::setw(10) << "p99 us"
+            << std::setw(10) << "max us" << '\n';
+        out << std::fixed;
+        for (const auto& row : rows) {
+            const auto& h = row.second;
+            out << std::left << std::setw(int(width)) << row.first << std::right
+                << std::setw(12) << h.count()
+                << std::setprecision(3)
+                << std::setw(12) << h.mean() * double(h.count()) / 1e6
+                << std::setw(10) << h.mean() / 1e3
+                << std::setw(10) << h.quantile(0.5) / 1e3
+                << std::setw(10) << h.quantile(0.9) / 1e3
+                << std::setw(10) << h.quantile(0.99) / 1e3
+                << std::setw(10) << h.max() / 1e3 << '\n';
+        }
+        out.flags(flags);
+        out.precision(precision);
+        out.flush();
+    }
+
+
+    /** Start timing for the site, if timing is enabled. */
+    explicit Timer(Site* const site) :
+        site_(enabled() ? site : null),
+        start_(site_ == null ? 0 : SystemTime::ticks())
+    {
+        // Nothing else to do.
+    }
+
+    Timer(const Timer&) = delete;
+    void operator =(const Timer&) = delete;
+
+    /** Add the time since construction to the site's durations. */
+    ~Timer() {
+        if (site_ != null) {
+            site_->durationIs(SystemTime::ticks() - start_);
+        }
+    }
+
+protected:
+
+    struct Registry {
+        std::mutex mutex;
+        std::list<Site> sites;
+    };
+
+    Site* const site_;
+    const U64 start_;
+
+
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    static std::atomic<bool>& enabledFlag() {
+        static std::atomic<bool> flag(false);
+        return flag;
+    }
+
+};
+
+#endif
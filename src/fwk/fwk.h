@@ -91,6 +91,7 @@
 // Support for DateTime stuff
 #ifdef _WIN32
 #   include <Windows.h>
+#   include <io.h>
 #   include <sys/timeb.h>
 #   include <time.h>
 #else
@@ -99,17 +100,51 @@
 #   include <unistd.h>
 #endif
 
+// The time stamp counter, for SystemTime::ticks
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#   include <intrin.h>
+#   define FWK_HAS_TSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#   include <cpuid.h>
+#   include <x86intrin.h>
+#   define FWK_HAS_TSC
+#endif
+
 // Used by fwk classes
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef __cpp_impl_coroutine
+#   include <coroutine>
+#endif
 #include <deque>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <queue>
+#include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <typeinfo>
 #include <unordered_map>
 #include <vector>
+#ifdef __GNUG__
+#   include <cxxabi.h>
+#endif
 
 using std::string;
 
@@ -121,20 +156,64 @@ namespace fwk {
 #   include "fwk/SystemTime.h"
 #   include "fwk/Time.h"
 #   include "fwk/DateTime.h"
+#   include "fwk/Histogram.h"
 
 #   include "fwk/Ptr.h"
 #   include "fwk/PtrInterface.h"
 #   include "fwk/ActivityElement.h"
 #   include "fwk/RootNotifiee.h"
 #   include "fwk/BaseNotifiee.h"
+#   include "fwk/BaseNotifieeList.h"
 #   include "fwk/NamedInterface.h"
 #   include "fwk/Exception.h"
 #   include "fwk/Activity.h"
 #   include "fwk/ActivityManager.h"
+#   include "fwk/EffectBuffer.h"
+#   include "fwk/Profiler.h"
 #   include "fwk/NotifierLib.h"
+#   include "fwk/ReplayLog.h"
+#   include "fwk/StateLog.h"
+#   include "fwk/Log.h"
+#   include "fwk/Timer.h"
 #   include "fwk/SequentialActivity.h"
 #   include "fwk/SequentialManager.h"
+#   ifdef __cpp_impl_coroutine
+#       include "fwk/Coroutine.h"
+#   endif
+#   include "fwk/CalendarManager.h"
+#   include "fwk/ParallelManager.h"
+#   include "fwk/OptimisticManager.h"
+#   include "fwk/BatchManager.h"
 
 }
 
+#ifdef FWK_PROFILE_ALLOCATIONS
+
+//
+// Count every allocation for fwk::Profiler. The other forms of operator new
+// and delete call these by default.
+//
+
+void* operator new(const std::size_t size) {
+    fwk::Profiler::allocationNew();
+    for (;;) {
+        const auto p = std::malloc(size == 0 ? 1 : size);
+        if (p != null) {
+            return p;
+        }
+
+        const auto handler = std::get_new_handler();
+        if (handler == null) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+void operator delete(void* const p) noexcept {
+    std::free(p);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,99 @@
+// Hungarian.h
+// Minimum-cost assignment of rows to columns, used by the batched
+// dispatcher in ServiceSim to match waiting trips with free vehicles.
+//
+
+#ifndef TRAVELSIM_HUNGARIAN_H
+#define TRAVELSIM_HUNGARIAN_H
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Return, for each row of the cost matrix, the column assigned to it so
+// that no column is used twice and the total cost is least. When there are
+// more rows than columns, the rows left over get -1. Every row must have
+// the same number of columns.
+//
+// This is the Hungarian (Kuhn-Munkres) algorithm with row and column
+// potentials, which takes O(n^2 m) time for n rows and m >= n columns.
+inline std::vector<int> minCostAssignment(const std::vector<std::vector<double>>& cost) {
+    const size_t rows = cost.size();
+    const size_t cols = rows == 0 ? 0 : cost[0].size();
+    if (rows == 0 || cols == 0) {
+        return std::vector<int>(rows, -1);
+    }
+
+    if (rows > cols) {
+        // Solve the transpose, which has at least as many columns as rows.
+        std::vector<std::vector<double>> transpose(cols, std::vector<double>(rows));
+        for (size_t i = 0; i < rows; ++i) {
+            for (size_t j = 0; j < cols; ++j) {
+                transpose[j][i] = cost[i][j];
+            }
+        }
+
+        const auto colToRow = minCostAssignment(transpose);
+        std::vector<int> rowToCol(rows, -1);
+        for (size_t j = 0; j < cols; ++j) {
+            rowToCol[colToRow[j]] = int(j);
+        }
+        return rowToCol;
+    }
+
+    // 1-based, with row 0 and column 0 as the sentinel the search starts from.
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> u(rows + 1, 0), v(cols + 1, 0);
+    std::vector<size_t> match(cols + 1, 0), way(cols + 1, 0);
+    for (size_t i = 1; i <= rows; ++i) {
+        match[0] = i;
+        size_t j0 = 0;
+        std::vector<double> minv(cols + 1, inf);
+        std::vector<bool> used(cols + 1, false);
+        do {
+            used[j0] = true;
+            const size_t i0 = match[j0];
+            double delta = inf;
+            size_t j1 = 0;
+            for (size_t j = 1; j <= cols; ++j) {
+                if (!used[j]) {
+                    const double reduced = cost[i0 - 1][j - 1] - u[i0] - v[j];
+                    if (reduced < minv[j]) {
+                        minv[j] = reduced;
+                        way[j] = j0;
+                    }
+                    if (minv[j] < delta) {
+                        delta = minv[j];
+                        j1 = j;
+                    }
+                }
+            }
+            for (size_t j = 0; j <= cols; ++j) {
+                if (used[j]) {
+                    u[match[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (match[j0] != 0);
+
+        // Flip the augmenting path back to the sentinel.
+        do {
+            const size_t j1 = way[j0];
+            match[j0] = match[j1];
+            j0 = j1;
+        } while (j0 != 0);
+    }
+
+    std::vector<int> rowToCol(rows, -1);
+    for (size_t j = 1; j <= cols; ++j) {
+        if (match[j] != 0) {
+            rowToCol[match[j] - 1] = int(j - 1);
+        }
+    }
+    return rowToCol;
+}
+
+#endif
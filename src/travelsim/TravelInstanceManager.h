@@ -308,8 +308,15 @@ protected:
                     return std::to_string(stats_->numRoads());
                 } else if (name == "Flight") {
                     return std::to_string(stats_->numFlights());
+                } else if (name.find('.') != string::npos) {
+                    try {
+                        return std::to_string(stats_->statistic(name));
+                    } catch (const fwk::Exception& e) {
+                        cerr << "Error in StatsInstance:attribute(): " << e.what() << endl;
+                        return "";
+                    }
                 }
-                cerr << "Error in StatsInstance:attribute(): Must specify one of the following attribute names: Residence, Airport, Road, Flight. The erroneous specified value was: " << name << endl;
+                cerr << "Error in StatsInstance:attribute(): Must specify one of the following attribute names: Residence, Airport, Road, Flight, or a trip time statistic such as waitTime.p99. The erroneous specified value was: " << name << endl;
                 return "";
             }
 
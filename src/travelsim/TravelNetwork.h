@@ -5,7 +5,9 @@
 #include <sstream>
 #include <vector>
 #include <queue>
+#include <limits>
 #include <set>
+#include <tuple>
 #include <unordered_map>
 #include <ostream>
 #include <iostream>
@@ -19,8 +21,12 @@ using fwk::BaseNotifiee;
 using fwk::NamedInterface;
 using fwk::NotifierLib::post;
 using fwk::Ptr;
+using fwk::StateLog;
+using fwk::ActivityManager;
 using fwk::Ordinal;
 using fwk::Time;
+using fwk::Histogram;
+using fwk::WindowedHistogram;
 using std::pair;
 using std::make_pair;
 using std::numeric_limits;
@@ -105,6 +111,53 @@ public:
 ******************************************************************************/
 class Segment; // forward declared so Location can refer to it.
 class TravelNetwork;
+class Trip; // forward declared so a Vehicle's stops can refer to it.
+
+// Type tags number the subtypes of an entity hierarchy (locations, segments
+// or vehicles), so code that treats subtypes differently can compare a tag
+// or index an array by it instead of trying a dynamic_cast per subtype.
+// Each subtype takes a tag once, from its static typeTag(), and passes it
+// to its base constructor. Trackers that keep counts by tag then handle a
+// new subtype without being changed.
+template <class Base>
+class TypeTags {
+public:
+    typedef unsigned Tag;
+
+    // Arrays indexed by tag can be this long.
+    static const Tag maxTags = 16;
+
+    static Tag tagNew(const string& name) {
+        std::lock_guard<std::mutex> lock(mutex());
+        auto& n = names();
+        if (n.size() == maxTags) {
+            throw fwk::RangeException("Too many subtypes to tag: " + name);
+        }
+        n.push_back(name);
+        return Tag(n.size() - 1);
+    }
+
+    static size_t numTags() {
+        std::lock_guard<std::mutex> lock(mutex());
+        return names().size();
+    }
+
+    static string name(const Tag tag) {
+        std::lock_guard<std::mutex> lock(mutex());
+        return tag < names().size() ? names()[tag] : string();
+    }
+
+private:
+    static vector<string>& names() {
+        static vector<string> n;
+        return n;
+    }
+
+    static std::mutex& mutex() {
+        static std::mutex m;
+        return m;
+    }
+};
 
 // A location is a place where passenger travel starts or ends, or an 
 // intermediary point along the way. Some intermediate locations allow 
@@ -124,7 +177,7 @@ public:
 
 protected:
     typedef vector< Ptr<Segment> > SegmentVector;
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Location> NotifieeList;
 
 public:
     typedef SegmentVector::iterator iterator;
@@ -185,12 +238,21 @@ public:
         return notifiees_;
     }
 
+    // The tag of the subtype this location was created as.
+    typedef TypeTags<Location>::Tag Tag;
+    Tag tag() const {
+        return tag_;
+    }
+
 protected:
     SegmentVector segmentVector_;
     NotifieeList notifiees_;
     Ptr<TravelNetwork> travelNetwork_ = null;
+    const Tag tag_;
 
-    explicit Location(const string& name) : NamedInterface(name)
+    Location(const string& name, const Tag tag) :
+        NamedInterface(name),
+        tag_(tag)
     {
         // Nothing else to do.
     }
@@ -209,9 +271,14 @@ public:
         return new Residence(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Location>::tagNew("Residence");
+        return tag;
+    }
+
 protected:
     Residence(const string& name) :
-        Location(name)
+        Location(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -229,9 +296,14 @@ public:
         return new Airport(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Location>::tagNew("Airport");
+        return tag;
+    }
+
 protected:
     Airport(const string& name) :
-        Location(name)
+        Location(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -254,7 +326,7 @@ public:
     };
 
 protected:
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Segment> NotifieeList;
 
 public:
 
@@ -326,6 +398,12 @@ public:
         return notifiees_;
     }
 
+    // The tag of the subtype this segment was created as.
+    typedef TypeTags<Segment>::Tag Tag;
+    Tag tag() const {
+        return tag_;
+    }
+
 
 protected:
     NotifieeList notifiees_;
@@ -333,8 +411,11 @@ protected:
     Ptr<Location> source_ = null;
     Ptr<Location> destination_ = null;
     Miles length_ = 0.0;
+    const Tag tag_;
 
-    explicit Segment(const string& name) : NamedInterface(name)
+    Segment(const string& name, const Tag tag) :
+        NamedInterface(name),
+        tag_(tag)
     {
         // Nothing else to do.
     }
@@ -353,6 +434,11 @@ public:
         return new Flight(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Segment>::tagNew("Flight");
+        return tag;
+    }
+
     // Source
     void sourceIs(const Ptr<Location>& source) {
         if (source != null && source->travelNetwork() != travelNetwork_) {
@@ -360,7 +446,7 @@ public:
             cerr << errorMessage << endl;
             throw fwk::DifferentNetworkException(errorMessage);
         }
-        if (dynamic_cast<Airport*>(source.ptr()) != null) {
+        if (source != null && source->tag() == Airport::typeTag()) {
             if (source_ != null) {
                 // Removing this source from existing source Location's segment list
                 int segmentIndexInSourceList = 0; // 
@@ -389,7 +475,7 @@ public:
             cerr << errorMessage << endl;
             throw fwk::DifferentNetworkException(errorMessage);
         }
-        if (dynamic_cast<Airport*>(destination.ptr()) != null) {
+        if (destination != null && destination->tag() == Airport::typeTag()) {
             destination_ = destination;
         } else {
             string errorMessage = "Error in destinationIs(): Flight's source and destination can only be of type Airport!";
@@ -400,7 +486,7 @@ public:
 
 protected:
     Flight(const string& name) :
-        Segment(name)
+        Segment(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -420,9 +506,14 @@ public:
         return new Road(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Segment>::tagNew("Road");
+        return tag;
+    }
+
 protected:
     Road(const string& name) :
-        Segment(name)
+        Segment(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -444,10 +535,35 @@ public:
         void notifierIs(const Ptr<Vehicle>& vehicle) {
             connect(vehicle, this);
         }
+
+        virtual void onLocation() { }
+        virtual void onStops() { }
+    };
+
+    // A route the vehicle follows without its location being set at each
+    // hop: it moves to hops[i].location at hops[i].time by clock's time.
+    struct Hop {
+        Time time;
+        Ptr<Location> location;
+    };
+
+    struct Route {
+        vector<Hop> hops;
+        Ptr<ActivityManager> clock;
+        size_t next = 0;
+    };
+
+    // A planned stop of a pooled vehicle: picking up or dropping off the
+    // trip at location. A pickup also keeps when the trip was assigned.
+    struct Stop {
+        Ptr<Trip> trip;
+        Ptr<Location> location;
+        bool pickup = false;
+        Time assigned = 0;
     };
 
 protected:
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Vehicle> NotifieeList;
 
 public:
 
@@ -461,6 +577,7 @@ public:
         return capacity_;
     }
     void capacityIs(const Passengers capacity) {
+        StateLog::saved(capacity_);
         capacity_ = capacity;
     }
 
@@ -469,6 +586,7 @@ public:
         return speed_;
     }
     void speedIs(const MilesPerHour speed) {
+        StateLog::saved(speed_);
         speed_ = speed;
     }
 
@@ -477,15 +595,52 @@ public:
         return cost_;
     }
     void costIs(const DollarsPerMile cost) {
+        StateLog::saved(cost_);
         cost_ = cost;
     }
 
-    // currLocation
+    // currLocation, brought up to date with the route, if any, when asked
     Ptr<Location> location() {
+        if (route_.clock != null) {
+            routeCaughtUp();
+        }
         return location_;
     }
     void locationIs(const Ptr<Location>& location) {
+        if (location == location_) {
+            return;
+        }
+        StateLog::saved(location_);
         location_ = location;
+        post(this, &Notifiee::onLocation);
+    }
+
+    // route
+    const Route& route() {
+        return route_;
+    }
+    void routeIs(const Route& route) {
+        StateLog::saved(route_);
+        route_ = route;
+    }
+
+    // stops, in the order the vehicle makes them
+    const vector<Stop>& stops() {
+        return stops_;
+    }
+    void stopsIs(const vector<Stop>& stops) {
+        StateLog::saved(stops_);
+        stops_ = stops;
+        post(this, &Notifiee::onStops);
+    }
+
+    // passengers on board
+    Passengers passengers() {
+        return passengers_;
+    }
+    void passengersIs(const Passengers passengers) {
+        StateLog::saved(passengers_);
+        passengers_ = passengers;
     }
 
     // travelNetwork
@@ -493,6 +648,7 @@ public:
         return travelNetwork_;
     }
     void travelNetworkIs(const Ptr<TravelNetwork>& travelNetwork) {
+        StateLog::saved(travelNetwork_);
         travelNetwork_ = travelNetwork;
     }
 
@@ -501,21 +657,51 @@ public:
         return notifiees_;
     }
 
+    // The tag of the subtype this vehicle was created as.
+    typedef TypeTags<Vehicle>::Tag Tag;
+    Tag tag() const {
+        return tag_;
+    }
+
 
 protected:
     NotifieeList notifiees_;
     Ptr<TravelNetwork> travelNetwork_ = null;
+    vector<Stop> stops_;
+    Passengers passengers_ = 0;
 
     Passengers capacity_ = 0;
     MilesPerHour speed_ = 0.0;
     DollarsPerMile cost_ = 0.0;
     Ptr<Location> location_ = null;
+    Route route_;
+    const Tag tag_;
 
-    explicit Vehicle(const string& name) : NamedInterface(name)
+    Vehicle(const string& name, const Tag tag) :
+        NamedInterface(name),
+        tag_(tag)
     {
         // Nothing else to do.
     }
     ~Vehicle() { }
+
+    // Move to each hop of the route reached by now and drop the route once
+    // all are reached.
+    void routeCaughtUp() {
+        const auto now = route_.clock->now();
+        auto next = route_.next;
+        while (next < route_.hops.size() && route_.hops[next].time <= now) {
+            locationIs(route_.hops[next].location);
+            ++next;
+        }
+
+        if (next == route_.hops.size()) {
+            routeIs(Route());
+        } else if (next != route_.next) {
+            StateLog::saved(route_.next);
+            route_.next = next;
+        }
+    }
 };
 
 /********************************************************
@@ -530,9 +716,14 @@ public:
         return new Airplane(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Vehicle>::tagNew("Airplane");
+        return tag;
+    }
+
 protected:
     Airplane(const string& name) :
-        Vehicle(name)
+        Vehicle(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -552,9 +743,14 @@ public:
         return new Car(name);
     }
 
+    static Tag typeTag() {
+        static const Tag tag = TypeTags<Vehicle>::tagNew("Car");
+        return tag;
+    }
+
 protected:
     Car(const string& name) :
-        Vehicle(name)
+        Vehicle(name, typeTag())
     {
         // Nothing else to do.
     }
@@ -568,6 +764,20 @@ class Trip : public NamedInterface {
 public:
     enum Status { waitingForVehicle, goingToPickup, goingToDropoff, droppedOff};
 
+    // Where the vehicle is on the path: crossing path()[index], having
+    // left its source at departure and reaching its destination at arrival.
+    struct PathCursor {
+        size_t index = 0;
+        Time departure = 0;
+        Time arrival = 0;
+    };
+
+    // A point on the path: the fraction of path()[index] crossed so far.
+    struct PathPosition {
+        size_t index = 0;
+        double fraction = 0;
+    };
+
     class Notifiee : public BaseNotifiee<Trip> {
     public:
         void notifierIs(const Ptr<Trip>& trip) {
@@ -578,7 +788,7 @@ public:
     };
 
 protected:
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Trip> NotifieeList;
 
 public:
 
@@ -596,6 +806,7 @@ public:
     }
 
     void startLocationIs(const Ptr<Location>& startLocation) {
+        StateLog::saved(startLocation_);
         startLocation_ = startLocation;
     }
 
@@ -605,6 +816,7 @@ public:
     }
 
     void endLocationIs(const Ptr<Location>& endLocation) {
+        StateLog::saved(endLocation_);
         endLocation_ = endLocation;
     }
 
@@ -618,6 +830,7 @@ public:
             cerr << errorMessage << endl;
             throw fwk::DifferentNetworkException(errorMessage);
         }
+        StateLog::saved(vehicle_);
         vehicle_ = vehicle;
     }
 
@@ -627,6 +840,7 @@ public:
     }
 
     void numTravelersIs(const Passengers numTravelers) {
+        StateLog::saved(numTravelers_);
         numTravelers_ = numTravelers;
     }
 
@@ -635,6 +849,7 @@ public:
         return travelNetwork_;
     }
     void travelNetworkIs(const Ptr<TravelNetwork>& travelNetwork) {
+        StateLog::saved(travelNetwork_);
         travelNetwork_ = travelNetwork;
     }
 
@@ -644,6 +859,7 @@ public:
     }
     void statusIs(const Status status) {
         if (status > status_) {
+            StateLog::saved(status_);
             status_ = status;
             post(this, &Notifiee::onStatus);
         } else {
@@ -658,15 +874,81 @@ public:
         return waitTime_;
     }
     void waitTimeIs(const Time waitTime) {
+        StateLog::saved(waitTime_);
         waitTime_ = waitTime;
     }
 
     // path
-    vector<Ptr<Segment>> path() {
+    const vector<Ptr<Segment>>& path() {
         return path_;
     }
-    void pathIs(vector<Ptr<Segment>> path) {
+    void pathIs(const vector<Ptr<Segment>>& path) {
+        StateLog::saved(path_);
+        StateLog::saved(pathCursor_);
         path_ = path;
+        pathCursor_ = PathCursor();
+    }
+
+    // pathCursor, advanced by the trip's sim as the vehicle crosses each segment
+    PathCursor pathCursor() {
+        return pathCursor_;
+    }
+    void pathCursorIs(const PathCursor& cursor) {
+        StateLog::saved(pathCursor_);
+        pathCursor_ = cursor;
+    }
+
+    // Time for the trip's vehicle to cross the segment
+    Time crossingTime(const Ptr<Segment>& seg) {
+        return seg->length().value() / vehicle_->speed().value() * 60 * 60;
+    }
+
+    // Return where on the path the vehicle is at time t, interpolating
+    // within the segment the cursor is on and assuming the vehicle keeps
+    // going at its speed after that. Before the cursor's departure, this
+    // is the start of its segment; past the end of the path, the end of
+    // the last segment.
+    PathPosition pathPositionAt(const Time t) {
+        PathPosition p;
+        p.index = pathCursor_.index;
+        if (p.index >= path_.size()) {
+            p.index = path_.size();
+            return p;
+        }
+
+        if (t <= pathCursor_.departure) {
+            return p;
+        }
+
+        auto departure = pathCursor_.departure;
+        auto arrival = pathCursor_.arrival;
+        while (t >= arrival) {
+            if (p.index + 1 == path_.size()) {
+                p.fraction = 1;
+                return p;
+            }
+            ++p.index;
+            departure = arrival;
+            arrival = departure + crossingTime(path_[p.index]);
+        }
+
+        if (arrival > departure) {
+            p.fraction = (t - departure).value() / (arrival - departure).value();
+        }
+        return p;
+    }
+
+    // Return the last location the vehicle reached on the path at time t
+    Ptr<Location> locationAt(const Time t) {
+        const auto p = pathPositionAt(t);
+        if (p.index >= path_.size()) {
+            return path_.empty() ? null : path_.back()->destination();
+        }
+
+        if (p.fraction >= 1) {
+            return path_[p.index]->destination();
+        }
+        return path_[p.index]->source();
     }
 
     // Notifiees
@@ -682,6 +964,7 @@ protected:
     Ptr<Location> endLocation_ = null;
     Ptr<Vehicle> vehicle_ = null;
     vector<Ptr<Segment>> path_;
+    PathCursor pathCursor_;
     Passengers numTravelers_ = 0;
     Status status_;
     Time waitTime_ = 0; // Confirmed with Prof. Linton on 12/3/2014 that we could set this to 0 and return it in the accessor
@@ -723,7 +1006,7 @@ protected:
     typedef std::unordered_map< string, Ptr<Segment> > SegmentMap;
     typedef std::unordered_map< string, Ptr<Vehicle> > VehicleMap;
     typedef std::unordered_map< string, Ptr<Trip> > TripMap;
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<TravelNetwork> NotifieeList;
 
     LocationMap locationMap_;
     SegmentMap segmentMap_;
@@ -955,7 +1238,7 @@ public:
     };
 
 protected:
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Stats> NotifieeList;
     NotifieeList notifiees_;
 
     
@@ -979,91 +1262,44 @@ protected:
                 cerr << "Unable to new null location!" << endl;
                 return;
             }
-
-            // Check if location is a Residence
-            if (dynamic_cast<Residence*>(location.ptr()) != null) {
-                stats_->numResidences_++;
-            }
-
-            // Check if location is a Airport
-            if (dynamic_cast<Airport*>(location.ptr()) != null) {
-                stats_->numAirports_++;
-            }
+            stats_->numLocations_[location->tag()]++;
         }
 
         /** Notification that a location is removed from the network. */
         void onLocationDel(const Ptr<Location>& location) {
-            // Check if location is a Residence
-            if (dynamic_cast<Residence*>(location.ptr()) != null) {
-                stats_->numResidences_--;
-            }
-
-            // Check if location is a Airport
-            if (dynamic_cast<Airport*>(location.ptr()) != null) {
-                stats_->numAirports_--;
-            }
+            stats_->numLocations_[location->tag()]--;
         }
 
         /** Notification that a segment is added to the network. */
         void onSegmentNew(const Ptr<Segment>& segment) {
-            // Check if segment is a Road
-            if (dynamic_cast<Road*>(segment.ptr()) != null) {
-                stats_->numRoads_++;
-            }
-
-            // Check if segment is a Flight
-            if (dynamic_cast<Flight*>(segment.ptr()) != null) {
-                stats_->numFlights_++;
-            }
+            stats_->numSegments_[segment->tag()]++;
         }
 
         /** Notification that a segment is removed from the network. */
         void onSegmentDel(const Ptr<Segment>& segment) {
-            // Check if segment is a Road
-            if (dynamic_cast<Road*>(segment.ptr()) != null) {
-                stats_->numRoads_--;
-            }
-
-            // Check if segment is a Flight
-            if (dynamic_cast<Flight*>(segment.ptr()) != null) {
-                stats_->numFlights_--;
-            }
+            stats_->numSegments_[segment->tag()]--;
         }
 
         /** Notification that a vehicle is added to the network. */
         void onVehicleNew(const Ptr<Vehicle>& vehicle) {
-            // Check if vehicle is a Car
-            if (dynamic_cast<Car*>(vehicle.ptr()) != null) {
-                stats_->numCars_++;
-            }
-
-            // Check if vehicle is a Airplane
-            if (dynamic_cast<Airplane*>(vehicle.ptr()) != null) {
-                stats_->numAirplanes_++;
-            }
+            stats_->numVehicles_[vehicle->tag()]++;
         }
 
         /** Notification that a vehicle is removed from the network. */
         void onVehicleDel(const Ptr<Vehicle>& vehicle) {
-            // Check if vehicle is a Car
-            if (dynamic_cast<Car*>(vehicle.ptr()) != null) {
-                stats_->numCars_--;
-            }
-
-            // Check if vehicle is a Airplane
-            if (dynamic_cast<Airplane*>(vehicle.ptr()) != null) {
-                stats_->numAirplanes_--;
-            }
+            stats_->numVehicles_[vehicle->tag()]--;
         }
 
         /** Notification that a trip is added to the network. */
         void onTripNew(const Ptr<Trip>& trip) {
             stats_->numTrips_++;
+            stats_->finishedTripTrackersDel();
 
             // Create a new trip tracker for each new trip
             auto tripTracker = TripTracker::instanceNew(trip);
             stats_->tripTrackerMap_[trip->name()] = tripTracker;
             tripTracker->stats_ = stats_; // from slide 28 in lecture3.pdf
+            tripTracker->requested_ = stats_->now();
         }
 
         /** Notification that a trip is removed from the network. */
@@ -1089,33 +1325,77 @@ protected:
 
         /** Notification that the trip's status changed. */
         void onStatus() {
+            const Time now = stats_->now();
+            if (!dispatched_ && notifier()->status() != Trip::waitingForVehicle) {
+                dispatched_ = true;
+                stats_->valueIs(stats_->dispatchLatency_, now - requested_);
+            }
             if (notifier()->status() == Trip::droppedOff) {
                 stats_->numCompletedTrips_++;
+                stats_->valueIs(stats_->tripDuration_, now - pickedUp_);
+
+                // The trip is done, so its tracker can go. It is still
+                // reacting, so it is released on the next new trip.
+                stats_->finishedTripTrackers_.push_back(notifier()->name());
             };
             if (notifier()->status() == Trip::goingToDropoff) {
                 stats_->numPickups_++;
                 stats_->cumWaitTime_ += notifier()->waitTime();
+                stats_->valueIs(stats_->waitTime_, notifier()->waitTime());
+                pickedUp_ = now;
             }
         }
 
         // We can make this public because it's only available to the stats class.
         Ptr<Stats> stats_;
+        Time requested_ = 0;
+        Time pickedUp_ = 0;
+        bool dispatched_ = false;
+    };
+
+    // A distribution of times, in seconds, over the whole run and over a
+    // sliding window of recent virtual time.
+    struct Metric {
+        Histogram all;
+        WindowedHistogram recent;
     };
 
-    unsigned int numResidences_ = 0;
-    unsigned int numAirports_ = 0;
-    unsigned int numFlights_ = 0;
-    unsigned int numRoads_ = 0;
+    // Entity counts, indexed by type tag.
+    unsigned int numLocations_[TypeTags<Location>::maxTags] = {};
+    unsigned int numSegments_[TypeTags<Segment>::maxTags] = {};
+    unsigned int numVehicles_[TypeTags<Vehicle>::maxTags] = {};
     unsigned int numTrips_ = 0;
     unsigned int numCompletedTrips_ = 0;
     unsigned int numPickups_ = 0;
-    unsigned int numCars_ = 0;
-    unsigned int numAirplanes_ = 0;
     Time cumWaitTime_ = 0;
 
+    Metric waitTime_;
+    Metric tripDuration_;
+    Metric dispatchLatency_;
+    Ptr<ActivityManager> clock_;
+
     Ptr<TravelNetworkTracker> travelNetworkTracker_;
     typedef unordered_map< string, Ptr<TripTracker> > TripTrackerMap;
     TripTrackerMap tripTrackerMap_;
+    std::vector<string> finishedTripTrackers_;
+
+    Time now() {
+        return clock_ == null ? Time(0) : clock_->now();
+    }
+
+    void valueIs(Metric& metric, const Time value) {
+        metric.all.valueIs(value.value());
+        if (clock_ != null) {
+            metric.recent.valueIs(now().value(), value.value());
+        }
+    }
+
+    void finishedTripTrackersDel() {
+        for (const auto& name : finishedTripTrackers_) {
+            tripTrackerMap_.erase(name);
+        }
+        finishedTripTrackers_.clear();
+    }
 
     explicit Stats(const string& name) : NamedInterface(name)
     {
@@ -1146,20 +1426,34 @@ public:
     /********************************************************
     * Accessor Functions                                    *
     ********************************************************/
+    // The number of entities in the network created as the subtype with
+    // the given tag, such as numLocations(Residence::typeTag()).
+    unsigned int numLocations(const Location::Tag tag) {
+        return tag < TypeTags<Location>::maxTags ? numLocations_[tag] : 0;
+    }
+
+    unsigned int numSegments(const Segment::Tag tag) {
+        return tag < TypeTags<Segment>::maxTags ? numSegments_[tag] : 0;
+    }
+
+    unsigned int numVehicles(const Vehicle::Tag tag) {
+        return tag < TypeTags<Vehicle>::maxTags ? numVehicles_[tag] : 0;
+    }
+
     unsigned int numResidences() {
-        return numResidences_;
+        return numLocations_[Residence::typeTag()];
     }
 
     unsigned int numAirports() {
-        return numAirports_;
+        return numLocations_[Airport::typeTag()];
     }
 
     unsigned int numFlights() {
-        return numFlights_;
+        return numSegments_[Flight::typeTag()];
     }
 
     unsigned int numRoads() {
-        return numRoads_;
+        return numSegments_[Road::typeTag()];
     }
 
     unsigned int numTrips() {
@@ -1171,11 +1465,11 @@ public:
     }
 
     unsigned int numAirplanes() {
-        return numAirplanes_;
+        return numVehicles_[Airplane::typeTag()];
     }
 
     unsigned int numCars() {
-        return numCars_;
+        return numVehicles_[Car::typeTag()];
     }
 
     unsigned int numCompletedTrips() {
@@ -1186,6 +1480,99 @@ public:
         if (numPickups_ == 0) return 0;
         return cumWaitTime_.value() / numPickups_;
     }
+
+    /********************************************************
+    * Trip Time Distributions                               *
+    ********************************************************/
+    // The clock that stamps trip events. Without one, only the wait
+    // times are recorded, and only over the whole run.
+    Ptr<ActivityManager> clock() {
+        return clock_;
+    }
+
+    void clockIs(const Ptr<ActivityManager>& clock) {
+        clock_ = clock;
+    }
+
+    // Set the sliding window to the last numPanes tumbling panes of
+    // paneLength each. Values already in the windows are dropped.
+    void windowIs(const Time paneLength, const size_t numPanes) {
+        if (paneLength <= 0) {
+            throw fwk::RangeException("Stats window panes must have a positive length");
+        }
+        for (auto metric : { &waitTime_, &tripDuration_, &dispatchLatency_ }) {
+            metric->recent = WindowedHistogram(paneLength.value(), numPanes);
+        }
+    }
+
+    // Return the statistic with the given name, in seconds or as a count.
+    // Names are metric[.window|.pane].stat, where metric is waitTime (the
+    // trip's own waitTime(), from a vehicle being assigned to pickup),
+    // tripDuration (from pickup to dropoff) or dispatchLatency (from
+    // request to a vehicle being assigned). With no
+    // window the stat covers the whole run, .window covers the sliding
+    // window up to now and .pane the last tumbling pane to close. The stat
+    // is count, mean, min, max, or pN for the Nth percentile, as in
+    // waitTime.p99 or tripDuration.window.p99.9.
+    double statistic(const string& name) {
+        std::vector<string> parts;
+        std::stringstream ss(name);
+        string part;
+        while (std::getline(ss, part, '.')) {
+            parts.push_back(part);
+        }
+
+        // A percentile such as p99.9 splits in two at its decimal point.
+        if (parts.size() >= 3 && parts[parts.size() - 2].compare(0, 1, "p") == 0 &&
+            parts.back().find_first_not_of("0123456789") == string::npos) {
+            parts[parts.size() - 2] += "." + parts.back();
+            parts.pop_back();
+        }
+        if (parts.size() != 2 && parts.size() != 3) {
+            throw fwk::UnknownAttrException("Unknown Stats statistic: " + name);
+        }
+
+        Metric* metric = null;
+        if (parts[0] == "waitTime") {
+            metric = &waitTime_;
+        } else if (parts[0] == "tripDuration") {
+            metric = &tripDuration_;
+        } else if (parts[0] == "dispatchLatency") {
+            metric = &dispatchLatency_;
+        } else {
+            throw fwk::UnknownAttrException("Unknown Stats metric: " + name);
+        }
+
+        Histogram h;
+        if (parts.size() == 2) {
+            h = metric->all;
+        } else if (parts[1] == "window") {
+            h = metric->recent.window(now().value());
+        } else if (parts[1] == "pane") {
+            h = metric->recent.lastPane(now().value());
+        } else {
+            throw fwk::UnknownAttrException("Unknown Stats window: " + name);
+        }
+
+        const string& stat = parts.back();
+        if (stat == "count") return double(h.count());
+        if (stat == "mean") return h.mean();
+        if (stat == "min") return h.min();
+        if (stat == "max") return h.max();
+        if (stat.size() > 1 && stat[0] == 'p') {
+            size_t end = 0;
+            double percentile = -1;
+            try {
+                percentile = std::stod(stat.substr(1), &end);
+            } catch (const std::exception&) {
+                end = 0;
+            }
+            if (end == stat.size() - 1 && percentile >= 0 && percentile <= 100) {
+                return h.quantile(percentile / 100);
+            }
+        }
+        throw fwk::UnknownAttrException("Unknown Stats statistic: " + name);
+    }
 };
 
 
@@ -1221,34 +1608,42 @@ protected:
 
         /** Notification that a segment is added to the network. */
         void onSegmentNew(const Ptr<Segment>& segment) {
+            if (conn_ != null) {
+                conn_->pathTreesDel();
+            }
+
             // Check if segment is a Road
-            if (dynamic_cast<Road*>(segment.ptr()) != null) {
+            if (segment->tag() == Road::typeTag()) {
                 cout << "conn_->numRoads_++;" << endl; // TODO
             }
 
             // Check if segment is a Flight
-            if (dynamic_cast<Flight*>(segment.ptr()) != null) {
+            if (segment->tag() == Flight::typeTag()) {
                 cout << "conn_->numFlights_++;" << endl; // TODO
             }
         }
 
         /** Notification that a segment is removed from the network. */
         void onSegmentDel(const Ptr<Segment>& segment) {
+            if (conn_ != null) {
+                conn_->pathTreesDel();
+            }
+
             // Check if segment is a Road
-            if (dynamic_cast<Road*>(segment.ptr()) != null) {
+            if (segment->tag() == Road::typeTag()) {
                 cout << "conn_->numRoads_--;" << endl; // TODO
             }
 
             // Check if segment is a Flight
-            if (dynamic_cast<Flight*>(segment.ptr()) != null) {
+            if (segment->tag() == Flight::typeTag()) {
                 cout << "conn_->numFlights_--;" << endl; // TODO
             }
         }
         // We can make this public because it's only available to the conn_ class.
-        Ptr<Conn> conn_;
+        Conn* conn_ = null; // weak pointer to prevent cycles
     };
 
-    typedef std::list<Notifiee*> NotifieeList;
+    typedef fwk::BaseNotifieeList<Conn> NotifieeList;
     NotifieeList notifiees_;
     Ptr<TravelNetwork> travelNetwork_;
     size_t cacheSize = 20;
@@ -1337,6 +1732,7 @@ public:
         Ptr<Conn> c = new Conn(name);
         c->travelNetwork_ = tn;
         c->travelNetworkTracker_ = TravelNetworkTracker::instanceNew(tn);
+        c->travelNetworkTracker_->conn_ = c.ptr();
         return c;
     }
 
@@ -1366,6 +1762,7 @@ public:
     }
 
     pair<vector<Ptr<Segment>>, double> findShortestPath(const Ptr<Location>& source, const Ptr<Location>& destination) {
+        FWK_TIMED("Conn::findShortestPath");
         if (source->name() == destination->name()) {
             cout << "returned 0 path" << endl;
             return make_pair(vector<Ptr<Segment>>(), 0);
@@ -1402,6 +1799,117 @@ public:
         return pathDistPair;
     }
 
+    // Distances of the shortest paths from a set of sources to the locations
+    // they reach, the last segment of each path, and the index of the source
+    // each path starts from.
+    struct PathTree {
+        unordered_map<Location*, double> distance;
+        unordered_map<Location*, Ptr<Segment>> via;
+        unordered_map<Location*, size_t> source;
+
+        // Whether there is a path to the location
+        bool reaches(const Ptr<Location>& location) const {
+            return distance.find(location.ptr()) != distance.end();
+        }
+
+        // The shortest path to the location, which must be reached
+        vector<Ptr<Segment>> path(const Ptr<Location>& location) const {
+            vector<Ptr<Segment>> segments;
+            auto loc = location.ptr();
+            for (auto i = via.find(loc); i != via.end(); i = via.find(loc)) {
+                segments.push_back(i->second);
+                loc = i->second->source().ptr();
+            }
+            std::reverse(segments.begin(), segments.end());
+            return segments;
+        }
+    };
+
+    // Return the shortest paths from source to every location, from one
+    // Dijkstra search. Unlike findShortestPath, this doesn't use the cache,
+    // so callers that need paths to many destinations search once.
+    PathTree shortestPathTree(const Ptr<Location>& source) {
+        return shortestPathTree(vector<Ptr<Location>>(1, source), null);
+    }
+
+    // Return the shortest paths from whichever source is nearest, searching
+    // outward from all of them at once. The search stops once it reaches
+    // destination, if not null, since every location it hasn't reached is
+    // at least as far. Of sources equally far from a location, the one
+    // earliest in sources wins.
+    PathTree shortestPathTree(const vector<Ptr<Location>>& sources, const Ptr<Location>& destination) {
+        FWK_TIMED("Conn::shortestPathTree");
+        typedef std::tuple<double, size_t, Location*> Entry;
+        std::priority_queue<Entry, vector<Entry>, std::greater<Entry>> frontier;
+        PathTree tree;
+        for (size_t i = 0; i < sources.size(); ++i) {
+            const auto loc = sources[i].ptr();
+            if (tree.source.find(loc) == tree.source.end()) {
+                tree.distance[loc] = 0;
+                tree.source[loc] = i;
+                frontier.push(Entry(0, i, loc));
+            }
+        }
+
+        while (!frontier.empty()) {
+            const auto entry = frontier.top();
+            frontier.pop();
+            const auto d = std::get<0>(entry);
+            const auto from = std::get<1>(entry);
+            const auto loc = std::get<2>(entry);
+            if (d != tree.distance[loc] || from != tree.source[loc]) {
+                continue;
+            }
+            if (loc == destination.ptr()) {
+                break;
+            }
+
+            for (auto it = loc->segmentIter(); it != loc->segmentIterEnd(); ++it) {
+                const Ptr<Segment> seg = *it;
+                if (seg->source() == null || seg->destination() == null) {
+                    continue;
+                }
+
+                const auto next = seg->destination().ptr();
+                const auto nextDistance = d + seg->length().value();
+                const auto i = tree.distance.find(next);
+                if (i == tree.distance.end() || nextDistance < i->second ||
+                    (nextDistance == i->second && from < tree.source[next])
+                ) {
+                    tree.distance[next] = nextDistance;
+                    tree.source[next] = from;
+                    tree.via[next] = seg;
+                    frontier.push(Entry(nextDistance, from, next));
+                }
+            }
+        }
+        return tree;
+    }
+
+    // Return the shortest paths from source to every location. Trees are
+    // kept until the network's segments change, so repeated questions
+    // about the same source cost a lookup rather than a search.
+    const PathTree& pathTreeFrom(const Ptr<Location>& source) {
+        auto i = pathTrees_.find(source.ptr());
+        if (i == pathTrees_.end()) {
+            i = pathTrees_.insert(make_pair(source.ptr(), shortestPathTree(source))).first;
+        }
+        return i->second;
+    }
+
+    // Return the length of the shortest path from source to destination,
+    // or the largest double if there is none.
+    double legDistance(const Ptr<Location>& source, const Ptr<Location>& destination) {
+        const auto& tree = pathTreeFrom(source);
+        const auto i = tree.distance.find(destination.ptr());
+        return i == tree.distance.end() ? numeric_limits<double>::max() : i->second;
+    }
+
+    // Forget the trees, once the segments they were built from change.
+    void pathTreesDel() {
+        pathTrees_.clear();
+    }
+
     unsigned int numCacheHits() {
         return numCacheHits_;
     }
@@ -1411,6 +1919,7 @@ public:
     }
 
     double cacheEfficiency() {
+        if (numCacheChecks_ == 0) return 0;
         return double(numCacheHits_) / numCacheChecks_;
     }
 
@@ -1418,6 +1927,9 @@ public:
     NotifieeList& notifiees() {
         return notifiees_;
     }
+
+protected:
+    unordered_map<Location*, PathTree> pathTrees_;
 };
 
 /******************************************************************************
@@ -0,0 +1,355 @@
+/**
+ * TripTrace records what happens to each trip (its request, its vehicle
+ * being assigned, pickup, dropoff, and each hop its vehicle makes) as
+ * rows of a table, and writes them to a binary columnar file that can be
+ * read back row by row.
+ *
+ * When writing, rows are added with eventNew into column buffers that are
+ * allocated once, and the buffers are written out as a block whenever
+ * they fill up and when the trace is destroyed. Trips, vehicles and
+ * locations are referred to by ids handed out on first use, keyed by the
+ * entity's address, so a name is copied only once; the entities must
+ * outlive the trace. When reading, rowNext returns the rows in the order
+ * they were added and name returns the name an id stands for.
+ *
+ * The file starts with the 8 bytes "TRIPTRC1", followed by blocks that
+ * each start with a 4-byte type and a 4-byte number of rows n:
+ *
+ *     type 1, names -- n records of a 4-byte id, a 4-byte length, and the
+ *         name's characters, for the ids first used by the rows after it
+ *
+ *     type 2, events -- n rows stored one column after another:
+ *         n 8-byte times, in simulated seconds
+ *         n 4-byte trip ids
+ *         n 4-byte vehicle ids
+ *         n 4-byte location ids
+ *         n 1-byte events
+ *         n 8-byte values
+ *
+ * Ids that don't apply to a row are none. Integers and doubles are in the
+ * writer's byte order, which is little-endian on the machines we run on.
+ * Each event's row is:
+ *
+ *     requested  -- trip, its start location, value the party size
+ *     assigned   -- trip, vehicle, value 0
+ *     pickedUp   -- trip, vehicle, start location, value the trip's wait time
+ *     droppedOff -- trip, vehicle, end location, value 0
+ *     hop        -- trip, vehicle, the location it heads for, at the time
+ *                   it leaves, value the seconds it takes to get there
+ */
+
+#ifndef TRAVELSIM_TRIPTRACE_H
+#define TRAVELSIM_TRIPTRACE_H
+
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include "fwk/fwk.h"
+
+class TripTrace : public fwk::PtrInterface {
+public:
+
+    enum Mode {
+        writing,
+        reading
+    };
+
+    enum Event {
+        requested,
+        assigned,
+        pickedUp,
+        droppedOff,
+        hop
+    };
+
+    /** The id of an entity that doesn't apply to a row. */
+    static const U32 none = 0xffffffff;
+
+    struct Row {
+        double time;
+        U32 trip;
+        U32 vehicle;
+        U32 location;
+        Event event;
+        double value;
+    };
+
+
+    /**
+     * Return a trace that writes or reads the given file. A written trace
+     * buffers batchRows rows at a time.
+     */
+    static fwk::Ptr<TripTrace> instanceNew(
+        const string& fileName, const Mode mode, const size_t batchRows = 4096
+    ) {
+        return new TripTrace(fileName, mode, batchRows);
+    }
+
+    TripTrace(const TripTrace&) = delete;
+    void operator =(const TripTrace&) = delete;
+
+
+    Mode mode() const {
+        return mode_;
+    }
+
+    /** Return the number of rows added or read so far. */
+    U64 rows() const {
+        return rows_;
+    }
+
+    /**
+     * Return the id for the entity, which must have a name(), giving it
+     * the next id if it has none yet. A null entity is none.
+     */
+    template <class T>
+    U32 id(T* const entity) {
+        if (entity == null) {
+            return none;
+        }
+
+        const auto i = ids_.find(entity);
+        if (i != ids_.end()) {
+            return i->second;
+        }
+
+        const auto id = U32(ids_.size());
+        ids_[entity] = id;
+        newNames_.push_back(std::make_pair(id, entity->name()));
+        return id;
+    }
+
+    /** Add a row, writing out the buffered rows if they fill up. */
+    void eventNew(
+        const double time, const Event event, const U32 trip,
+        const U32 vehicle, const U32 location, const double value
+    ) {
+        times_.push_back(time);
+        trips_.push_back(trip);
+        vehicles_.push_back(vehicle);
+        locations_.push_back(location);
+        events_.push_back(U8(event));
+        values_.push_back(value);
+        ++rows_;
+        if (times_.size() == batchRows_) {
+            flush();
+        }
+    }
+
+    /** Write out the buffered rows. */
+    void flush() {
+        if (mode_ != writing) {
+            return;
+        }
+
+        if (!newNames_.empty()) {
+            u32Write(namesBlock);
+            u32Write(U32(newNames_.size()));
+            for (const auto& n : newNames_) {
+                u32Write(n.first);
+                u32Write(U32(n.second.size()));
+                file_.write(n.second.data(), std::streamsize(n.second.size()));
+            }
+            newNames_.clear();
+        }
+
+        if (!times_.empty()) {
+            u32Write(eventsBlock);
+            u32Write(U32(times_.size()));
+            columnWrite(times_);
+            columnWrite(trips_);
+            columnWrite(vehicles_);
+            columnWrite(locations_);
+            columnWrite(events_);
+            columnWrite(values_);
+            times_.clear();
+            trips_.clear();
+            vehicles_.clear();
+            locations_.clear();
+            events_.clear();
+            values_.clear();
+        }
+
+        file_.flush();
+        if (!file_) {
+            throw fwk::StorageException("can't write trip trace");
+        }
+    }
+
+    /**
+     * Read the next row into row and return true, or return false at the
+     * end of the trace.
+     */
+    bool rowNext(Row& row) {
+        while (next_ == times_.size()) {
+            if (!blockRead()) {
+                return false;
+            }
+        }
+
+        row.time = times_[next_];
+        row.trip = trips_[next_];
+        row.vehicle = vehicles_[next_];
+        row.location = locations_[next_];
+        row.event = Event(events_[next_]);
+        row.value = values_[next_];
+        ++next_;
+        ++rows_;
+        return true;
+    }
+
+    /** Return the name the id stands for in rows read so far. */
+    string name(const U32 id) const {
+        return id < names_.size() ? names_[id] : string();
+    }
+
+    static string eventName(const Event event) {
+        switch (event) {
+            case requested: return "requested";
+            case assigned: return "assigned";
+            case pickedUp: return "pickedUp";
+            case droppedOff: return "droppedOff";
+            case hop: return "hop";
+        }
+        return "unknown";
+    }
+
+protected:
+
+    static const U32 namesBlock = 1;
+    static const U32 eventsBlock = 2;
+
+    Mode mode_;
+    size_t batchRows_;
+    U64 rows_ = 0;
+    std::fstream file_;
+
+    /** Column buffers: rows to write, or the block being read. */
+    std::vector<double> times_;
+    std::vector<U32> trips_;
+    std::vector<U32> vehicles_;
+    std::vector<U32> locations_;
+    std::vector<U8> events_;
+    std::vector<double> values_;
+
+    /** Ids by entity and the names not yet written, when writing. */
+    std::unordered_map<const void*, U32> ids_;
+    std::vector<std::pair<U32, string>> newNames_;
+
+    /** Names by id and the next row of the block, when reading. */
+    std::vector<string> names_;
+    size_t next_ = 0;
+
+
+    TripTrace(const string& fileName, const Mode mode, const size_t batchRows) :
+        mode_(mode),
+        batchRows_(batchRows == 0 ? 1 : batchRows)
+    {
+        static const char magic[8] = { 'T', 'R', 'I', 'P', 'T', 'R', 'C', '1' };
+
+        if (mode == writing) {
+            file_.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file_) {
+                throw fwk::StorageException("can't create trip trace " + fileName);
+            }
+            file_.write(magic, sizeof(magic));
+            times_.reserve(batchRows_);
+            trips_.reserve(batchRows_);
+            vehicles_.reserve(batchRows_);
+            locations_.reserve(batchRows_);
+            events_.reserve(batchRows_);
+            values_.reserve(batchRows_);
+            return;
+        }
+
+        file_.open(fileName, std::ios::in | std::ios::binary);
+        char header[8];
+        if (!file_ || !file_.read(header, sizeof(header)) ||
+            !std::equal(header, header + sizeof(header), magic)
+        ) {
+            throw fwk::StorageException("can't read trip trace " + fileName);
+        }
+    }
+
+    ~TripTrace() {
+        if (mode_ == writing) {
+            try {
+                flush();
+            } catch (const fwk::StorageException& e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+
+
+    void u32Write(const U32 v) {
+        file_.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    template <class T>
+    void columnWrite(const std::vector<T>& column) {
+        file_.write(reinterpret_cast<const char*>(column.data()), std::streamsize(column.size() * sizeof(T)));
+    }
+
+    bool u32Read(U32& v) {
+        return bool(file_.read(reinterpret_cast<char*>(&v), sizeof(v)));
+    }
+
+    template <class T>
+    void columnRead(std::vector<T>& column, const U32 rows) {
+        column.resize(rows);
+        if (!file_.read(reinterpret_cast<char*>(column.data()), std::streamsize(rows * sizeof(T)))) {
+            throw fwk::StorageException("trip trace is truncated");
+        }
+    }
+
+    /**
+     * Read the next block, returning false at the end of the file. A
+     * names block leaves the row buffers empty.
+     */
+    bool blockRead() {
+        U32 type;
+        if (!u32Read(type)) {
+            return false;
+        }
+
+        U32 rows;
+        if (!u32Read(rows)) {
+            throw fwk::StorageException("trip trace is truncated");
+        }
+
+        next_ = 0;
+        if (type == namesBlock) {
+            times_.clear();
+            for (U32 i = 0; i < rows; ++i) {
+                U32 id, length;
+                if (!u32Read(id) || !u32Read(length)) {
+                    throw fwk::StorageException("trip trace is truncated");
+                }
+                string name(length, '\0');
+                if (length > 0 && !file_.read(&name[0], length)) {
+                    throw fwk::StorageException("trip trace is truncated");
+                }
+                if (id >= names_.size()) {
+                    names_.resize(id + 1);
+                }
+                names_[id] = name;
+            }
+            return true;
+        }
+
+        if (type != eventsBlock) {
+            throw fwk::StorageException("trip trace has an unknown block type");
+        }
+        columnRead(times_, rows);
+        columnRead(trips_, rows);
+        columnRead(vehicles_, rows);
+        columnRead(locations_, rows);
+        columnRead(events_, rows);
+        columnRead(values_, rows);
+        return true;
+    }
+
+};
+
+#endif
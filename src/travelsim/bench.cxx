@@ -0,0 +1,1120 @@
+// bench.cxx
+// Performance benchmarks for routing, the path cache, notifications, Ptr
+// and the fwk activity managers, written out as JSON so runs can be
+// compared to catch regressions.
+//
+// Usage: bench [--filter=TEXT] [--minTime=SECONDS] [--repetitions=N]
+//              [--out=FILE]
+//        bench --check
+//
+// Only benchmarks whose names contain TEXT run. Each runs its operation
+// enough times to take at least SECONDS (default 0.1), then repeats that
+// N times (default 5). The JSON goes to FILE, or to standard output, and
+// the name of each benchmark goes to standard error as it starts.
+//
+// The benchmarks are preceded by checks that the behavior they time is
+// still right, such as the order postings are delivered in and that the
+// managers give the same results on any number of workers. A failed
+// check is written to standard error and bench exits with status 1.
+// --check runs only the checks.
+//
+
+#include "fwk/fwk.h"
+#include <random>
+
+#include "TravelNetwork.h"
+#include <cmath>
+#include <fstream>
+
+using namespace fwk;
+using std::cout;
+using std::endl;
+using std::vector;
+
+/**
+ * Keep the compiler from optimizing away the computation of value.
+ */
+template <class T>
+inline void doNotOptimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r"(&value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+/**
+ * Harness times benchmarks and collects their results. A benchmark's body
+ * does its operation n times and returns the number of items it handled,
+ * usually n; times are reported per item.
+ */
+class Harness {
+public:
+
+    typedef std::function<U64(U64 n)> Body;
+
+    struct Result {
+        string name;
+        U64 iterations;
+        vector<double> nsPerItem;
+    };
+
+    Harness(const string& filter, const double minSeconds, const unsigned repetitions) :
+        filter_(filter),
+        minNanoseconds_(minSeconds * 1e9),
+        repetitions_(repetitions == 0 ? 1 : repetitions)
+    {
+        // Nothing else to do.
+    }
+
+    /** Return whether the benchmark with the given name runs. */
+    bool wanted(const string& name) const {
+        return filter_.empty() || name.find(filter_) != string::npos;
+    }
+
+    /**
+     * Run the benchmark, if its name matches the filter. The number of
+     * iterations grows until one run takes minSeconds, and then that many
+     * are timed repetitions times.
+     */
+    void benchmarkNew(const string& name, const Body& body) {
+        if (!wanted(name)) {
+            return;
+        }
+        std::cerr << name << std::endl;
+
+        U64 n = 1;
+        for (;;) {
+            U64 items;
+            const auto ns = timed(body, n, items);
+            if (ns >= minNanoseconds_ || n >= maxIterations) {
+                break;
+            }
+            const auto estimate = ns > 0 ? double(n) * minNanoseconds_ * 1.2 / ns : double(n) * 100;
+            n = U64(std::min(std::max(estimate, double(n) * 2), double(n) * 100));
+        }
+
+        Result result;
+        result.name = name;
+        result.iterations = n;
+        for (unsigned i = 0; i < repetitions_; ++i) {
+            U64 items;
+            const auto ns = timed(body, n, items);
+            result.nsPerItem.push_back(ns / double(items == 0 ? 1 : items));
+        }
+        results_.push_back(result);
+    }
+
+    /**
+     * Write the results as a JSON object with a context and a list of
+     * benchmarks, each with its median, minimum and maximum nanoseconds
+     * per item over the repetitions and its items per second at the
+     * median.
+     */
+    void resultsWritten(std::ostream& out) const {
+        out << "{\n";
+        out << "  \"context\": {\n";
+        out << "    \"date\": \"" << dateTimeAsString(time(SystemTime::now())) << "\",\n";
+#ifdef __VERSION__
+        out << "    \"compiler\": " << quoted(__VERSION__) << ",\n";
+#endif
+#ifdef FWK_ATOMIC_PTR
+        out << "    \"atomic_ptr\": true,\n";
+#else
+        out << "    \"atomic_ptr\": false,\n";
+#endif
+        out << "    \"tsc\": " << (SystemTime::tsc() ? "true" : "false") << ",\n";
+        out << "    \"ns_per_tick\": " << SystemTime::nanosecondsPerTick() << ",\n";
+        out << "    \"min_time\": " << minNanoseconds_ / 1e9 << ",\n";
+        out << "    \"repetitions\": " << repetitions_ << "\n";
+        out << "  },\n";
+        out << "  \"benchmarks\": [";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const auto& r = results_[i];
+            auto sorted = r.nsPerItem;
+            std::sort(sorted.begin(), sorted.end());
+            const auto median = sorted[sorted.size() / 2];
+            out << (i == 0 ? "\n" : ",\n");
+            out << "    {\n";
+            out << "      \"name\": " << quoted(r.name) << ",\n";
+            out << "      \"iterations\": " << r.iterations << ",\n";
+            out << "      \"time_unit\": \"ns\",\n";
+            out << "      \"real_time\": " << median << ",\n";
+            out << "      \"min_time\": " << sorted.front() << ",\n";
+            out << "      \"max_time\": " << sorted.back() << ",\n";
+            out << "      \"items_per_second\": " << (median > 0 ? 1e9 / median : 0) << "\n";
+            out << "    }";
+        }
+        out << "\n  ]\n}\n";
+        out.flush();
+    }
+
+protected:
+
+    static const U64 maxIterations = 1000000000;
+
+    string filter_;
+    double minNanoseconds_;
+    unsigned repetitions_;
+    vector<Result> results_;
+
+
+    static double timed(const Body& body, const U64 n, U64& items) {
+        const auto start = SystemTime::nanoseconds();
+        items = body(n);
+        return double(SystemTime::nanoseconds() - start);
+    }
+
+    static string quoted(const string& s) {
+        string q = "\"";
+        for (const auto c : s) {
+            if (c == '"' || c == '\\') {
+                q += '\\';
+            }
+            q += c;
+        }
+        return q + "\"";
+    }
+
+};
+
+/******************************************************************************
+ * Synthetic networks
+ *****************************************************************************/
+
+typedef vector<std::tuple<size_t, size_t, double>> Edges;
+
+/** Add a Road each way between locations a and b. */
+void twoWayEdgeNew(Edges& edges, const size_t a, const size_t b, const double length) {
+    edges.push_back(std::make_tuple(a, b, length));
+    edges.push_back(std::make_tuple(b, a, length));
+}
+
+/**
+ * Return a new network of Residences named loc0, loc1, ... with a Road
+ * for each edge, from its first location to its second.
+ */
+Ptr<TravelNetwork> networkNew(const string& name, const size_t locations, const Edges& edges) {
+    const auto tn = TravelNetwork::instanceNew(name);
+    tn->conn("conn");
+    vector<Ptr<Location>> locs;
+    for (size_t i = 0; i < locations; ++i) {
+        const Ptr<Location> loc = Residence::instanceNew("loc" + std::to_string(i));
+        tn->locationNew(loc);
+        locs.push_back(loc);
+    }
+
+    for (size_t i = 0; i < edges.size(); ++i) {
+        const Ptr<Segment> seg = Road::instanceNew("seg" + std::to_string(i));
+        tn->segmentNew(seg);
+        seg->sourceIs(locs[std::get<0>(edges[i])]);
+        seg->destinationIs(locs[std::get<1>(edges[i])]);
+        seg->lengthIs(std::get<2>(edges[i]));
+    }
+    return tn;
+}
+
+/** A width by height grid, with edges 1 to 10 miles long. */
+Ptr<TravelNetwork> gridNetworkNew(const size_t width, const size_t height, std::mt19937& rng) {
+    std::uniform_real_distribution<double> length(1, 10);
+    Edges edges;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            const auto i = y * width + x;
+            if (x + 1 < width) {
+                twoWayEdgeNew(edges, i, i + 1, length(rng));
+            }
+            if (y + 1 < height) {
+                twoWayEdgeNew(edges, i, i + width, length(rng));
+            }
+        }
+    }
+    return networkNew("grid", width * height, edges);
+}
+
+/**
+ * A random geometric graph: n points in a 100-mile square, joined when
+ * they are closer than the radius that makes the graph connected with
+ * high probability, by edges as long as the distance between them.
+ */
+Ptr<TravelNetwork> geometricNetworkNew(const size_t n, std::mt19937& rng) {
+    std::uniform_real_distribution<double> coord(0, 100);
+    vector<std::pair<double, double>> points;
+    for (size_t i = 0; i < n; ++i) {
+        const auto x = coord(rng);
+        points.push_back(std::make_pair(x, coord(rng)));
+    }
+
+    const auto radius = 100 * std::sqrt(2 * std::log(double(n)) / (3.14159265358979 * double(n)));
+    Edges edges;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = i + 1; j < n; ++j) {
+            const auto d = std::hypot(points[i].first - points[j].first, points[i].second - points[j].second);
+            if (d < radius) {
+                twoWayEdgeNew(edges, i, j, d);
+            }
+        }
+    }
+    return networkNew("geometric", n, edges);
+}
+
+/**
+ * A scale-free graph grown by preferential attachment: each new location
+ * joins two existing ones chosen in proportion to their degree, by edges
+ * 1 to 50 miles long.
+ */
+Ptr<TravelNetwork> scaleFreeNetworkNew(const size_t n, std::mt19937& rng) {
+    std::uniform_real_distribution<double> length(1, 50);
+    Edges edges;
+    twoWayEdgeNew(edges, 0, 1, length(rng));
+
+    // Each location appears once per edge it has, so a uniform pick from
+    // ends is a pick in proportion to degree
+    vector<size_t> ends = { 0, 1 };
+    for (size_t i = 2; i < n; ++i) {
+        std::uniform_int_distribution<size_t> pick(0, ends.size() - 1);
+        const auto a = ends[pick(rng)];
+        auto b = a;
+        while (b == a) {
+            b = ends[pick(rng)];
+        }
+        for (const auto j : { a, b }) {
+            twoWayEdgeNew(edges, i, j, length(rng));
+            ends.push_back(i);
+            ends.push_back(j);
+        }
+    }
+    return networkNew("scaleFree", n, edges);
+}
+
+/**
+ * The base network of travelsim1 with copies connected to it in a chain,
+ * as setupConnectedParallelNetworks builds them.
+ */
+Ptr<TravelNetwork> parallelNetworkNew(const size_t copies) {
+    // Copy c's stanford, menlopark, sfo and lax are 4c, 4c + 1, 4c + 2
+    // and 4c + 3
+    Edges edges;
+    for (size_t c = 0; c <= copies; ++c) {
+        const auto stanford = 4 * c, menlopark = stanford + 1, sfo = stanford + 2, lax = stanford + 3;
+        twoWayEdgeNew(edges, stanford, sfo, 20);
+        edges.push_back(std::make_tuple(menlopark, stanford, 20.0));
+        edges.push_back(std::make_tuple(sfo, menlopark, 20.0));
+        twoWayEdgeNew(edges, stanford, menlopark, 5);
+        twoWayEdgeNew(edges, sfo, lax, 350);
+        if (c > 0) {
+            for (size_t k = 0; k < 4; ++k) {
+                twoWayEdgeNew(edges, stanford - 4 + k, stanford + k, 50);
+            }
+        }
+    }
+    return networkNew("parallel", 4 * (copies + 1), edges);
+}
+
+/******************************************************************************
+ * Benchmarks
+ *****************************************************************************/
+
+/**
+ * Benchmark routing on the network, per call: findShortestPath on a
+ * cycle of more distinct pairs than its LRU cache holds, so every call
+ * misses and searches; findShortestPath on one pair, so every call hits
+ * the cache; and shortestPathTree from each pair's source. Search costs
+ * vary a lot between pairs, so every iteration goes around the whole
+ * cycle and each run does the same work.
+ */
+void routingBenchmarksNew(
+    Harness& h, const string& name, const Ptr<TravelNetwork>& tn,
+    const size_t locations, std::mt19937& rng
+) {
+    const string prefix = "routing/" + name + "/";
+    const auto conn = tn->conn("conn");
+    vector<Ptr<Location>> locs;
+    for (size_t i = 0; i < locations; ++i) {
+        locs.push_back(tn->location("loc" + std::to_string(i)));
+    }
+
+    const size_t numPairs = 24;
+    vector<std::pair<Ptr<Location>, Ptr<Location>>> pairs;
+    std::set<std::pair<Location*, Location*>> seen;
+    std::uniform_int_distribution<size_t> pick(0, locs.size() - 1);
+    while (pairs.size() < numPairs && seen.size() < locs.size() * (locs.size() - 1)) {
+        const auto a = locs[pick(rng)];
+        const auto b = locs[pick(rng)];
+        if (a != b && seen.insert(std::make_pair(a.ptr(), b.ptr())).second) {
+            pairs.push_back(std::make_pair(a, b));
+        }
+    }
+
+    h.benchmarkNew(prefix + "findShortestPath", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            for (const auto& p : pairs) {
+                const auto path = conn->findShortestPath(p.first, p.second);
+                doNotOptimize(path);
+            }
+        }
+        return n * pairs.size();
+    });
+
+    if (h.wanted(prefix + "findShortestPath/cached")) {
+        conn->findShortestPath(pairs[0].first, pairs[0].second);
+    }
+    h.benchmarkNew(prefix + "findShortestPath/cached", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            const auto path = conn->findShortestPath(pairs[0].first, pairs[0].second);
+            doNotOptimize(path);
+        }
+        return n;
+    });
+
+    h.benchmarkNew(prefix + "shortestPathTree", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            for (const auto& p : pairs) {
+                const auto tree = conn->shortestPathTree(p.first);
+                doNotOptimize(tree);
+            }
+        }
+        return n * pairs.size();
+    });
+}
+
+/**
+ * Benchmark the path cache as Conn uses it, with string keys and paths
+ * of 8 segments: inserting when full, so each insert evicts, looking up
+ * an entry that is there, and checking for one that isn't.
+ */
+void cacheBenchmarksNew(Harness& h) {
+    typedef pair<vector<Ptr<Segment>>, double> Path;
+    const size_t capacity = 20;
+    const size_t numKeys = 64;
+
+    vector<string> keys;
+    for (size_t i = 0; i < numKeys; ++i) {
+        keys.push_back("loc" + std::to_string(i) + "->loc" + std::to_string(numKeys - i));
+    }
+    Path path;
+    for (int i = 0; i < 8; ++i) {
+        path.first.push_back(Road::instanceNew("seg" + std::to_string(i)));
+    }
+    path.second = 42;
+
+    Cache<string, Path> cache(capacity);
+    for (const auto& key : keys) {
+        cache.cacheEntryIs(key, path);
+    }
+
+    h.benchmarkNew("cache/cacheEntryIs", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            cache.cacheEntryIs(keys[i % numKeys], path);
+        }
+        return n;
+    });
+
+    for (size_t i = 0; i < capacity; ++i) {
+        cache.cacheEntryIs(keys[i], path);
+    }
+
+    h.benchmarkNew("cache/cacheEntry/hit", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            const auto p = cache.cacheEntry(keys[i % capacity]);
+            doNotOptimize(p);
+        }
+        return n;
+    });
+
+    h.benchmarkNew("cache/containsCacheEntry/miss", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            const auto found = cache.containsCacheEntry(keys[capacity + i % (numKeys - capacity)]);
+            doNotOptimize(found);
+        }
+        return n;
+    });
+}
+
+/** CountingNotifiee counts the onNextTime notifications it is sent. */
+class CountingNotifiee : public Activity::Notifiee {
+public:
+
+    static Ptr<CountingNotifiee> instanceNew(const Ptr<Activity>& a) {
+        const Ptr<CountingNotifiee> n = new CountingNotifiee();
+        n->notifierIs(a);
+        return n;
+    }
+
+    void onNextTime() {
+        ++count_;
+    }
+
+    U64 count() const {
+        return count_;
+    }
+
+protected:
+
+    U64 count_ = 0;
+
+};
+
+/**
+ * Benchmark NotifierLib::post of a notification delivered immediately to
+ * each of the given numbers of notifiees.
+ */
+void postBenchmarksNew(Harness& h) {
+    const auto mgr = SequentialManager::instanceNew();
+    for (const size_t notifiees : { 1, 4, 16 }) {
+        const auto a = mgr->activityNew("notifier" + std::to_string(notifiees));
+        vector<Ptr<CountingNotifiee>> list;
+        for (size_t i = 0; i < notifiees; ++i) {
+            list.push_back(CountingNotifiee::instanceNew(a));
+        }
+
+        h.benchmarkNew("notify/post/" + std::to_string(notifiees), [&](const U64 n) {
+            for (U64 i = 0; i < n; ++i) {
+                NotifierLib::post(a.ptr(), &Activity::Notifiee::onNextTime);
+            }
+            return n;
+        });
+        doNotOptimize(list.front()->count());
+        mgr->activityDel(a->name());
+    }
+}
+
+/** Benchmark copying a Ptr, which adds and removes a reference. */
+void ptrBenchmarksNew(Harness& h) {
+    const Ptr<Location> loc = Residence::instanceNew("loc");
+
+    h.benchmarkNew("ptr/copy", [&](const U64 n) {
+        for (U64 i = 0; i < n; ++i) {
+            const Ptr<Location> copy = loc;
+            doNotOptimize(copy);
+        }
+        return n;
+    });
+
+    h.benchmarkNew("ptr/assign", [&](const U64 n) {
+        Ptr<Location> p;
+        for (U64 i = 0; i < n; ++i) {
+            p = loc;
+            doNotOptimize(p);
+            p = null;
+        }
+        return n;
+    });
+}
+
+/**
+ * HoldSim is the classic "hold" model for measuring an event queue:
+ * each time its activity runs, it reschedules the activity a random
+ * delay into the future.
+ */
+class HoldSim : public Activity::Notifiee {
+public:
+
+    static Ptr<HoldSim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const string& name,
+        std::default_random_engine& rng, U64& events
+    ) {
+        const Ptr<HoldSim> sim = new HoldSim(rng, events);
+        const auto a = mgr->activityNew(name);
+        sim->notifierIs(a);
+        a->nextTimeIsOffset(sim->delay());
+        a->statusIs(Activity::scheduled);
+        mgr->activityAdd(a);
+        return sim;
+    }
+
+    void onStatus() {
+        const auto a = notifier();
+        if (a->status() == Activity::running) {
+            ++events_;
+            a->nextTimeIsOffset(delay());
+        }
+    }
+
+protected:
+
+    std::default_random_engine& rng_;
+    std::exponential_distribution<double> delay_;
+    U64& events_;
+
+
+    HoldSim(std::default_random_engine& rng, U64& events) :
+        rng_(rng),
+        delay_(1.0),
+        events_(events)
+    {
+        // Nothing else to do.
+    }
+
+    double delay() {
+        return delay_(rng_);
+    }
+
+};
+
+/**
+ * Benchmark the manager's nowIs on the hold model with the given number
+ * of activities. Each activity runs once per unit of time on average, so
+ * a run of n items advances the time by n / activities; items are the
+ * activity runs that actually happened.
+ */
+void holdBenchmarkNew(
+    Harness& h, const string& name, const Ptr<ActivityManager>& mgr,
+    const unsigned long activities
+) {
+    const auto benchmark = "manager/hold/" + name + "/" + std::to_string(activities);
+    if (!h.wanted(benchmark)) {
+        return;
+    }
+
+    std::default_random_engine rng(1);
+    U64 events = 0;
+    vector<Ptr<HoldSim>> sims;
+    for (unsigned long i = 0; i < activities; ++i) {
+        sims.push_back(HoldSim::instanceNew(mgr, "hold" + std::to_string(i), rng, events));
+    }
+
+    h.benchmarkNew(benchmark, [&](const U64 n) {
+        const auto before = events;
+        mgr->nowIs(mgr->now() + double(n) / double(activities));
+        return events - before;
+    });
+}
+
+/**
+ * Check that postings made while a reaction runs are delivered next, in
+ * the order they were made and ahead of older postings, however deeply
+ * they nest: each reaction here posts two more, three levels down, so
+ * the reactions must run in preorder. Return whether they did.
+ */
+bool postingOrderChecked() {
+    const auto mgr = SequentialManager::instanceNew();
+    const auto a = mgr->activityNew("postingOrder");
+    string order;
+    std::function<void(const string&)> postingNew = [&](const string& label) {
+        a->postingNew(null, [&, label]() {
+            order += " " + label;
+            if (label.size() < 3) {
+                postingNew(label + "a");
+                postingNew(label + "b");
+            }
+        });
+    };
+    postingNew("x");
+    postingNew("y");
+    mgr->nowIs(mgr->now() + 1);
+
+    const string expected =
+        " x xa xaa xab xb xba xbb"
+        " y ya yaa yab yb yba ybb";
+    if (order != expected) {
+        std::cerr << "Postings delivered out of order:" << order << endl;
+        std::cerr << "                        expected:" << expected << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * MoveRecorder writes each move of its vehicle to a log shared by every
+ * vehicle. It belongs to no activity, so under BatchManager the moves
+ * reach it when the batch's effects are applied.
+ */
+class MoveRecorder : public Vehicle::Notifiee {
+public:
+
+    static Ptr<MoveRecorder> instanceNew(
+        const Ptr<Vehicle>& vehicle, const Ptr<ActivityManager>& mgr, string& log
+    ) {
+        const Ptr<MoveRecorder> r = new MoveRecorder(mgr, log);
+        r->notifierIs(vehicle);
+        return r;
+    }
+
+    void onLocation() {
+        log_ += " " + std::to_string(int(mgr_->now().value())) + ":" +
+            notifier()->name() + "@" + notifier()->location()->name();
+    }
+
+protected:
+
+    Ptr<ActivityManager> mgr_;
+    string& log_;
+
+
+    MoveRecorder(const Ptr<ActivityManager>& mgr, string& log) :
+        mgr_(mgr),
+        log_(log)
+    {
+        // Belong to no activity, not to whichever ran last on this thread.
+        activityIs(null);
+    }
+
+};
+
+/**
+ * ShuttleSim moves its own vehicle between its own two locations each
+ * time its activity runs, then reschedules the activity one to three
+ * units of time later. Many shuttles share each time, so their runs make
+ * batches of several tasks. A shuttle touches nothing of any other, so
+ * it can run on any worker of any manager.
+ */
+class ShuttleSim : public Activity::Notifiee {
+public:
+
+    static Ptr<ShuttleSim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const unsigned long index, string& log
+    ) {
+        const auto name = "shuttle" + std::to_string(index);
+        const Ptr<ShuttleSim> sim = new ShuttleSim(index);
+        sim->ends_[0] = Residence::instanceNew(name + "a");
+        sim->ends_[1] = Residence::instanceNew(name + "b");
+        sim->vehicle_ = Car::instanceNew(name);
+        sim->vehicle_->locationIs(sim->ends_[0]);
+        sim->recorder_ = MoveRecorder::instanceNew(sim->vehicle_, mgr, log);
+
+        const auto a = mgr->activityNew(name);
+        sim->notifierIs(a);
+        a->nextTimeIs(1);
+        a->statusIs(Activity::scheduled);
+        mgr->activityAdd(a);
+        return sim;
+    }
+
+    void onStatus() {
+        const auto a = notifier();
+        if (a->status() == Activity::running) {
+            ++runs_;
+            vehicle_->locationIs(ends_[runs_ % 2]);
+            a->nextTimeIsOffset(1 + (index_ + runs_) % 3);
+        }
+    }
+
+protected:
+
+    unsigned long index_;
+    unsigned long runs_ = 0;
+    Ptr<Location> ends_[2];
+    Ptr<Vehicle> vehicle_;
+    Ptr<MoveRecorder> recorder_;
+
+
+    ShuttleSim(const unsigned long index) :
+        index_(index)
+    {
+        // Belong to no activity, not to whichever ran last on this thread.
+        activityIs(null);
+    }
+
+};
+
+/**
+ * Run shuttles on the manager until time 40 and return the log of their
+ * moves, in the order the recorders were told of them.
+ */
+string shuttleLog(const Ptr<ActivityManager>& mgr) {
+    string log;
+    vector<Ptr<ShuttleSim>> sims;
+    for (unsigned long i = 0; i < 32; ++i) {
+        sims.push_back(ShuttleSim::instanceNew(mgr, i, log));
+    }
+    mgr->nowIs(40);
+    return log;
+}
+
+/**
+ * Check that BatchManager gives the sequential result whatever its number
+ * of workers, with the batches big enough to run on its worker pool.
+ * Return whether it did.
+ */
+bool batchResultsChecked() {
+    const auto expected = shuttleLog(SequentialManager::instanceNew());
+    for (const unsigned long workers : { 1, 2, 4 }) {
+        const auto mgr = BatchManager::instanceNew(workers);
+        const auto log = shuttleLog(mgr);
+        if (mgr->taskCount() <= mgr->batchCount() * mgr->minBatchSize()) {
+            std::cerr << "BatchManager with " << workers << " workers ran too few tasks per batch" << endl;
+            return false;
+        }
+        if (log != expected) {
+            std::cerr << "BatchManager with " << workers << " workers differed from SequentialManager:" << endl;
+            std::cerr << "  " << log << endl;
+            std::cerr << "expected:" << endl;
+            std::cerr << "  " << expected << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Placement of an activity in a partition of a partitioned manager, which
+ * does nothing under the other managers.
+ */
+typedef std::function<void(const Ptr<Activity>&, unsigned long)> Placement;
+
+/**
+ * CourierSim logs a run of its activity, on behalf of the relay run that
+ * sent it, to the log of its partition. Each courier is sent at most
+ * once, so the sender is the only other partition that ever touches it,
+ * and only before sending it.
+ */
+class CourierSim : public Activity::Notifiee {
+public:
+
+    static Ptr<CourierSim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const string& name, string& log
+    ) {
+        const Ptr<CourierSim> sim = new CourierSim(log);
+        sim->notifierIs(mgr->activityNew(name));
+        return sim;
+    }
+
+    void labelIs(const string& label) {
+        label_ = label;
+    }
+
+    void onStatus() {
+        const auto a = notifier();
+        if (a->status() == Activity::running) {
+            StateLog::saved(log_);
+            log_ += " " + std::to_string(int(a->manager()->now().value())) + ":" + label_;
+        }
+    }
+
+protected:
+
+    string& log_;
+    string label_;
+
+
+    CourierSim(string& log) :
+        log_(log)
+    {
+        // Belong to no activity, not to whichever ran last on this thread.
+        activityIs(null);
+    }
+
+};
+
+/**
+ * RelaySim logs each run of its activity to the log of its partition,
+ * reschedules it one to three units of time later and, on each run,
+ * sends a courier to another partition to run delay units of time later
+ * or one after that. So runs in a partition tie with couriers from other
+ * partitions, and the order they run in depends on the order they were
+ * scheduled in. Its state is saved in the StateLog, so its runs can be
+ * rolled back, and the relays of partition 0 spin for spin iterations
+ * per run, so that the other partitions run ahead of it.
+ *
+ * A run that is rolled back and run again sends a courier it hasn't sent
+ * before, and sets up the courier's schedule without saving it. That
+ * way a rollback never touches a courier that the other partition may be
+ * running or rolling back, since its anti-message is enough to cancel
+ * the courier.
+ */
+class RelaySim : public Activity::Notifiee {
+public:
+
+    static Ptr<RelaySim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const Placement& placed,
+        const unsigned long index, const unsigned long partitions,
+        const Time delay, const unsigned long spin, vector<string>& logs
+    ) {
+        const auto name = "relay" + std::to_string(index);
+        const auto partition = index % partitions;
+        const Ptr<RelaySim> sim = new RelaySim(
+            index, partitions, delay, partition == 0 ? spin : 0, logs[partition]
+        );
+        for (unsigned long p = 0; p < partitions; ++p) {
+            sim->couriers_.push_back(vector<Ptr<CourierSim>>());
+            sim->courierActivities_.push_back(vector<Ptr<Activity>>());
+            sim->sends_.push_back(0);
+            for (unsigned long i = 0; p != partition && i < courierCount; ++i) {
+                const auto courier = CourierSim::instanceNew(
+                    mgr, name + "." + std::to_string(p) + "." + std::to_string(i), logs[p]
+                );
+                placed(courier->notifier(), p);
+                sim->couriers_[p].push_back(courier);
+                sim->courierActivities_[p].push_back(courier->notifier());
+            }
+        }
+
+        const auto a = mgr->activityNew(name);
+        placed(a, partition);
+        sim->notifierIs(a);
+        a->nextTimeIs(1);
+        a->statusIs(Activity::scheduled);
+        mgr->activityAdd(a);
+        return sim;
+    }
+
+    void onStatus() {
+        const auto a = notifier();
+        if (a->status() != Activity::running) {
+            return;
+        }
+
+        for (unsigned long i = 0; i < spin_; ++i) {
+            doNotOptimize(i);
+        }
+
+        const auto label = a->name() + "." + std::to_string(runs_);
+        StateLog::saved(log_);
+        log_ += " " + std::to_string(int(a->manager()->now().value())) + ":" + label;
+
+        const auto p = (index_ + 1 + runs_ % (partitions_ - 1)) % partitions_;
+        if (sends_[p] < courierCount) {
+            const auto i = sends_[p]++;
+            couriers_[p][i]->labelIs(label);
+            const auto& courier = courierActivities_[p][i];
+            const auto log = StateLog::current();
+            StateLog::currentIs(null);
+            courier->nextTimeIs(a->manager()->now() + delay_ + runs_ % 2);
+            courier->statusIs(Activity::scheduled);
+            StateLog::currentIs(log);
+            a->manager()->activityAdd(courier);
+        }
+
+        StateLog::saved(runs_);
+        ++runs_;
+        a->nextTimeIsOffset(1 + (index_ + runs_) % 3);
+    }
+
+protected:
+
+    /** Couriers for each other partition, enough for every run to be rolled back many times. */
+    static const unsigned long courierCount = 320;
+
+    unsigned long index_;
+    unsigned long partitions_;
+    Time delay_;
+    unsigned long spin_;
+    string& log_;
+    unsigned long runs_ = 0;
+    vector<vector<Ptr<CourierSim>>> couriers_;
+    vector<vector<Ptr<Activity>>> courierActivities_;
+
+    /** Couriers sent to each partition, which a rollback leaves alone. */
+    vector<unsigned long> sends_;
+
+
+    RelaySim(
+        const unsigned long index, const unsigned long partitions,
+        const Time delay, const unsigned long spin, string& log
+    ) :
+        index_(index),
+        partitions_(partitions),
+        delay_(delay),
+        spin_(spin),
+        log_(log)
+    {
+        // Belong to no activity, not to whichever ran last on this thread.
+        activityIs(null);
+    }
+
+};
+
+/**
+ * Run relays over the given number of partitions on the manager until
+ * time 40, ten units of time at a time, with couriers sent delay units of
+ * time ahead, and return the logs of the partitions, one after the other.
+ */
+string relayLog(
+    const Ptr<ActivityManager>& mgr, const Placement& placed,
+    const unsigned long partitions, const Time delay, const unsigned long spin
+) {
+    vector<string> logs(partitions);
+    vector<Ptr<RelaySim>> sims;
+    for (unsigned long i = 0; i < 4 * partitions; ++i) {
+        sims.push_back(RelaySim::instanceNew(mgr, placed, i, partitions, delay, spin, logs));
+    }
+    for (auto t = 10; t <= 40; t += 10) {
+        mgr->nowIs(t);
+    }
+
+    string log;
+    for (unsigned long p = 0; p < partitions; ++p) {
+        log += " |" + logs[p];
+    }
+    return log;
+}
+
+/**
+ * Check that ParallelManager gives the sequential result whatever its
+ * number of workers, with schedules between partitions that respect the
+ * lookahead. Return whether it did.
+ */
+bool parallelResultsChecked() {
+    const unsigned long partitions = 4;
+    const Time lookahead = 2;
+    const auto expected = relayLog(
+        SequentialManager::instanceNew(), [](const Ptr<Activity>&, unsigned long) {},
+        partitions, lookahead, 0
+    );
+    for (const unsigned long workers : { 1, 2, 4 }) {
+        const auto mgr = ParallelManager::instanceNew(partitions);
+        mgr->workerCountIs(workers);
+        mgr->lookaheadIs(lookahead);
+        const auto log = relayLog(
+            mgr, [&](const Ptr<Activity>& a, const unsigned long p) { mgr->partitionIs(a, p); },
+            partitions, lookahead, 0
+        );
+        if (log != expected) {
+            std::cerr << "ParallelManager with " << workers << " workers differed from SequentialManager:" << endl;
+            std::cerr << "  " << log << endl;
+            std::cerr << "expected:" << endl;
+            std::cerr << "  " << expected << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Check that OptimisticManager commits the sequential result whatever its
+ * number of workers, with couriers sent for the same or the next time,
+ * so that runs tie across partitions. Partition 0 is slowed down, so the
+ * others run ahead and are rolled back by its couriers, and the runs
+ * rolled back send anti-messages in turn. Return whether it did, and
+ * whether the runs with more than one worker rolled anything back.
+ */
+bool optimisticResultsChecked() {
+    const unsigned long partitions = 4;
+    const unsigned long spin = 20000;
+    const auto expected = relayLog(
+        SequentialManager::instanceNew(), [](const Ptr<Activity>&, unsigned long) {},
+        partitions, 0, spin
+    );
+    unsigned long rollbacks = 0;
+    unsigned long antiMessages = 0;
+    for (const unsigned long workers : { 1, 2, 4, 4, 4 }) {
+        const auto mgr = OptimisticManager::instanceNew(partitions);
+        mgr->workerCountIs(workers);
+        const auto log = relayLog(
+            mgr, [&](const Ptr<Activity>& a, const unsigned long p) { mgr->partitionIs(a, p); },
+            partitions, 0, spin
+        );
+        if (log != expected) {
+            std::cerr << "OptimisticManager with " << workers << " workers differed from SequentialManager:" << endl;
+            std::cerr << "  " << log << endl;
+            std::cerr << "expected:" << endl;
+            std::cerr << "  " << expected << endl;
+            return false;
+        }
+        if (workers == 1 && mgr->rollbackCount() != 0) {
+            std::cerr << "OptimisticManager with one worker rolled back " << mgr->rollbackCount() << " runs" << endl;
+            return false;
+        }
+        rollbacks += mgr->rollbackCount();
+        antiMessages += mgr->antiMessageCount();
+    }
+    if (rollbacks == 0 || antiMessages == 0) {
+        std::cerr << "OptimisticManager rolled back " << rollbacks << " runs and sent "
+            << antiMessages << " anti-messages, so rollback went unchecked" << endl;
+        return false;
+    }
+    return true;
+}
+
+/** NullBuf is a stream buffer that throws away what is written to it. */
+class NullBuf : public std::streambuf {
+protected:
+
+    int overflow(const int c) {
+        return c;
+    }
+
+};
+
+int main(int argc, char *argv[]) {
+    string filter;
+    double minSeconds = 0.1;
+    unsigned repetitions = 5;
+    string outFile;
+    bool checkOnly = false;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--check") {
+            checkOnly = true;
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+            filter = arg.substr(9);
+        } else if (arg.compare(0, 10, "--minTime=") == 0) {
+            minSeconds = std::stod(arg.substr(10));
+        } else if (arg.compare(0, 14, "--repetitions=") == 0) {
+            repetitions = unsigned(std::stoul(arg.substr(14)));
+        } else if (arg.compare(0, 6, "--out=") == 0) {
+            outFile = arg.substr(6);
+        } else {
+            std::cerr << "Usage: bench [--filter=TEXT] [--minTime=SECONDS] "
+                "[--repetitions=N] [--out=FILE]" << endl;
+            std::cerr << "       bench --check" << endl;
+            return 1;
+        }
+    }
+
+    if (!postingOrderChecked() || !batchResultsChecked() ||
+        !parallelResultsChecked() || !optimisticResultsChecked()
+    ) {
+        return 1;
+    }
+    if (checkOnly) {
+        return 0;
+    }
+
+    // The network and Conn chatter on cout; keep it out of the results
+    NullBuf nullBuf;
+    std::ostream out(cout.rdbuf());
+    std::ofstream file;
+    if (!outFile.empty()) {
+        file.open(outFile);
+        if (!file) {
+            std::cerr << "Can't write " << outFile << endl;
+            return 1;
+        }
+        out.rdbuf(file.rdbuf());
+    }
+    cout.rdbuf(&nullBuf);
+
+    Harness h(filter, minSeconds, repetitions);
+
+    // Each network gets its own seed, so it is the same whatever the filter
+    struct NetworkSpec {
+        string name;
+        size_t locations;
+        std::function<Ptr<TravelNetwork>(std::mt19937&)> network;
+    };
+    const vector<NetworkSpec> networks = {
+        { "grid/64", 64, [](std::mt19937& r) { return gridNetworkNew(8, 8, r); } },
+        { "grid/144", 144, [](std::mt19937& r) { return gridNetworkNew(12, 12, r); } },
+        { "geometric/64", 64, [](std::mt19937& r) { return geometricNetworkNew(64, r); } },
+        { "geometric/144", 144, [](std::mt19937& r) { return geometricNetworkNew(144, r); } },
+        { "scaleFree/100", 100, [](std::mt19937& r) { return scaleFreeNetworkNew(100, r); } },
+        { "scaleFree/400", 400, [](std::mt19937& r) { return scaleFreeNetworkNew(400, r); } },
+        { "parallel/4", 20, [](std::mt19937&) { return parallelNetworkNew(4); } },
+        { "parallel/16", 68, [](std::mt19937&) { return parallelNetworkNew(16); } },
+        { "parallel/64", 260, [](std::mt19937&) { return parallelNetworkNew(64); } },
+    };
+    for (const auto& spec : networks) {
+        const auto prefix = "routing/" + spec.name + "/";
+        if (h.wanted(prefix + "findShortestPath") || h.wanted(prefix + "findShortestPath/cached") ||
+            h.wanted(prefix + "shortestPathTree")
+        ) {
+            std::mt19937 rng(1);
+            routingBenchmarksNew(h, spec.name, spec.network(rng), spec.locations, rng);
+        }
+    }
+
+    cacheBenchmarksNew(h);
+    postBenchmarksNew(h);
+    ptrBenchmarksNew(h);
+
+    for (const unsigned long activities : { 100, 10000, 100000 }) {
+        holdBenchmarkNew(h, "heap", SequentialManager::instanceNew(), activities);
+        holdBenchmarkNew(h, "calendar", CalendarManager::instanceNew(), activities);
+    }
+
+    h.resultsWritten(out);
+    return 0;
+}
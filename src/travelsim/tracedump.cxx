@@ -0,0 +1,91 @@
+// tracedump.cxx
+// Print a trip trace written by travelsim1 --trace=FILE, as CSV rows or,
+// with --summary, as counts and times per trip.
+//
+
+#include "fwk/fwk.h"
+#include "TripTrace.h"
+#include <iostream>
+
+using namespace fwk;
+using std::cerr;
+using std::cout;
+using std::endl;
+
+static void rowsPrinted(const Ptr<TripTrace>& trace) {
+    cout << "time,event,trip,vehicle,location,value" << endl;
+    cout.precision(15);
+    TripTrace::Row row;
+    while (trace->rowNext(row)) {
+        cout << row.time << ","
+             << TripTrace::eventName(row.event) << ","
+             << trace->name(row.trip) << ","
+             << trace->name(row.vehicle) << ","
+             << trace->name(row.location) << ","
+             << row.value << endl;
+    }
+}
+
+static void summaryPrinted(const Ptr<TripTrace>& trace) {
+    unsigned long events[TripTrace::hop + 1] = {};
+    double requested = 0, cumWait = 0, cumDuration = 0;
+    std::unordered_map<U32, double> requestTimes;
+    TripTrace::Row row;
+    while (trace->rowNext(row)) {
+        ++events[row.event];
+        if (row.event == TripTrace::requested) {
+            requestTimes[row.trip] = row.time;
+            ++requested;
+        } else if (row.event == TripTrace::pickedUp) {
+            cumWait += row.value;
+        } else if (row.event == TripTrace::droppedOff) {
+            const auto i = requestTimes.find(row.trip);
+            if (i != requestTimes.end()) {
+                cumDuration += row.time - i->second;
+                requestTimes.erase(i);
+            }
+        }
+    }
+
+    cout << "rows:\t" << trace->rows() << endl;
+    for (int e = TripTrace::requested; e <= TripTrace::hop; ++e) {
+        cout << TripTrace::eventName(TripTrace::Event(e)) << ":\t" << events[e] << endl;
+    }
+    if (events[TripTrace::pickedUp] > 0) {
+        cout << "averageWait:\t" << cumWait / events[TripTrace::pickedUp] / 60 << " minutes." << endl;
+    }
+    if (events[TripTrace::droppedOff] > 0) {
+        cout << "averageRequestToDropoff:\t" << cumDuration / events[TripTrace::droppedOff] / 60 << " minutes." << endl;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool summary = false;
+    string fileName;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg == "--summary") {
+            summary = true;
+        } else {
+            fileName = arg;
+        }
+    }
+    if (fileName.empty()) {
+        cerr << "usage: tracedump [--summary] FILE" << endl;
+        return 1;
+    }
+
+    try {
+        const auto trace = TripTrace::instanceNew(fileName, TripTrace::reading);
+        if (summary) {
+            summaryPrinted(trace);
+        } else {
+            rowsPrinted(trace);
+        }
+    } catch (const Exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
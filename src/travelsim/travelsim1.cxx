@@ -2,9 +2,23 @@
 #include <random>
 
 #include "TravelNetwork.h"
+#include "Hungarian.h"
+#include "TripTrace.h"
 #include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <map>
+
+// Peak memory and child processes, for batch runs and sweeps
+#ifdef _WIN32
+#   include <psapi.h>
+#   define popen _popen
+#   define pclose _pclose
+#else
+#   include <sys/resource.h>
+#   include <sys/wait.h>
+#endif
 
 using namespace fwk;
 using std::find;
@@ -32,6 +46,55 @@ vector<string> allVehicleNames;
 vector<string> allTripNames;
 vector<string> allSegmentNames;
 
+// Log the run is recorded to or replayed from, if any
+Ptr<ReplayLog> replayLog;
+
+// Log components, so each kind of sim's lines can be turned up or down
+const Log::Component mainLog = Log::instance()->componentNew("main");
+const Log::Component tripRequesterLog = Log::instance()->componentNew("TripRequesterSim");
+const Log::Component tripSimLog = Log::instance()->componentNew("TripSim");
+const Log::Component vehicleSimLog = Log::instance()->componentNew("VehicleSim");
+const Log::Component serviceSimLog = Log::instance()->componentNew("ServiceSim");
+const Log::Component rebalancerLog = Log::instance()->componentNew("RebalancerSim");
+
+// Whether log lines are formatted and written by the log's own thread
+bool asyncLogging = true;
+
+// Whether the FWK_TIMED call sites are timed and reported at the end
+bool timersEnabled = false;
+
+// File the profile's folded stacks are written to at the end, if any
+string profileFile;
+
+// Whether the run is headless: the scenario comes from the options instead
+// of the chooser, and a one-line JSON summary replaces the report
+bool batchMode = false;
+
+// Seed of the random numbers
+U32 randomSeed = 1;
+
+// Trace each trip's progress is written to, if any
+Ptr<TripTrace> tripTrace;
+
+// Whether TripSims wake once per leg instead of once per segment
+bool expressTrips = false;
+
+// Whether ServiceSim matches trips and vehicles in batches instead of
+// giving each trip the nearest vehicle as it arrives, and how long it
+// collects trips and vehicles before matching them
+bool batchedDispatch = false;
+double dispatchWindowInSeconds = 60;
+
+// Whether ServiceSim pools riders into shared vehicles, and the most a
+// pooled trip may delay any stop already planned, in minutes
+bool ridePooling = false;
+double maxDetourInMinutes = 10;
+
+// How often RebalancerSim moves idle vehicles toward demand, or 0 for
+// never, and how quickly the demand it remembers fades
+double rebalancePeriodInSeconds = 0;
+const double demandDecayInSeconds = 3600;
+
 /********************************************************************************
 * Helper Classes and Functions                                                  *
 *********************************************************************************/
@@ -43,18 +106,54 @@ string majorTripMessage(Ptr<Trip> trip, string message) {
 }
 
 /**
- * Helper class for random number generation.
+ * Return the parallel sub-network a location belongs to: 0 for the base
+ * network ("stanford1", ...) and i for the i-th copy ("stanford<i+1>", ...).
+ */
+unsigned long locationPartition(const Ptr<Location>& location) {
+    const auto& name = location->name();
+    const auto digits = name.find_last_not_of("0123456789") + 1;
+    if (digits == name.size()) {
+        return 0;
+    }
+
+    return std::stoul(name.substr(digits)) - 1;
+}
+
+/**
+ * Place a new activity in the given partition if the manager is partitioned.
+ */
+void activityPartitionIs(const Ptr<ActivityManager>& mgr, const Ptr<Activity>& activity, const unsigned long partition) {
+    const Ptr<ParallelManager> parallel = dynamic_cast<ParallelManager*>(mgr.ptr());
+    if (parallel != null) {
+        parallel->partitionIs(activity, partition);
+        return;
+    }
+
+    const Ptr<OptimisticManager> optimistic = dynamic_cast<OptimisticManager*>(mgr.ptr());
+    if (optimistic != null) {
+        optimistic->partitionIs(activity, partition);
+    }
+}
+
+/**
+ * Helper class for random number generation. Draws go through the replay
+ * log when there is one, so a replayed run gets the recorded values.
  */
 class Random : public PtrInterface {
 public:
 
-    static Ptr<Random> instanceNew() {
-        return new Random();
+    static Ptr<Random> instanceNew(const U32 seed) {
+        return new Random(seed);
     }
 
 
     double normal(const double mean, const double dev) {
-        return dev * distribution_(generator_) + mean;
+        return drawn(dev * distribution_(generator_) + mean);
+    }
+
+    /** Return a uniformly distributed index less than n. */
+    size_t index(const size_t n) {
+        return size_t(drawn(double(generator_() % n)));
     }
 
     double normalRange(
@@ -80,16 +179,68 @@ protected:
     std::normal_distribution<double> distribution_;
 
 
-    Random() :
-        generator_(U32(SystemTime::now().value() & 0xffffffff)),
+    Random(const U32 seed) :
+        generator_(seed),
         distribution_(0.0, 1.0)
     {
         // Nothing else to do.
     }
+
+    static double drawn(const double value) {
+        if (replayLog != null) {
+            return replayLog->draw(value);
+        }
+
+        return value;
+    }
 };
 
-static void logEntryNew(const Time t, const string& s) {
-    std::cout << timeMilliAsString(t) << " " << s << std::endl;
+/**
+ * Write a log line made of args for the component at the given level, if
+ * the component writes that level. In a batch, lines are logged when the
+ * batch's effects are applied, so they come out in the same order for any
+ * number of workers.
+ */
+template <class... Args>
+static void logEntryNew(
+    const Log::Component component, const Log::Level level, const Time t, const Args&... args
+) {
+    const auto log = Log::instance();
+    if (!log->enabled(component, level)) {
+        return;
+    }
+
+    const Log::Record record(component, level, t, args...);
+    if (EffectBuffer::current() == null) {
+        log->recordNew(record);
+        return;
+    }
+    EffectBuffer::effectNew([record]() {
+        Log::instance()->recordNew(record);
+    });
+}
+
+/**
+ * Add a row to the trip trace, if there is one. In a batch, rows are added
+ * when the batch's effects are applied, like log lines.
+ */
+static void traceEventNew(
+    const Time t, const TripTrace::Event event, const Ptr<Trip>& trip,
+    const Ptr<Vehicle>& vehicle, const Ptr<Location>& location, const double value
+) {
+    if (tripTrace == null) {
+        return;
+    }
+
+    const auto add = [=]() {
+        tripTrace->eventNew(t.value(), event, tripTrace->id(trip.ptr()),
+            tripTrace->id(vehicle.ptr()), tripTrace->id(location.ptr()), value);
+    };
+    if (EffectBuffer::current() == null) {
+        add();
+    } else {
+        EffectBuffer::effectNew(add);
+    }
 }
 
 void locationNew(
@@ -156,7 +307,8 @@ void tripNew(
 * Global Variables (cont'd)                                                     *
 *********************************************************************************/
 
-static Ptr<Random> rng = Random::instanceNew();
+// Created in main from the --seed option
+static Ptr<Random> rng;
 
 
 /********************************************************************************
@@ -203,7 +355,7 @@ public:
         if (a->status() == Activity::running) {
             requestTrip(travelNetwork_, tripNum_, simNum_);
             Ptr<Trip> trip = travelNetwork_->trip(tripNameFromNum(tripNum_));
-            logEntryNew(a->manager()->now(), majorTripMessage(trip, "Requested Trip:"));
+            logEntryNew(tripRequesterLog, Log::info, a->manager()->now(), majorTripMessage(trip, "Requested Trip:"));
             tripNum_++;
             if (!randomTimes) {
                 a->nextTimeIsOffset(timeBetweenRequestsInSeconds);
@@ -226,20 +378,26 @@ protected:
         return oss.str();
     }
 
+    // Parties of up to three share pooled vehicles; otherwise a trip books
+    // a whole vehicle, whatever its capacity.
+    size_t partySize() {
+        return ridePooling ? 1 + rng->index(3) : 30;
+    }
+
     void requestTrip(Ptr<TravelNetwork>& tn, unsigned int tripNum, unsigned int simNum) {
         string tripName = tripNameFromNum(tripNum);
         if (simNum == 1) {
-            tripNew(tn, tripName, "menlopark1", "stanford1", 30);
+            tripNew(tn, tripName, "menlopark1", "stanford1", partySize());
         } else if (simNum == 2) {
-            tripNew(tn, tripName, "menlopark1", "sfo1", 30);
+            tripNew(tn, tripName, "menlopark1", "sfo1", partySize());
         } else if (simNum == 3) {
-            int randomIndex = rand() % allLocationNames.size();
-            int randomIndex2 = rand() % allLocationNames.size();
+            const auto randomIndex = rng->index(allLocationNames.size());
+            auto randomIndex2 = rng->index(allLocationNames.size());
             while (randomIndex == randomIndex2) {
-                randomIndex2 = rand() % allLocationNames.size();
+                randomIndex2 = rng->index(allLocationNames.size());
             }
             // cout << randomIndex << ", " << randomIndex2 << "\n\n";
-            tripNew(tn, tripName, allLocationNames[randomIndex], allLocationNames[randomIndex2], 30);
+            tripNew(tn, tripName, allLocationNames[randomIndex], allLocationNames[randomIndex2], partySize());
         }
     }
 
@@ -255,7 +413,8 @@ protected:
 
 
 /**
- * TripSim is the simulator logic for a trip.
+ * TripSim is the simulator logic for a trip, written as a coroutine that
+ * waits for the vehicle to cross each segment of the trip's path.
  */
 class TripSim : public Sim {
 public:
@@ -263,102 +422,441 @@ public:
     static Ptr<TripSim> instanceNew(
         const Ptr<ActivityManager>& mgr, const Ptr<Trip>& trip
     ) {
-        return new TripSim(mgr->activityNew(trip->name()+"Sim"), trip);
+        const auto a = mgr->activityNew(trip->name()+"Sim");
+        activityPartitionIs(mgr, a, locationPartition(trip->startLocation()));
+        return new TripSim(a, trip);
     }
 
+protected:
 
-    void onStatus() {
-        const auto a = notifier();
-        if (a->status() == Activity::running) {
-            // Trip::waitingForVehicle
-            if (trip_->status() == Trip::waitingForVehicle) {
-                logEntryNew(a->manager()->now(), majorTripMessage(trip_, "Started Trip"));
-                const auto currLoc = trip_->vehicle()->location();
-                Time timeToNextLoc;
-                if (currLoc->name() != trip_->startLocation()->name()) {
-                    // cout << "Found that a started trip has vehicle at " << currLoc->name() << "and startLocation() " << trip_->startLocation()->name() << endl; //debug
-                    const auto currSeg = trip_->path()[0];
-                    trip_->statusIs(Trip::goingToPickup);
-                    timeToNextLoc = currSeg->length().value() / trip_->vehicle()->speed().value() * minutesPerHour * secondsPerMinute;
-                    logEntryNew(a->manager()->now(), "[" + trip_->name() + "]: Trip::waitingForVehicle -> Trip::goingToPickup. (Expected: " + timeMilliAsString(notifier()->manager()->now() + timeToNextLoc) + ").");
-                } else {
-                    cout << "Found that a started trip has vehicle at " << currLoc->name() << "and startLocation() " << trip_->startLocation()->name() << endl; //debug
-                    trip_->statusIs(Trip::goingToDropoff);
-                    timeToNextLoc = 0;
-                    logEntryNew(a->manager()->now(), "[" + trip_->name() + "]: Trip::waitingForVehicle -> Trip::goingToDropoff. (Expected: " + timeMilliAsString(notifier()->manager()->now() + timeToNextLoc) + ").");
-                }
-                a->nextTimeIsOffset(timeToNextLoc);
-
-            // Trip::goingToPickup
-            } else if (trip_->status() == Trip::goingToPickup) {
-                const auto currLoc = trip_->vehicle()->location();
-                if (currLoc == trip_->startLocation()) {
-                    // calculate the new path from start to end location
-                    pair<vector<Ptr<Segment>>, double> pathDistPair = trip_->travelNetwork()->conn("conn")->findShortestPath(currLoc, trip_->endLocation());
-                    vector<Ptr<Segment>> shortestPath = pathDistPair.first;
-                    trip_->pathIs(shortestPath);
-                    trip_->statusIs(Trip::goingToDropoff);
-                    cout << trip_->name() << ": " << trip_->startLocation()->name() << ".." << currLoc->name() << "->" << trip_->endLocation()->name() << endl; // debug
-                    const auto currSeg = trip_->path()[0];
-                    Time timeToNextLoc = currSeg->length().value() / trip_->vehicle()->speed().value() * minutesPerHour * secondsPerMinute;
-                    logEntryNew(a->manager()->now(), "[" + trip_->name() + "]: Trip::goingToPickup -> Trip::goingToDropoff. (Expected: " + timeMilliAsString(notifier()->manager()->now() + timeToNextLoc) + ").");
-                    a->nextTimeIsOffset(timeToNextLoc);
-                } else {
-                    for (unsigned int i = 0; i < trip_->path().size(); i++) {
-                        const auto currSeg = trip_->path()[i];
-                        if (currLoc == currSeg->source()) {
-                            trip_->vehicle()->locationIs(currSeg->destination());
-                            Time timeToNextLoc = currSeg->length().value() / trip_->vehicle()->speed().value() * minutesPerHour * secondsPerMinute;
-                            logEntryNew(a->manager()->now(), "[" + trip_->name() + "]:\t\t " + currLoc->name() + " -> " + currSeg->destination()->name() + ". (Expected: " + timeMilliAsString(notifier()->manager()->now() + timeToNextLoc) + ").");
-                            a->nextTimeIsOffset(timeToNextLoc);
-                            return;
-                        }
-                    }
-                }
-            // Trip::goingToDropoff
-            } else if (trip_->status() == Trip::goingToDropoff){
-                const auto currLoc = trip_->vehicle()->location();
-                if (currLoc == trip_->endLocation()) {
-                    logEntryNew(a->manager()->now(), "[" + trip_->name() + "]: Trip::goingToDropoff -> Trip::droppedOff.");
-                    trip_->statusIs(Trip::droppedOff);
-                    a->statusIs(Activity::stopped);
-                    logEntryNew(a->manager()->now(), majorTripMessage(trip_, "Finished Trip"));
-                } else {
-                    for (unsigned int i = 0; i < trip_->path().size(); i++) {
-                        const auto currSeg = trip_->path()[i];
-                        if (currLoc == currSeg->source()) {
-                            trip_->vehicle()->locationIs(currSeg->destination());
-                            Time timeToNextLoc = currSeg->length().value() / trip_->vehicle()->speed().value() * minutesPerHour * secondsPerMinute;
-                            logEntryNew(a->manager()->now(), "[" + trip_->name() + "]:\t\t " + currLoc->name() + " -> " + currSeg->destination()->name() + ". (Expected: " + timeMilliAsString(notifier()->manager()->now() + timeToNextLoc) + ").");
-                            a->nextTimeIsOffset(timeToNextLoc);
-                            return;
-                        }
-                    }
-                }
+    Ptr<Trip> trip_;
+    Coroutine run_;
+
+
+    TripSim(const Ptr<Activity>& activity, const Ptr<Trip>& trip) :
+        trip_(trip),
+        run_(run())
+    {
+        activityIs(activity);
+        const auto mgr = activity->manager();
+        activity->immediateDeliveryFlagIs(false);
+        run_.activityIs(activity);
+        activity->nextTimeIs(mgr->now());
+        activity->statusIs(Activity::scheduled);
+        mgr->activityAdd(activity);
+        notifierIs(activity);
+    }
+
+
+    Time now() {
+        return notifier()->manager()->now();
+    }
+
+    /**
+     * Return the index of the segment of the trip's path that leaves the
+     * location, or the path's size if there is none. This is normally
+     * the segment at the path cursor or the one after it.
+     */
+    size_t segmentFrom(const Ptr<Location>& loc) {
+        return segmentFrom(loc, trip_->pathCursor().index);
+    }
+
+    size_t segmentFrom(const Ptr<Location>& loc, const size_t i) {
+        const auto& path = trip_->path();
+        for (auto j = i; j < i + 2 && j < path.size(); ++j) {
+            if (path[j]->source() == loc) {
+                return j;
+            }
+        }
+
+        for (size_t j = 0; j < path.size(); ++j) {
+            if (path[j]->source() == loc) {
+                return j;
+            }
+        }
+
+        return path.size();
+    }
+
+    /** Move the path cursor to segment i, which takes time t to cross. */
+    void pathCursorIs(const size_t i, const Time t) {
+        Trip::PathCursor cursor;
+        cursor.index = i;
+        cursor.departure = now();
+        cursor.arrival = now() + t;
+        trip_->pathCursorIs(cursor);
+    }
+
+    /**
+     * Move the vehicle across the segment of the path that leaves its
+     * location and set timeToNextLoc to the time that takes. Returns
+     * false if the path doesn't leave the vehicle's location.
+     */
+    bool hopStarted(Time& timeToNextLoc) {
+        const auto currLoc = trip_->vehicle()->location();
+        const auto i = segmentFrom(currLoc);
+        if (i == trip_->path().size()) {
+            return false;
+        }
+
+        const auto& currSeg = trip_->path()[i];
+        trip_->vehicle()->locationIs(currSeg->destination());
+        timeToNextLoc = trip_->crossingTime(currSeg);
+        pathCursorIs(i, timeToNextLoc);
+        traceEventNew(now(), TripTrace::hop, trip_, trip_->vehicle(), currSeg->destination(), timeToNextLoc.value());
+        logEntryNew(tripSimLog, Log::debug, now(), "[", trip_->name(), "]:\t\t ", currLoc->name(), " -> ", currSeg->destination()->name(), ". (Expected: ", now() + timeToNextLoc, ").");
+        return true;
+    }
+
+    /**
+     * Return whether to move the vehicle a whole leg at a time. Express
+     * mode is only used while nothing is watching the vehicle.
+     */
+    bool express() {
+        return expressTrips && trip_->vehicle()->notifiees().size() == 0;
+    }
+
+    /**
+     * Give the vehicle a route along the path from its location to target,
+     * stopping early if the path doesn't leave where it is, and set
+     * timeToNextLoc to the time the route takes. The vehicle's location
+     * follows the route when it is asked for. Returns false if the route
+     * has no hops.
+     */
+    bool routeStarted(const Ptr<Location>& target, Time& timeToNextLoc) {
+        const auto& path = trip_->path();
+        Vehicle::Route route;
+        route.clock = notifier()->manager();
+        auto loc = trip_->vehicle()->location();
+        auto i = trip_->pathCursor().index;
+        auto t = now();
+        while (loc != target) {
+            i = segmentFrom(loc, i);
+            if (i == path.size()) {
+                break;
+            }
+
+            if (route.hops.empty()) {
+                pathCursorIs(i, trip_->crossingTime(path[i]));
             }
+            Vehicle::Hop hop;
+            hop.time = t;
+            hop.location = path[i]->destination();
+            route.hops.push_back(hop);
+            traceEventNew(t, TripTrace::hop, trip_, trip_->vehicle(), hop.location, trip_->crossingTime(path[i]).value());
+            t = t + trip_->crossingTime(path[i]);
+            loc = hop.location;
         }
+
+        if (route.hops.empty()) {
+            return false;
+        }
+
+        const auto from = trip_->vehicle()->location();
+        trip_->vehicle()->routeIs(route);
+        timeToNextLoc = t - now();
+        logEntryNew(tripSimLog, Log::debug, now(), "[", trip_->name(), "]:\t\t ", from->name(), " -> ", loc->name(), " in ", route.hops.size(), " segments. (Expected: ", t, ").");
+        return true;
+    }
+
+    /**
+     * Start the vehicle on its next hop, or on the rest of the leg to
+     * target in express mode.
+     */
+    bool moveStarted(const Ptr<Location>& target, Time& timeToNextLoc) {
+        if (express()) {
+            return routeStarted(target, timeToNextLoc);
+        }
+
+        return hopStarted(timeToNextLoc);
+    }
+
+    /**
+     * Drive the trip's vehicle to the pickup and then to the destination,
+     * waiting for it to cross each segment, or each leg in express mode.
+     * The trip's path cursor keeps the segment it is on, so each hop takes
+     * constant time. Stops early if the vehicle is at a location the path
+     * doesn't leave.
+     */
+    Coroutine run() {
+        Time timeToNextLoc;
+
+        // Trip::waitingForVehicle
+        logEntryNew(tripSimLog, Log::info, now(), majorTripMessage(trip_, "Started Trip"));
+        const auto startLoc = trip_->vehicle()->location();
+        if (startLoc->name() != trip_->startLocation()->name()) {
+            trip_->statusIs(Trip::goingToPickup);
+            timeToNextLoc = trip_->crossingTime(trip_->path()[0]);
+            pathCursorIs(0, timeToNextLoc);
+            logEntryNew(tripSimLog, Log::info, now(), "[", trip_->name(), "]: Trip::waitingForVehicle -> Trip::goingToPickup. (Expected: ", now() + timeToNextLoc, ").");
+            co_await after(timeToNextLoc);
+        } else {
+            trip_->pathIs(trip_->travelNetwork()->conn("conn")->findShortestPath(startLoc, trip_->endLocation()).first);
+            trip_->statusIs(Trip::goingToDropoff);
+            logEntryNew(tripSimLog, Log::info, now(), "[", trip_->name(), "]: Trip::waitingForVehicle -> Trip::goingToDropoff. (Expected: ", now(), ").");
+            co_await after(0);
+        }
+
+        // Trip::goingToPickup
+        while (trip_->status() == Trip::goingToPickup) {
+            const auto currLoc = trip_->vehicle()->location();
+            if (currLoc == trip_->startLocation()) {
+                // calculate the new path from start to end location
+                pair<vector<Ptr<Segment>>, double> pathDistPair = trip_->travelNetwork()->conn("conn")->findShortestPath(currLoc, trip_->endLocation());
+                trip_->pathIs(pathDistPair.first);
+                trip_->statusIs(Trip::goingToDropoff);
+                timeToNextLoc = trip_->crossingTime(trip_->path()[0]);
+                pathCursorIs(0, timeToNextLoc);
+                logEntryNew(tripSimLog, Log::info, now(), "[", trip_->name(), "]: Trip::goingToPickup -> Trip::goingToDropoff. (Expected: ", now() + timeToNextLoc, ").");
+                co_await after(timeToNextLoc);
+                break;
+            }
+
+            if (!moveStarted(trip_->startLocation(), timeToNextLoc)) {
+                co_return;
+            }
+            co_await after(timeToNextLoc);
+        }
+
+        // Trip::goingToDropoff
+        while (trip_->vehicle()->location() != trip_->endLocation()) {
+            if (!moveStarted(trip_->endLocation(), timeToNextLoc)) {
+                co_return;
+            }
+            co_await after(timeToNextLoc);
+        }
+
+        logEntryNew(tripSimLog, Log::info, now(), "[", trip_->name(), "]: Trip::goingToDropoff -> Trip::droppedOff.");
+        trip_->statusIs(Trip::droppedOff);
+        notifier()->statusIs(Activity::stopped);
+        logEntryNew(tripSimLog, Log::info, now(), majorTripMessage(trip_, "Finished Trip"));
+    }
+};
+
+
+
+
+/**
+ * VehicleSim drives a pooled vehicle through its planned stops, picking
+ * up and dropping off trips as it reaches them. The plan may change while
+ * the vehicle is moving, so it heads for whichever stop is first each
+ * time it reaches a location, and waits for new stops when it has none.
+ */
+class VehicleSim : public Sim {
+public:
+
+    static Ptr<VehicleSim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const Ptr<Vehicle>& vehicle
+    ) {
+        const auto a = mgr->activityNew(vehicle->name() + "Sim");
+        return new VehicleSim(a, vehicle);
+    }
+
+    Ptr<Vehicle> vehicle() {
+        return vehicle_;
     }
 
 protected:
 
-    Ptr<Trip> trip_;
+    Ptr<Vehicle> vehicle_;
+    Coroutine run_;
 
 
-    TripSim(const Ptr<Activity>& activity, const Ptr<Trip>& trip) :
-        trip_(trip)
+    VehicleSim(const Ptr<Activity>& activity, const Ptr<Vehicle>& vehicle) :
+        vehicle_(vehicle),
+        run_(run())
     {
-        activityIs(activity);
         const auto mgr = activity->manager();
         activity->immediateDeliveryFlagIs(false);
+        run_.activityIs(activity);
         activity->nextTimeIs(mgr->now());
         activity->statusIs(Activity::scheduled);
         mgr->activityAdd(activity);
         notifierIs(activity);
     }
+
+
+    Time now() {
+        return notifier()->manager()->now();
+    }
+
+    /** Make the first stop, which is at the vehicle's location. */
+    void stopMade() {
+        auto stops = vehicle_->stops();
+        const auto stop = stops.front();
+        stops.erase(stops.begin());
+        vehicle_->stopsIs(stops);
+
+        const auto& trip = stop.trip;
+        if (stop.pickup) {
+            vehicle_->passengersIs(vehicle_->passengers().value() + trip->numTravelers().value());
+            trip->waitTimeIs(now() - stop.assigned);
+            logEntryNew(vehicleSimLog, Log::info, now(), "[", vehicle_->name(), "]: picked up ", trip->name(), " at ", stop.location->name(), " (", vehicle_->passengers().value(), " on board)");
+            trip->statusIs(Trip::goingToDropoff);
+        } else {
+            vehicle_->passengersIs(vehicle_->passengers().value() - trip->numTravelers().value());
+            logEntryNew(vehicleSimLog, Log::info, now(), "[", vehicle_->name(), "]: dropped off ", trip->name(), " at ", stop.location->name(), " (", vehicle_->passengers().value(), " on board)");
+            trip->statusIs(Trip::droppedOff);
+            logEntryNew(vehicleSimLog, Log::info, now(), majorTripMessage(trip, "Finished Trip"));
+        }
+    }
+
+    /**
+     * Move the vehicle across the first segment of the shortest path to
+     * its next stop and set timeToNextLoc to the time that takes. Returns
+     * false, dropping the stop, if the stop can't be reached.
+     */
+    bool hopStarted(Time& timeToNextLoc) {
+        const auto currLoc = vehicle_->location();
+        const auto& next = vehicle_->stops().front();
+        const auto path = vehicle_->travelNetwork()->conn("conn")->pathTreeFrom(currLoc).path(next.location);
+        if (path.empty()) {
+            logEntryNew(vehicleSimLog, Log::info, now(), "[", vehicle_->name(), "]: can't reach ", next.location->name(), " for ", next.trip->name());
+            auto stops = vehicle_->stops();
+            stops.erase(stops.begin());
+            vehicle_->stopsIs(stops);
+            return false;
+        }
+
+        const auto& seg = path.front();
+        vehicle_->locationIs(seg->destination());
+        timeToNextLoc = seg->length().value() / vehicle_->speed().value() * minutesPerHour * secondsPerMinute;
+        traceEventNew(now(), TripTrace::hop, next.trip, vehicle_, seg->destination(), timeToNextLoc.value());
+        logEntryNew(vehicleSimLog, Log::debug, now(), "[", vehicle_->name(), "]:\t\t ", currLoc->name(), " -> ", seg->destination()->name(), ". (Expected: ", now() + timeToNextLoc, ").");
+        return true;
+    }
+
+    Coroutine run() {
+        Time timeToNextLoc;
+        for (;;) {
+            while (vehicle_->stops().size() > 0 &&
+                vehicle_->stops().front().location == vehicle_->location()
+            ) {
+                stopMade();
+            }
+
+            if (vehicle_->stops().empty()) {
+                co_await notification(vehicle_, &Vehicle::Notifiee::onStops);
+                continue;
+            }
+
+            if (hopStarted(timeToNextLoc)) {
+                co_await after(timeToNextLoc);
+            }
+        }
+    }
 };
 
 
+/**
+ * Pool holds idle vehicles or waiting trips in arrival order and, alongside,
+ * in buckets by location, so either order can be scanned and any entry can
+ * be removed in constant time.
+ */
+template <class T>
+class Pool {
+public:
+
+    typedef std::list<Ptr<T>> List;
+    typedef typename List::const_iterator const_iterator;
+    typedef unordered_map<Location*, List> Buckets;
+
+    size_t size() const {
+        return index_.size();
+    }
+
+    // All entries, oldest first
+    const_iterator begin() const {
+        return all_.begin();
+    }
+    const_iterator end() const {
+        return all_.end();
+    }
+
+    // The entries by location, each bucket oldest first
+    const Buckets& buckets() const {
+        return buckets_;
+    }
+
+    // The entries at the location, oldest first
+    const List& bucket(Location* const location) const {
+        static const List empty;
+        const auto i = buckets_.find(location);
+        return i == buckets_.end() ? empty : i->second;
+    }
+
+    // Add the entry at the location, unless it's already in the pool
+    void push(const Ptr<T>& t, Location* const location) {
+        if (index_.find(t.ptr()) != index_.end()) {
+            return;
+        }
+
+        auto& bucket = buckets_[location];
+        all_.push_back(t);
+        bucket.push_back(t);
+        index_[t.ptr()] = Entry{location, std::prev(all_.end()), std::prev(bucket.end()), pushes_++};
+    }
+
+    // Return how many entries were added before this one, which must be in
+    // the pool
+    U64 order(const Ptr<T>& t) const {
+        return index_.at(t.ptr()).order;
+    }
+
+    // Move the entry, which must be in the pool, to the bucket of the new
+    // location, keeping the bucket oldest first
+    void locationIs(const Ptr<T>& t, Location* const location) {
+        auto& entry = index_.at(t.ptr());
+        if (entry.location == location) {
+            return;
+        }
+
+        const auto b = buckets_.find(entry.location);
+        b->second.erase(entry.inBucket);
+        if (b->second.empty()) {
+            buckets_.erase(b);
+        }
+
+        auto& bucket = buckets_[location];
+        auto i = bucket.end();
+        while (i != bucket.begin() && index_.at(std::prev(i)->ptr()).order > entry.order) {
+            --i;
+        }
+        entry.location = location;
+        entry.inBucket = bucket.insert(i, t);
+    }
+
+    // Remove the entry, returning whether it was in the pool
+    bool del(const Ptr<T>& t) {
+        const auto i = index_.find(t.ptr());
+        if (i == index_.end()) {
+            return false;
+        }
+
+        const auto b = buckets_.find(i->second.location);
+        all_.erase(i->second.inAll);
+        b->second.erase(i->second.inBucket);
+        if (b->second.empty()) {
+            buckets_.erase(b);
+        }
+        index_.erase(i);
+        return true;
+    }
+
+private:
+
+    struct Entry {
+        Location* location;
+        typename List::iterator inAll;
+        typename List::iterator inBucket;
+        U64 order;
+    };
 
+    List all_;
+    Buckets buckets_;
+    unordered_map<T*, Entry> index_;
+    U64 pushes_ = 0;
+};
 
 /**
  * ServiceSim is the simulator logic for a service that dispatches vehicles to trips. 
@@ -375,52 +873,105 @@ public:
         return sim;
     }
 
+    void onStatus() {
+        if (notifier()->status() == Activity::running) {
+            dispatchBatch();
+        }
+    }
+
+    // Idle vehicles, up to date with any routes they are following
+    const Pool<Vehicle>& idleVehicles() {
+        idleVehiclesCaughtUp();
+        return availableVehicles_;
+    }
+
+    /**
+     * Bring idle vehicles on a route up to date, which moves them to the
+     * bucket of wherever the route has taken them by now.
+     */
+    void idleVehiclesCaughtUp() {
+        for (auto i = availableVehicles_.begin(); i != availableVehicles_.end(); ++i) {
+            if ((*i)->route().clock != null) {
+                (*i)->location();
+            }
+        }
+    }
+
     void onTravelNetworkTripNew(const Ptr<Trip>& trip) {
+        if (ridePooling) {
+            if (!pooledTripAssigned(trip)) {
+                waitingTrips_.push(trip, trip->startLocation().ptr());
+                logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), "]: will not schedule trip because no vehicle can take it");
+            }
+            return;
+        }
+        if (batchedDispatch) {
+            waitingTrips_.push(trip, trip->startLocation().ptr());
+            dispatchScheduled();
+            logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), "]: will match trip in the next dispatch batch");
+            return;
+        }
         if (availableVehicles_.size() > 0) {
             assignNearestAvailableVehicle(trip);
             if (trip->vehicle() != null) {
-                logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + trip->name() + "," + trip->vehicle()->name() + "]: will schedule trip with assigned vehicle");
+                logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), ",", trip->vehicle()->name(), "]: will schedule trip with assigned vehicle");
                 return;
             }
         }
-        waitingTrips_.push_back(trip); // Push back the trip if I can't find a vehicle that can service it
-        logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + trip->name() + "]: will not schedule trip because no available reachable vehicle");
+        waitingTrips_.push(trip, trip->startLocation().ptr()); // Queue the trip if I can't find a vehicle that can service it
+        logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), "]: will not schedule trip because no available reachable vehicle");
     }
 
     void onTravelNetworkTripDel(const Ptr<Trip>& trip) {
-        logEntryNew(notifier()->manager()->now(), "ServiceSim checking if it should remove: " + trip->name());
-        const auto iter = find(waitingTrips_.begin(), waitingTrips_.end(), trip);
-        if (iter != waitingTrips_.end()) {
-            waitingTrips_.erase(iter);
-            logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + trip->name() + "]: Erased waiting trip from serviceSim");
+        logEntryNew(serviceSimLog, Log::debug, notifier()->manager()->now(), "ServiceSim checking if it should remove: ", trip->name());
+        if (waitingTrips_.del(trip)) {
+            logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), "]: Erased waiting trip from serviceSim");
         } else {
-            logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + trip->name() + "]: Unable to find waiting trip so no erasure from serviceSim");
+            logEntryNew(serviceSimLog, Log::debug, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), "]: Unable to find waiting trip so no erasure from serviceSim");
         }
     }
 
     void onTravelNetworkVehicleNew(const Ptr<Vehicle>& vehicle) {
-        availableVehicles_.push_back(vehicle);
-        if (waitingTrips_.size() > 0) {
-            for (auto& trip : waitingTrips_) {
-                assignNearestAvailableVehicle(trip);
-                if (trip->vehicle() != null) {
-                    logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + trip->name() + "," + trip->vehicle()->name() + "]: will schedule trip with assigned vehicle");
-                    return;
+        idleVehicleNew(vehicle);
+        if (ridePooling) {
+            idleVehicleFilled(vehicle);
+            return;
+        }
+        if (batchedDispatch) {
+            if (waitingTrips_.size() > 0) {
+                dispatchScheduled();
+            }
+            logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", vehicle->name(), "]: will match vehicle in the next dispatch batch");
+            return;
+        }
+        if (waitingTrips_.size() > 0 && vehicle->location() != null) {
+            // Search once from the freed vehicle and give it the oldest
+            // waiting trip it can reach, rather than searching from every
+            // idle vehicle for each waiting trip in turn.
+            const auto tree = travelNetworkReactor_->notifier()->conn("conn")->shortestPathTree(vehicle->location());
+            for (auto i = waitingTrips_.begin(); i != waitingTrips_.end(); ++i) {
+                const auto trip = *i;
+                const auto pickup = trip->startLocation();
+                if (!tree.reaches(pickup)) {
+                    continue;
                 }
+
+                Time waitTimeInSeconds = tree.distance.at(pickup.ptr()) / vehicle->speed().value() * minutesPerHour * secondsPerMinute;
+                vehicleAssigned(trip, vehicle, tree.path(pickup), waitTimeInSeconds);
+                logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), ",", vehicle->name(), "]: will schedule trip with assigned vehicle");
+                return;
             }
         }
-        logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + vehicle->name() + "]: will not schedule this vehicle because no available reachable trips");
+        logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", vehicle->name(), "]: will not schedule this vehicle because no available reachable trips");
     }
 
     void onTravelNetworkVehicleDel(const Ptr<Vehicle>& vehicle) {
-        logEntryNew(notifier()->manager()->now(), "ServiceSim checking if it should remove: " + vehicle->name());
-        const auto iter = find(availableVehicles_.begin(), availableVehicles_.end(), vehicle);
-        if (iter != availableVehicles_.end()) {
-            availableVehicles_.erase(iter);
-            logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + vehicle->name() + "]: Erased available vehicle from serviceSim");
+        logEntryNew(serviceSimLog, Log::debug, notifier()->manager()->now(), "ServiceSim checking if it should remove: ", vehicle->name());
+        if (idleVehicleDel(vehicle)) {
+            logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", vehicle->name(), "]: Erased available vehicle from serviceSim");
         } else {
-            logEntryNew(notifier()->manager()->now(), "Not a available vehicle so no removal in serviceSim: " + vehicle->name());
-            logEntryNew(notifier()->manager()->now(), "[ServiceSim: " + vehicle->name() + "]: Unable to find available vehicle so no erasure from serviceSim");
+            logEntryNew(serviceSimLog, Log::debug, notifier()->manager()->now(), "Not a available vehicle so no removal in serviceSim: ", vehicle->name());
+            logEntryNew(serviceSimLog, Log::debug, notifier()->manager()->now(), "[ServiceSim: ", vehicle->name(), "]: Unable to find available vehicle so no erasure from serviceSim");
         }
     }
 
@@ -431,85 +982,371 @@ protected:
     void assignNearestAvailableVehicle(Ptr<Trip> trip) {
         // logEntryNew(notifier()->manager()->now(), "assignNearestAvailableVehicle for " + trip->name());
         
-        // Setup assignee variables
-        Miles shortestDistance = numeric_limits<double>::max();
+        // Search outward from every location with an idle vehicle at once,
+        // stopping at the pickup, rather than searching from each vehicle.
+        // Locations are ordered by their oldest vehicle, so of vehicles
+        // equally far away the one that has waited longest wins.
+        const auto oldest = longestIdleVehicles();
+        vector<Ptr<Location>> sources;
+        for (const auto& vehicle : oldest) {
+            sources.push_back(vehicle->location());
+        }
+
+        const auto pickup = trip->startLocation();
+        const auto tree = travelNetworkReactor_->notifier()->conn("conn")->shortestPathTree(sources, pickup);
         Ptr<Vehicle> closestVehicle = null;
-        vector<Ptr<Segment>> shortestPath;
-        // Find shortest path on each vehicle
-        for (Ptr<Vehicle>& vehicle : availableVehicles_) {
-            Ptr<Location> vehicleLocation = vehicle->location();
-            string pickupLocName = trip->startLocation()->name();
-            if (vehicleLocation != null) {
-                const auto travelNetwork_ = travelNetworkReactor_->notifier();
-                pair<vector<Ptr<Segment>>, double> pathDistPair = travelNetwork_->conn("conn")->findShortestPath(vehicleLocation, trip->startLocation());
-                vector<Ptr<Segment>> path = pathDistPair.first;
-                cout << trip->startLocation()->name() << "(" << vehicleLocation->name() << " -> " << trip->startLocation()->name() << ": " << path.size() << ")" << trip->endLocation()->name() << endl; // debug
-                // if (path.size() == 0) exit(-1);
-                Miles distance = pathDistPair.second;
-                if (distance.value() < shortestDistance.value()) {
-                    closestVehicle = vehicle;
-                    shortestDistance = distance;
-                    shortestPath = path;
-                }
-            } else {
-                cerr << "Could not find the starting location for the trip (" << trip->name() << "). Skipping the vehicle: " << vehicle->name() << endl;
-                continue;
-            }
+        if (tree.reaches(pickup)) {
+            closestVehicle = oldest[tree.source.at(pickup.ptr())];
         }
 
         if (closestVehicle == null) {
             return;
         }
         // logEntryNew(notifier()->manager()->now(), "[" + trip->name() + "]: Trip assigned nearest reachable available vehicle " + closestVehicle->name());
-        trip->vehicleIs(closestVehicle);
-        removeAssignedTripAndVehicle(trip, closestVehicle);
-        trip->pathIs(shortestPath);
-        Time waitTimeInSeconds = shortestDistance.value() / closestVehicle->speed().value() * minutesPerHour * secondsPerMinute;
-        trip->waitTimeIs(waitTimeInSeconds);
-        Ptr<TripSim> tripSim = TripSim::instanceNew(notifier()->manager(), trip);
-        tripSimsVector_.push_back(tripSim);
+        Time waitTimeInSeconds = tree.distance.at(pickup.ptr()) / closestVehicle->speed().value() * minutesPerHour * secondsPerMinute;
+        vehicleAssigned(trip, closestVehicle, tree.path(pickup), waitTimeInSeconds);
     }
 
-    void removeAssignedTripAndVehicle(Ptr<Trip>& trip, Ptr<Vehicle>& vehicle) {
-        // Remove the available trip
-        waitingTrips_.erase(std::remove(waitingTrips_.begin(), waitingTrips_.end(), trip), waitingTrips_.end());
+    // Return the vehicle that has been idle longest at each location, longest
+    // idle first. Vehicles with no location can't be dispatched.
+    vector<Ptr<Vehicle>> longestIdleVehicles() {
+        idleVehiclesCaughtUp();
+        vector<pair<U64, Ptr<Vehicle>>> oldest;
+        for (const auto& bucket : availableVehicles_.buckets()) {
+            if (bucket.first != null) {
+                const auto& vehicle = bucket.second.front();
+                oldest.push_back(make_pair(availableVehicles_.order(vehicle), vehicle));
+            }
+        }
+        std::sort(oldest.begin(), oldest.end(),
+            [](const pair<U64, Ptr<Vehicle>>& a, const pair<U64, Ptr<Vehicle>>& b) { return a.first < b.first; }
+        );
 
-        // Remove the available vehicle
-        availableVehicles_.erase(std::remove(availableVehicles_.begin(), availableVehicles_.end(), vehicle), availableVehicles_.end());
+        vector<Ptr<Vehicle>> vehicles;
+        for (const auto& o : oldest) {
+            vehicles.push_back(o.second);
+        }
+        return vehicles;
     }
 
-    // Embedded TravelNetworkReactor
-    class TravelNetworkReactor : public TravelNetwork::Notifiee {
-    public:
-        void onTripNew(const Ptr<Trip>& trip) {
-            auto tripTracker = TripTracker::instanceNew(trip);
-            serviceSim_->tripTrackerMap_[trip->name()] = tripTracker;
-            tripTracker->serviceSim_ = serviceSim_; // from slide 28 in lecture3.pdf
+    // Send the vehicle along the path to pick up the trip.
+    void vehicleAssigned(const Ptr<Trip>& trip, const Ptr<Vehicle>& vehicle,
+        const vector<Ptr<Segment>>& path, const Time waitTime
+    ) {
+        trip->vehicleIs(vehicle);
+        waitingTrips_.del(trip);
+        idleVehicleDel(vehicle);
+        trip->pathIs(path);
+        trip->waitTimeIs(waitTime);
+        Ptr<TripSim> tripSim = TripSim::instanceNew(notifier()->manager(), trip);
+        tripSimsVector_.push_back(tripSim);
+    }
 
-            serviceSim_->onTravelNetworkTripNew(trip); //trampoline
-        }
-        void onTripDel(const Ptr<Trip>& trip) {
-            serviceSim_->onTravelNetworkTripDel(trip); //trampoline
+    // Add the vehicle to the idle vehicles, tracking where it is while idle.
+    void idleVehicleNew(const Ptr<Vehicle>& vehicle) {
+        availableVehicles_.push(vehicle, vehicle->location().ptr());
+        auto& tracker = vehicleTrackerMap_[vehicle->name()];
+        if (tracker == null) {
+            tracker = new VehicleTracker(this);
         }
+        tracker->notifierIs(vehicle);
+    }
 
-        void onVehicleNew(const Ptr<Vehicle>& vehicle) {
-            serviceSim_->onTravelNetworkVehicleNew(vehicle); //trampoline
+    // Remove the vehicle from the idle vehicles, returning whether it was
+    // idle. The tracker is disconnected so that moving vehicles have no
+    // notifiees, which lets express trips skip their per-segment moves.
+    bool idleVehicleDel(const Ptr<Vehicle>& vehicle) {
+        const auto tracker = vehicleTrackerMap_.find(vehicle->name());
+        if (tracker != vehicleTrackerMap_.end()) {
+            tracker->second->notifierIs(null);
         }
-        void onVehicleDel(const Ptr<Vehicle>& vehicle) {
-            serviceSim_->onTravelNetworkVehicleDel(vehicle); //trampoline
-        }
-    protected:
-        friend class ServiceSim;
-        TravelNetworkReactor(ServiceSim* const serviceSim, const Ptr<TravelNetwork>& tn) :
-            serviceSim_(serviceSim)
-        {
-            notifierIs(tn);
+
+        // Stop a vehicle being rebalanced wherever its route has taken it
+        if (vehicle->route().clock != null) {
+            vehicle->location();
+            vehicle->routeIs(Vehicle::Route());
         }
-        ServiceSim* const serviceSim_; // weak pointer to prevent cycles
+        return availableVehicles_.del(vehicle);
+    }
+
+    // Where a trip's pickup and dropoff can go among a vehicle's stops, and
+    // how much longer that makes the vehicle's route.
+    struct Insertion {
+        Ptr<Vehicle> vehicle;
+        vector<Vehicle::Stop> stops;
+        double addedMiles = numeric_limits<double>::max();
+        double milesToPickup = 0;
     };
 
+    /**
+     * Try every place to insert the trip's pickup and dropoff into the
+     * vehicle's stops, keeping the shortest detour in best if it beats
+     * best. A place is only allowed if the vehicle never carries more than
+     * its capacity, no stop already planned is put off by more than
+     * maxDetourInMinutes, and the trip's own ride is no more than that
+     * longer than going direct. Leg lengths come from Conn's cached trees.
+     */
+    void insertionFound(const Ptr<Trip>& trip, const Ptr<Vehicle>& vehicle, Insertion& best) {
+        const auto start = vehicle->location();
+        const auto& stops = vehicle->stops();
+        const auto capacity = long(vehicle->capacity().value());
+        if (start == null || long(trip->numTravelers().value()) > capacity ||
+            stops.size() + 2 > size_t(2 * capacity)
+        ) {
+            return;
+        }
 
-    /********************************************************
+        const auto conn = travelNetworkReactor_->notifier()->conn("conn");
+        const double unreachable = numeric_limits<double>::max();
+        const double direct = conn->legDistance(trip->startLocation(), trip->endLocation());
+        if (direct == unreachable) {
+            return;
+        }
+        const double detourMiles = maxDetourInMinutes / minutesPerHour * vehicle->speed().value();
+
+        // Miles from the vehicle to each stop as planned now
+        vector<double> planned;
+        double plannedMiles = 0;
+        auto loc = start;
+        for (const auto& stop : stops) {
+            plannedMiles += conn->legDistance(loc, stop.location);
+            planned.push_back(plannedMiles);
+            loc = stop.location;
+        }
+
+        Vehicle::Stop pickup;
+        pickup.trip = trip;
+        pickup.location = trip->startLocation();
+        pickup.pickup = true;
+        pickup.assigned = notifier()->manager()->now();
+        Vehicle::Stop dropoff;
+        dropoff.trip = trip;
+        dropoff.location = trip->endLocation();
+
+        // Pickup before stops[i] and dropoff before stops[j]
+        for (size_t i = 0; i <= stops.size(); ++i) {
+            for (size_t j = i; j <= stops.size(); ++j) {
+                vector<Vehicle::Stop> candidate(stops.begin(), stops.begin() + i);
+                candidate.push_back(pickup);
+                candidate.insert(candidate.end(), stops.begin() + i, stops.begin() + j);
+                candidate.push_back(dropoff);
+                candidate.insert(candidate.end(), stops.begin() + j, stops.end());
+
+                double miles = 0;
+                double pickupMiles = 0;
+                long load = long(vehicle->passengers().value());
+                size_t k = 0; // index of the next planned stop
+                auto feasible = true;
+                loc = start;
+                for (const auto& stop : candidate) {
+                    const auto leg = conn->legDistance(loc, stop.location);
+                    if (leg == unreachable) {
+                        feasible = false;
+                        break;
+                    }
+                    miles += leg;
+                    loc = stop.location;
+
+                    if (stop.trip == trip) {
+                        if (stop.pickup) {
+                            pickupMiles = miles;
+                        } else if (miles - pickupMiles > direct + detourMiles) {
+                            feasible = false;
+                            break;
+                        }
+                    } else if (miles - planned[k++] > detourMiles) {
+                        feasible = false;
+                        break;
+                    }
+
+                    const auto travelers = long(stop.trip->numTravelers().value());
+                    load += stop.pickup ? travelers : -travelers;
+                    if (load > capacity) {
+                        feasible = false;
+                        break;
+                    }
+                }
+
+                if (feasible && miles - plannedMiles < best.addedMiles) {
+                    best.vehicle = vehicle;
+                    best.stops = candidate;
+                    best.addedMiles = miles - plannedMiles;
+                    best.milesToPickup = pickupMiles;
+                }
+            }
+        }
+    }
+
+    /**
+     * Add the trip to whichever vehicle it lengthens least: one already
+     * under way, or the longest idle vehicle at some location. Returns
+     * whether any vehicle could take it.
+     */
+    bool pooledTripAssigned(const Ptr<Trip>& trip) {
+        Insertion best;
+        for (const auto& sim : vehicleSims_) {
+            if (sim->vehicle()->stops().size() > 0) {
+                insertionFound(trip, sim->vehicle(), best);
+            }
+        }
+        for (const auto& vehicle : longestIdleVehicles()) {
+            insertionFound(trip, vehicle, best);
+        }
+
+        if (best.vehicle == null) {
+            return false;
+        }
+        pooledVehicleAssigned(trip, best);
+        return true;
+    }
+
+    // Give the trip its place among the vehicle's stops.
+    void pooledVehicleAssigned(const Ptr<Trip>& trip, const Insertion& insertion) {
+        const auto& vehicle = insertion.vehicle;
+        const auto others = insertion.stops.size() - 2;
+        trip->vehicleIs(vehicle);
+        waitingTrips_.del(trip);
+        idleVehicleDel(vehicle);
+        trip->waitTimeIs(insertion.milesToPickup / vehicle->speed().value() * minutesPerHour * secondsPerMinute);
+        trip->statusIs(Trip::goingToPickup);
+        vehicle->stopsIs(insertion.stops);
+        if (vehicleSimMap_.find(vehicle->name()) == vehicleSimMap_.end()) {
+            const auto sim = VehicleSim::instanceNew(notifier()->manager(), vehicle);
+            vehicleSimMap_[vehicle->name()] = sim;
+            vehicleSims_.push_back(sim);
+        }
+        logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), ",", vehicle->name(), "]: pooled trip with ", others, " other stops, adding ", insertion.addedMiles, " miles");
+    }
+
+    /**
+     * Give a vehicle that has just become idle the oldest waiting trip it
+     * can take, and then the trips waiting at the stops on its new route
+     * that fit.
+     */
+    void idleVehicleFilled(const Ptr<Vehicle>& vehicle) {
+        for (auto i = waitingTrips_.begin(); i != waitingTrips_.end(); ++i) {
+            Insertion best;
+            insertionFound(*i, vehicle, best);
+            if (best.vehicle != null) {
+                pooledVehicleAssigned(Ptr<Trip>(*i), best);
+                break;
+            }
+        }
+
+        vector<Ptr<Location>> route;
+        for (const auto& stop : vehicle->stops()) {
+            route.push_back(stop.location);
+        }
+        for (const auto& location : route) {
+            const auto& bucket = waitingTrips_.bucket(location.ptr());
+            const vector<Ptr<Trip>> nearby(bucket.begin(), bucket.end());
+            for (const auto& trip : nearby) {
+                Insertion best;
+                insertionFound(trip, vehicle, best);
+                if (best.vehicle != null) {
+                    pooledVehicleAssigned(trip, best);
+                }
+            }
+        }
+    }
+
+    // Schedule the next dispatch batch, unless one is already scheduled.
+    void dispatchScheduled() {
+        if (dispatchPending_) {
+            return;
+        }
+        dispatchPending_ = true;
+        const auto a = notifier();
+        a->nextTimeIsOffset(dispatchWindowInSeconds);
+        a->statusIs(Activity::scheduled);
+        a->manager()->activityAdd(a);
+    }
+
+    // Match the waiting trips with the available vehicles so that the total
+    // wait is least. Each vehicle location gets one search for its paths to
+    // every pickup, rather than one search per trip and vehicle.
+    void dispatchBatch() {
+        FWK_TIMED("ServiceSim::dispatchBatch");
+        dispatchPending_ = false;
+        if (waitingTrips_.size() == 0 || availableVehicles_.size() == 0) {
+            return;
+        }
+
+        const auto conn = travelNetworkReactor_->notifier()->conn("conn");
+        unordered_map<Location*, Conn::PathTree> pathTrees;
+        const vector<Ptr<Trip>> trips(waitingTrips_.begin(), waitingTrips_.end());
+        const vector<Ptr<Vehicle>> vehicles(availableVehicles_.begin(), availableVehicles_.end());
+        for (auto& vehicle : vehicles) {
+            const auto location = vehicle->location();
+            if (location != null && pathTrees.find(location.ptr()) == pathTrees.end()) {
+                pathTrees[location.ptr()] = conn->shortestPathTree(location);
+            }
+        }
+
+        // Wait times in seconds, with unreachable pairs costing more than any
+        // reachable assignment so they are only chosen when nothing else is left
+        const double unreachable = 1e12;
+        vector<vector<double>> waitTimes(trips.size(), vector<double>(vehicles.size(), unreachable));
+        for (size_t i = 0; i < trips.size(); ++i) {
+            for (size_t j = 0; j < vehicles.size(); ++j) {
+                const auto location = vehicles[j]->location();
+                if (location == null) {
+                    continue;
+                }
+                const auto& tree = pathTrees[location.ptr()];
+                const auto distance = tree.distance.find(trips[i]->startLocation().ptr());
+                if (distance != tree.distance.end()) {
+                    waitTimes[i][j] = distance->second / vehicles[j]->speed().value() * minutesPerHour * secondsPerMinute;
+                }
+            }
+        }
+
+        const auto assignment = minCostAssignment(waitTimes);
+        for (size_t i = 0; i < trips.size(); ++i) {
+            const auto j = assignment[i];
+            if (j < 0 || waitTimes[i][j] >= unreachable) {
+                continue;
+            }
+
+            const auto& trip = trips[i];
+            const auto& vehicle = vehicles[j];
+            vehicleAssigned(trip, vehicle, pathTrees[vehicle->location().ptr()].path(trip->startLocation()), waitTimes[i][j]);
+            logEntryNew(serviceSimLog, Log::info, notifier()->manager()->now(), "[ServiceSim: ", trip->name(), ",", vehicle->name(), "]: will schedule trip with assigned vehicle");
+        }
+    }
+
+    // Embedded TravelNetworkReactor
+    class TravelNetworkReactor : public TravelNetwork::Notifiee {
+    public:
+        void onTripNew(const Ptr<Trip>& trip) {
+            auto tripTracker = TripTracker::instanceNew(trip);
+            serviceSim_->tripTrackerMap_[trip->name()] = tripTracker;
+            tripTracker->serviceSim_ = serviceSim_; // from slide 28 in lecture3.pdf
+
+            serviceSim_->onTravelNetworkTripNew(trip); //trampoline
+        }
+        void onTripDel(const Ptr<Trip>& trip) {
+            serviceSim_->onTravelNetworkTripDel(trip); //trampoline
+        }
+
+        void onVehicleNew(const Ptr<Vehicle>& vehicle) {
+            serviceSim_->onTravelNetworkVehicleNew(vehicle); //trampoline
+        }
+        void onVehicleDel(const Ptr<Vehicle>& vehicle) {
+            serviceSim_->onTravelNetworkVehicleDel(vehicle); //trampoline
+        }
+    protected:
+        friend class ServiceSim;
+        TravelNetworkReactor(ServiceSim* const serviceSim, const Ptr<TravelNetwork>& tn) :
+            serviceSim_(serviceSim)
+        {
+            notifierIs(tn);
+        }
+        ServiceSim* const serviceSim_; // weak pointer to prevent cycles
+    };
+
+
+    /********************************************************
     * Nest TripTracker in ServiceSim                        *
     ********************************************************/
     class TripTracker : public Trip::Notifiee {
@@ -523,7 +1360,10 @@ protected:
         /** Notification that the trip's status changed. */
         void onStatus() {
             if (notifier()->status() == Trip::droppedOff) {
-                serviceSim_->onTravelNetworkVehicleNew(notifier()->vehicle());
+                // A pooled vehicle is only free once it has no more stops
+                if (!ridePooling || notifier()->vehicle()->stops().empty()) {
+                    serviceSim_->onTravelNetworkVehicleNew(notifier()->vehicle());
+                }
                 notifier()->vehicleIs(null); // TODO: check if I want to nullify the vehicle
             };
         }
@@ -534,16 +1374,317 @@ protected:
     
     typedef unordered_map< string, Ptr<TripTracker> > TripTrackerMap;
     TripTrackerMap tripTrackerMap_;
+
+    /**
+     * VehicleTracker keeps an idle vehicle in the bucket of its current
+     * location when something moves it.
+     */
+    class VehicleTracker : public Vehicle::Notifiee {
+    public:
+        void onLocation() {
+            const auto location = notifier()->location();
+            serviceSim_->availableVehicles_.locationIs(notifier(), location.ptr());
+        }
+
+    protected:
+        friend class ServiceSim;
+        explicit VehicleTracker(ServiceSim* const serviceSim) :
+            serviceSim_(serviceSim)
+        {
+            // Nothing else to do.
+        }
+        ServiceSim* const serviceSim_; // weak pointer to prevent cycles
+    };
+
+    typedef unordered_map< string, Ptr<VehicleTracker> > VehicleTrackerMap;
+    VehicleTrackerMap vehicleTrackerMap_;
+    unordered_map< string, Ptr<VehicleSim> > vehicleSimMap_;
+    vector<Ptr<VehicleSim>> vehicleSims_;
     Ptr<TravelNetworkReactor> travelNetworkReactor_;
-    vector<Ptr<Vehicle>> availableVehicles_;
-    vector<Ptr<Trip>> waitingTrips_;
+    Pool<Vehicle> availableVehicles_;
+    Pool<Trip> waitingTrips_;
     vector<Ptr<TripSim>> tripSimsVector_;
+    bool dispatchPending_;
 
     ServiceSim(const Ptr<TravelNetwork>& tn) :
-        travelNetworkReactor_(new TravelNetworkReactor(this, tn))
+        travelNetworkReactor_(new TravelNetworkReactor(this, tn)),
+        dispatchPending_(false)
+    {
+        // Nothing else to do.
+    }
+};
+
+/**
+ * RebalancerSim periodically moves idle vehicles toward where trips have
+ * been requested lately, so pickups don't start with a long empty leg.
+ * Each location's demand is a count of the trips requested there that
+ * decays exponentially with age. Each run shares the idle vehicles out
+ * between locations in proportion to demand, then sends the vehicles
+ * over at the least total distance. Vehicles follow a route and stay idle
+ * on the way, so ServiceSim can still dispatch them.
+ */
+class RebalancerSim : public Sim {
+public:
+
+    static Ptr<RebalancerSim> instanceNew(
+        const Ptr<ActivityManager>& mgr, const Ptr<TravelNetwork>& tn,
+        const Ptr<ServiceSim>& serviceSim
+    ) {
+        const Ptr<RebalancerSim> sim = new RebalancerSim(tn, serviceSim);
+        const auto a = mgr->activityNew("RebalancerSim");
+        a->nextTimeIsOffset(rebalancePeriodInSeconds);
+        a->statusIs(Activity::scheduled);
+        mgr->activityAdd(a);
+        sim->notifierIs(a);
+        return sim;
+    }
+
+    void onStatus() {
+        const auto a = notifier();
+        if (a->status() == Activity::running) {
+            rebalance();
+            a->nextTimeIsOffset(rebalancePeriodInSeconds);
+        }
+    }
+
+    // Number of vehicles sent toward demand so far
+    unsigned int numMoves() {
+        return numMoves_;
+    }
+
+protected:
+
+    // Embedded TravelNetworkReactor
+    class TravelNetworkReactor : public TravelNetwork::Notifiee {
+    public:
+        void onTripNew(const Ptr<Trip>& trip) {
+            rebalancer_->demandNew(trip->startLocation());
+        }
+    protected:
+        friend class RebalancerSim;
+        TravelNetworkReactor(RebalancerSim* const rebalancer, const Ptr<TravelNetwork>& tn) :
+            rebalancer_(rebalancer)
+        {
+            notifierIs(tn);
+        }
+        RebalancerSim* const rebalancer_; // weak pointer to prevent cycles
+    };
+
+    // Decayed count of the trips requested at a location, as of updated
+    struct Demand {
+        Ptr<Location> location;
+        double weight = 0;
+        Time updated = 0;
+    };
+
+    Ptr<TravelNetworkReactor> travelNetworkReactor_;
+    Ptr<ServiceSim> serviceSim_;
+    std::map<string, Demand> demand_; // by location name, for a stable order
+    unsigned int numMoves_;
+
+    RebalancerSim(const Ptr<TravelNetwork>& tn, const Ptr<ServiceSim>& serviceSim) :
+        travelNetworkReactor_(new TravelNetworkReactor(this, tn)),
+        serviceSim_(serviceSim),
+        numMoves_(0)
+    {
+        // Nothing else to do.
+    }
+
+    Time now() {
+        return notifier()->manager()->now();
+    }
+
+    double weightNow(const Demand& d) {
+        return d.weight * std::exp(-(now() - d.updated).value() / demandDecayInSeconds);
+    }
+
+    void demandNew(const Ptr<Location>& location) {
+        auto& d = demand_[location->name()];
+        d.location = location;
+        d.weight = weightNow(d) + 1;
+        d.updated = now();
+    }
+
+    /**
+     * Work out how many idle vehicles each location should have, and
+     * send surplus vehicles to locations short of their share. Sending
+     * vehicles is a transportation problem on the network's shortest
+     * path distances, solved as a min-cost assignment of surplus vehicles
+     * to open places.
+     */
+    void rebalance() {
+        const auto& idle = serviceSim_->idleVehicles();
+        vector<Ptr<Vehicle>> vehicles;
+        for (auto i = idle.begin(); i != idle.end(); ++i) {
+            if ((*i)->location() != null) {
+                vehicles.push_back(*i);
+            }
+        }
+
+        double totalWeight = 0;
+        for (const auto& d : demand_) {
+            totalWeight += weightNow(d.second);
+        }
+        if (vehicles.empty() || totalWeight <= 0) {
+            return;
+        }
+
+        // Each location's share of the vehicles, by largest remainder
+        std::map<string, size_t> target;
+        vector<pair<double, string>> remainders;
+        size_t assigned = 0;
+        for (const auto& d : demand_) {
+            const auto share = vehicles.size() * weightNow(d.second) / totalWeight;
+            target[d.first] = size_t(share);
+            assigned += size_t(share);
+            remainders.push_back(make_pair(share - std::floor(share), d.first));
+        }
+        std::stable_sort(remainders.begin(), remainders.end(),
+            [](const pair<double, string>& a, const pair<double, string>& b) { return a.first > b.first; }
+        );
+        for (size_t i = 0; assigned < vehicles.size(); ++i, ++assigned) {
+            ++target[remainders[i].second];
+        }
+
+        // Vehicles beyond a location's share, newest idle first, and the
+        // open places at locations short of theirs
+        std::map<string, size_t> count;
+        vector<Ptr<Vehicle>> surplus;
+        for (auto v = vehicles.rbegin(); v != vehicles.rend(); ++v) {
+            const auto& name = (*v)->location()->name();
+            if (++count[name] > target[name]) {
+                surplus.push_back(*v);
+            }
+        }
+        vector<Ptr<Location>> places;
+        for (const auto& d : demand_) {
+            for (auto n = count[d.first]; n < target[d.first]; ++n) {
+                places.push_back(d.second.location);
+            }
+        }
+        if (surplus.empty() || places.empty()) {
+            return;
+        }
+
+        const auto conn = travelNetworkReactor_->notifier()->conn("conn");
+        const double unreachable = 1e12;
+        vector<vector<double>> miles(surplus.size(), vector<double>(places.size(), unreachable));
+        for (size_t i = 0; i < surplus.size(); ++i) {
+            for (size_t j = 0; j < places.size(); ++j) {
+                const auto d = conn->legDistance(surplus[i]->location(), places[j]);
+                if (d < unreachable) {
+                    miles[i][j] = d;
+                }
+            }
+        }
+
+        const auto assignment = minCostAssignment(miles);
+        for (size_t i = 0; i < surplus.size(); ++i) {
+            const auto j = assignment[i];
+            if (j >= 0 && miles[i][j] < unreachable) {
+                routeStarted(surplus[i], places[j]);
+            }
+        }
+    }
+
+    // Send the idle vehicle to the location along the shortest path.
+    void routeStarted(const Ptr<Vehicle>& vehicle, const Ptr<Location>& location) {
+        const auto from = vehicle->location();
+        const auto conn = travelNetworkReactor_->notifier()->conn("conn");
+        Vehicle::Route route;
+        route.clock = notifier()->manager();
+        auto t = now();
+        for (const auto& seg : conn->pathTreeFrom(from).path(location)) {
+            Vehicle::Hop hop;
+            hop.time = t;
+            hop.location = seg->destination();
+            route.hops.push_back(hop);
+            t = t + seg->length().value() / vehicle->speed().value() * minutesPerHour * secondsPerMinute;
+        }
+
+        vehicle->routeIs(route);
+        ++numMoves_;
+        logEntryNew(rebalancerLog, Log::info, now(), "[RebalancerSim: ", vehicle->name(), "]: rebalancing ", from->name(), " -> ", location->name(), ". (Expected: ", t, ").");
+    }
+};
+
+/**
+ * TripTracer adds each trip's request, vehicle assignment, pickup and
+ * dropoff to the trip trace as they happen; the sims add the hops. It
+ * must be created before ServiceSim, so it sees a trip's request and its
+ * vehicle before ServiceSim acts on them.
+ */
+class TripTracer : public TravelNetwork::Notifiee {
+public:
+
+    static Ptr<TripTracer> instanceNew(
+        const Ptr<ActivityManager>& mgr, const Ptr<TravelNetwork>& tn
+    ) {
+        const Ptr<TripTracer> tracer = new TripTracer(mgr);
+        tracer->notifierIs(tn);
+        return tracer;
+    }
+
+    void onTripNew(const Ptr<Trip>& trip) {
+        finishedTripTrackersDel();
+        traceEventNew(manager_->now(), TripTrace::requested, trip, null, trip->startLocation(), trip->numTravelers().value());
+        tripTrackerMap_[trip->name()] = new TripTracker(this, trip);
+    }
+
+    void onTripDel(const Ptr<Trip>& trip) {
+        tripTrackerMap_.erase(trip->name());
+    }
+
+protected:
+
+    /** Traces a trip's status changes until it is dropped off. */
+    class TripTracker : public Trip::Notifiee {
+    public:
+        void onStatus() {
+            const auto trip = notifier();
+            const auto now = tracer_->manager_->now();
+            if (vehicle_ == null && trip->vehicle() != null) {
+                vehicle_ = trip->vehicle();
+                traceEventNew(now, TripTrace::assigned, trip, vehicle_, null, 0);
+            }
+
+            if (trip->status() == Trip::goingToDropoff) {
+                traceEventNew(now, TripTrace::pickedUp, trip, vehicle_, trip->startLocation(), trip->waitTime().value());
+            } else if (trip->status() == Trip::droppedOff) {
+                traceEventNew(now, TripTrace::droppedOff, trip, vehicle_, trip->endLocation(), 0);
+
+                // Still reacting, so released on the next new trip
+                tracer_->finishedTripTrackers_.push_back(trip->name());
+            }
+        }
+
+    protected:
+        friend class TripTracer;
+        TripTracker(TripTracer* const tracer, const Ptr<Trip>& trip) :
+            tracer_(tracer)
+        {
+            notifierIs(trip);
+        }
+        TripTracer* const tracer_; // weak pointer to prevent cycles
+        Ptr<Vehicle> vehicle_;
+    };
+
+    Ptr<ActivityManager> manager_;
+    unordered_map< string, Ptr<TripTracker> > tripTrackerMap_;
+    vector<string> finishedTripTrackers_;
+
+    explicit TripTracer(const Ptr<ActivityManager>& mgr) :
+        manager_(mgr)
     {
         // Nothing else to do.
     }
+
+    void finishedTripTrackersDel() {
+        for (const auto& name : finishedTripTrackers_) {
+            tripTrackerMap_.erase(name);
+        }
+        finishedTripTrackers_.clear();
+    }
 };
 
 // /********************************************************************************
@@ -682,6 +1823,9 @@ void printTripStatistics(Ptr<TravelNetwork> tn) {
     cout << "numTrips:\t" << tn->stats("stats")->numTrips() << endl;
     cout << "numCompleted:\t" << tn->stats("stats")->numCompletedTrips() << endl;
     cout << "averageWait:\t" << (tn->stats("stats")->averageWaitTime().value() / secondsPerMinute) << " minutes."<< endl;
+    for (const auto& stat : { "waitTime.p50", "waitTime.p90", "waitTime.p99", "tripDuration.p50", "dispatchLatency.p99" }) {
+        cout << stat << ":\t" << (tn->stats("stats")->statistic(stat) / secondsPerMinute) << " minutes." << endl;
+    }
 
     cout << endl;
     cout << "Cache Statistics:\t" << endl;
@@ -691,46 +1835,817 @@ void printTripStatistics(Ptr<TravelNetwork> tn) {
     cout << endl;
 }
 
+/**
+ * The kinds of value an option takes: none, a count of digits, an integer,
+ * a number, or any text.
+ */
+enum OptionValue { noValue, countValue, integerValue, numberValue, textValue };
+
+/**
+ * An option this program takes. The name of an option that takes a value
+ * ends in '='. An option whose value may be left off, like --rebalance,
+ * is listed both ways.
+ */
+struct OptionSpec {
+    const char* name;
+    OptionValue value;
+};
+
+static const OptionSpec optionSpecs[] = {
+    { "--sim=", countValue }, { "--batch", noValue }, { "--sweep=", textValue },
+    { "--jobs=", countValue }, { "--config=", textValue },
+    { "--networks=", integerValue }, { "--cars=", integerValue },
+    { "--requests=", countValue }, { "--duration=", numberValue },
+    { "--requestInterval=", numberValue },
+    { "--manager=", textValue }, { "--workers=", countValue },
+    { "--seed=", countValue }, { "--express", noValue }, { "--dispatch=batch", noValue },
+    { "--dispatchWindow=", numberValue }, { "--pooling", noValue },
+    { "--maxDetour=", numberValue }, { "--rebalance", noValue },
+    { "--rebalance=", numberValue }, { "--quiet", noValue }, { "--log=", textValue },
+    { "--syncLog", noValue }, { "--timers", noValue }, { "--timers=monotonic", noValue },
+    { "--profile=", textValue }, { "--trace=", textValue }, { "--record=", textValue },
+    { "--replay=", textValue }
+};
+
+/** The activity managers --manager chooses from (see activityManagerNew). */
+static const char* const managerNames[] = { "sequential", "calendar", "parallel", "optimistic", "batch" };
+
+/** Return whether the value is of the given kind. */
+static bool valueChecked(const string& value, const OptionValue kind) {
+    if (kind == textValue) {
+        return true;
+    }
+
+    // Counts and integers are all digits, after an integer's minus sign.
+    const size_t start = kind == integerValue && value.compare(0, 1, "-") == 0 ? 1 : 0;
+    if (kind != numberValue && (value.size() == start ||
+        value.find_first_not_of("0123456789", start) != string::npos)) {
+        return false;
+    }
+
+    // The conversions used on the value throw if it doesn't fit.
+    try {
+        size_t end = 0;
+        if (kind == countValue) {
+            std::stoul(value, &end);
+        } else if (kind == integerValue) {
+            std::stoi(value, &end);
+        } else {
+            std::stod(value, &end);
+        }
+        return end == value.size();
+    } catch (const std::logic_error&) {
+        return false;
+    }
+}
+
+/**
+ * Return whether each of the options is one this program takes, with a
+ * value of the right kind, writing the first that isn't to standard error.
+ */
+static bool optionsChecked(const vector<string>& args) {
+    for (const auto& arg : args) {
+        const OptionSpec* spec = null;
+        for (const auto& s : optionSpecs) {
+            const string name = s.name;
+            if (s.value == noValue ? arg == name : arg.compare(0, name.size(), name) == 0) {
+                spec = &s;
+                break;
+            }
+        }
+        if (spec == null) {
+            cerr << "Unknown option: " << arg << endl;
+            return false;
+        }
+        if (spec->value != noValue && !valueChecked(arg.substr(string(spec->name).size()), spec->value)) {
+            cerr << "Bad value: " << arg << endl;
+            return false;
+        }
+        if (arg.compare(0, 10, "--manager=") == 0 &&
+            find(std::begin(managerNames), std::end(managerNames), arg.substr(10)) == std::end(managerNames)) {
+            cerr << "Unknown activity manager: " << arg.substr(10) << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Write the options this program takes to standard error. */
+static void usagePrinted() {
+    cerr << "Usage: travelsim1 [--sim=N] [--batch] [--sweep=FILE [--jobs=N]] [--config=FILE]" << endl
+         << "                  [--networks=N] [--cars=N] [--requests=N] [--duration=SECONDS]" << endl
+         << "                  [--requestInterval=SECONDS] [--manager=NAME] [--workers=N]" << endl
+         << "                  [--seed=N] [--express] [--dispatch=batch] [--dispatchWindow=SECONDS]" << endl
+         << "                  [--pooling] [--maxDetour=MINUTES] [--rebalance[=SECONDS]] [--quiet]" << endl
+         << "                  [--log=LEVELS] [--syncLog] [--timers[=monotonic]] [--profile=FILE]" << endl
+         << "                  [--trace=FILE] [--record=FILE | --replay=FILE]" << endl;
+}
+
+/**
+ * Return the activity manager chosen on the command line: --manager=calendar
+ * selects the calendar queue, --manager=parallel a ParallelManager and
+ * --manager=optimistic an OptimisticManager with one partition per
+ * sub-network, --manager=batch a BatchManager, otherwise, or with
+ * --manager=sequential, the heap-based SequentialManager.
+ *
+ * These managers run on --workers=N threads (default 1). For the
+ * partitioned managers, ServiceSim, Stats, and Conn are shared by all
+ * sub-networks and their state is not saved for rollback, nor is the
+ * state of the TripSim and VehicleSim coroutines, so both refuse more
+ * than one worker until they are made partition-local; with one, they
+ * run activities in the same order as the sequential manager.
+ * ServiceSim also sends a vehicle from one sub-network to a trip in
+ * another as soon as the trip is requested, so the parallel manager's
+ * lookahead is zero. The batch manager defers notifications to shared
+ * state, but TripSims find paths through Conn, whose caches aren't
+ * locked, and share Locations and Segments, so it refuses more than one
+ * worker too.
+ */
+static Ptr<ActivityManager> activityManagerNew(const vector<string>& args) {
+    string manager;
+    unsigned long workers = 1;
+    for (const auto& arg : args) {
+        if (arg.compare(0, 10, "--manager=") == 0) {
+            manager = arg.substr(10);
+        } else if (arg.compare(0, 10, "--workers=") == 0) {
+            workers = std::stoul(arg.substr(10));
+        }
+    }
+
+    if (manager == "calendar") {
+        return CalendarManager::instance();
+    }
+
+    if ((manager == "parallel" || manager == "optimistic") && workers > 1) {
+        cerr << "--manager=" << manager << " shares ServiceSim across sub-networks, so it only supports --workers=1" << endl;
+        exit(1);
+    }
+
+    if (manager == "batch" && workers > 1) {
+        cerr << "--manager=batch shares Conn's path caches between trips, so it only supports --workers=1" << endl;
+        exit(1);
+    }
+
+    if (manager == "parallel") {
+        const auto mgr = ParallelManager::instanceNew(desiredNumParallelNetworks + 1);
+        mgr->workerCountIs(workers);
+        return mgr;
+    }
+
+    if (manager == "batch") {
+        return BatchManager::instanceNew(workers);
+    }
+
+    if (manager == "optimistic") {
+        const auto mgr = OptimisticManager::instanceNew(desiredNumParallelNetworks + 1);
+        mgr->workerCountIs(workers);
+        return mgr;
+    }
+
+    return SequentialManager::instance();
+}
+
+/**
+ * Set log levels from a comma-separated list of LEVEL, for every
+ * component, or COMPONENT=LEVEL, where LEVEL is debug, info, warning,
+ * error or off, e.g., info,ServiceSim=off,TripSim=debug.
+ */
+static void logLevelsIs(const string& spec) {
+    const auto log = Log::instance();
+    std::stringstream ss(spec);
+    string item;
+    while (std::getline(ss, item, ',')) {
+        const auto eq = item.find('=');
+        const string name = eq == string::npos ? "" : item.substr(0, eq);
+        const string levelName = eq == string::npos ? item : item.substr(eq + 1);
+        const string levelNames[] = { "debug", "info", "warning", "error", "off" };
+        const auto found = std::find(std::begin(levelNames), std::end(levelNames), levelName);
+        if (found == std::end(levelNames)) {
+            cerr << "Unknown log level: " << levelName << endl;
+            exit(1);
+        }
+
+        const auto level = Log::Level(found - std::begin(levelNames));
+        if (name.empty()) {
+            log->levelIs(level);
+            continue;
+        }
+        const auto component = log->component(name);
+        if (component == Log::noComponent) {
+            cerr << "Unknown log component: " << name << endl;
+            exit(1);
+        }
+        log->levelIs(component, level);
+    }
+}
+
+/**
+ * Handle the remaining command line options: --seed=N seeds the random
+ * numbers (default 1), --express moves trips a leg at a time instead of
+ * a segment at a time, --dispatch=batch matches trips and vehicles in
+ * batches every --dispatchWindow=SECONDS (default 60) instead of one trip
+ * at a time, --pooling shares vehicles between trips whose detours stay
+ * under --maxDetour=MINUTES (default 10), --rebalance[=SECONDS] moves
+ * idle vehicles toward recent demand every SECONDS (default 600), --quiet
+ * turns off the log, --log=LEVELS sets the lowest level each log component
+ * writes (see logLevelsIs), --syncLog formats log lines as they are made
+ * instead of on the log's thread, --trace=FILE writes each trip's
+ * progress to a TripTrace, --timers times the FWK_TIMED call sites and
+ * reports them at the end, with --timers=monotonic reading the monotonic
+ * clock instead of the time stamp counter, --profile=FILE profiles the
+ * activities and reactors, writing folded stacks to FILE and a table of
+ * the top frames at the end, counting allocations too in a build with
+ * FWK_PROFILE_ALLOCATIONS (make -f Makefile-sims.gcc profile), and
+ * --record=FILE and --replay=FILE record the run to or replay it from a
+ * ReplayLog. Replay turns off the log and is only
+ * supported by the default manager.
+ */
+static void optionsIs(const vector<string>& args, const Ptr<ActivityManager>& mgr) {
+    for (const auto& arg : args) {
+        if (arg.compare(0, 7, "--seed=") == 0) {
+            randomSeed = U32(std::stoul(arg.substr(7)));
+        } else if (arg == "--express") {
+            expressTrips = true;
+        } else if (arg == "--dispatch=batch") {
+            batchedDispatch = true;
+        } else if (arg.compare(0, 17, "--dispatchWindow=") == 0) {
+            dispatchWindowInSeconds = std::stod(arg.substr(17));
+        } else if (arg == "--pooling") {
+            ridePooling = true;
+        } else if (arg.compare(0, 12, "--maxDetour=") == 0) {
+            maxDetourInMinutes = std::stod(arg.substr(12));
+        } else if (arg == "--rebalance") {
+            rebalancePeriodInSeconds = 600;
+        } else if (arg.compare(0, 12, "--rebalance=") == 0) {
+            rebalancePeriodInSeconds = std::stod(arg.substr(12));
+        } else if (arg == "--quiet") {
+            Log::instance()->levelIs(Log::off);
+        } else if (arg.compare(0, 6, "--log=") == 0) {
+            logLevelsIs(arg.substr(6));
+        } else if (arg == "--syncLog") {
+            asyncLogging = false;
+        } else if (arg == "--timers") {
+            timersEnabled = true;
+        } else if (arg == "--timers=monotonic") {
+            timersEnabled = true;
+            SystemTime::tscIs(false);
+        } else if (arg.compare(0, 10, "--profile=") == 0) {
+            profileFile = arg.substr(10);
+        } else if (arg.compare(0, 8, "--trace=") == 0) {
+            tripTrace = TripTrace::instanceNew(arg.substr(8), TripTrace::writing);
+        } else if (arg.compare(0, 9, "--record=") == 0) {
+            replayLog = ReplayLog::instanceNew(arg.substr(9), ReplayLog::recording);
+        } else if (arg.compare(0, 9, "--replay=") == 0) {
+            replayLog = ReplayLog::instanceNew(arg.substr(9), ReplayLog::replaying);
+            Log::instance()->levelIs(Log::off);
+        }
+    }
+    rng = Random::instanceNew(randomSeed);
+
+    if (replayLog == null) {
+        return;
+    }
+
+    const Ptr<SequentialManager> sequential = dynamic_cast<SequentialManager*>(mgr.ptr());
+    if (sequential == null) {
+        cerr << "--record and --replay need the default activity manager" << endl;
+        exit(1);
+    }
+    sequential->replayLogIs(replayLog);
+}
+
+/**
+ * Print the statistics of a parallel activity manager.
+ */
+static void printManagerStatistics(const Ptr<ActivityManager>& mgr) {
+    const Ptr<SequentialManager> sequential = dynamic_cast<SequentialManager*>(mgr.ptr());
+    if (sequential != null) {
+        cout << "Sequential Manager Statistics:\t" << endl;
+        cout << "numRuns:\t" << sequential->runCount() << endl;
+        cout << endl;
+    }
+
+    const Ptr<ParallelManager> parallel = dynamic_cast<ParallelManager*>(mgr.ptr());
+    if (parallel != null) {
+        cout << "Parallel Manager Statistics:\t" << endl;
+        cout << "numPartitions:\t" << parallel->partitionCount() << endl;
+        cout << "numWorkers:\t" << parallel->workerCount() << endl;
+        cout << "numWindows:\t" << parallel->windowCount() << endl;
+        cout << endl;
+    }
+
+    const Ptr<BatchManager> batch = dynamic_cast<BatchManager*>(mgr.ptr());
+    if (batch != null) {
+        cout << "Batch Manager Statistics:\t" << endl;
+        cout << "numWorkers:\t" << batch->workerCount() << endl;
+        cout << "numBatches:\t" << batch->batchCount() << endl;
+        cout << "numTasks:\t" << batch->taskCount() << endl;
+        cout << "numRuns:\t" << batch->runCount() << endl;
+        cout << "numSteals:\t" << batch->stealCount() << endl;
+        cout << endl;
+    }
+
+    const Ptr<OptimisticManager> optimistic = dynamic_cast<OptimisticManager*>(mgr.ptr());
+    if (optimistic != null) {
+        cout << "Optimistic Manager Statistics:\t" << endl;
+        cout << "numPartitions:\t" << optimistic->partitionCount() << endl;
+        cout << "numWorkers:\t" << optimistic->workerCount() << endl;
+        cout << "numEvents:\t" << optimistic->eventCount() << endl;
+        cout << "numCommitted:\t" << optimistic->commitCount() << endl;
+        cout << "numRolledBack:\t" << optimistic->rollbackCount() << endl;
+        cout << "numAntiMessages:\t" << optimistic->antiMessageCount() << endl;
+        cout << endl;
+    }
+
+    if (replayLog != null) {
+        cout << "Replay Log Statistics:\t" << endl;
+        cout << "mode:\t" << (replayLog->mode() == ReplayLog::recording ? "recording" : "replaying") << endl;
+        cout << "numRuns:\t" << replayLog->runCount() << endl;
+        cout << "numDraws:\t" << replayLog->drawCount() << endl;
+        cout << endl;
+    }
+}
+
+/** NullBuf is a stream buffer that throws away what is written to it. */
+class NullBuf : public std::streambuf {
+protected:
+
+    int overflow(const int c) {
+        return c;
+    }
+
+};
+
+/**
+ * Return the option a line of a config or sweep file gives, which may
+ * leave off the leading "--", or an empty string for a blank line or a
+ * # comment.
+ */
+static string optionFromLine(const string& line) {
+    const auto begin = line.find_first_not_of(" \t\r");
+    if (begin == string::npos || line[begin] == '#') {
+        return "";
+    }
+
+    const auto option = line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+    return option.compare(0, 2, "--") == 0 ? option : "--" + option;
+}
+
+/**
+ * Return the command line options, with each --config=FILE replaced by the
+ * options in FILE, one to a line, e.g.,
+ *
+ *     # sim 3 on a network four times as large
+ *     sim=3
+ *     networks=16
+ *     cars=160
+ *
+ * Options later on the command line override those before them.
+ */
+static vector<string> optionsFromCommandLine(int argc, char *argv[]) {
+    vector<string> args;
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        if (arg.compare(0, 9, "--config=") != 0) {
+            args.push_back(arg);
+            continue;
+        }
+
+        ifstream in(arg.substr(9));
+        if (!in) {
+            cerr << "Can't read config " << arg.substr(9) << endl;
+            exit(1);
+        }
+        string line;
+        while (std::getline(in, line)) {
+            const auto option = optionFromLine(line);
+            if (!option.empty()) {
+                args.push_back(option);
+            }
+        }
+    }
+    return args;
+}
+
+/**
+ * Override the chosen simulation's variables from the command line:
+ * --networks=N parallel copies of the base network, --cars=N vehicles,
+ * --duration=SECONDS of simulated time, and --requests=N trips requested
+ * over that time or, instead, one every --requestInterval=SECONDS.
+ */
+static void scenarioIs(const vector<string>& args) {
+    double requestInterval = -1;
+    for (const auto& arg : args) {
+        if (arg.compare(0, 11, "--networks=") == 0) {
+            desiredNumParallelNetworks = std::stoi(arg.substr(11));
+        } else if (arg.compare(0, 7, "--cars=") == 0) {
+            desiredNumCarsInNetwork = std::stoi(arg.substr(7));
+        } else if (arg.compare(0, 11, "--requests=") == 0) {
+            desiredNumRequests = unsigned(std::stoul(arg.substr(11)));
+        } else if (arg.compare(0, 11, "--duration=") == 0) {
+            desiredOverallTimespanInSeconds = std::stod(arg.substr(11));
+        } else if (arg.compare(0, 18, "--requestInterval=") == 0) {
+            requestInterval = std::stod(arg.substr(18));
+        }
+    }
+
+    if (desiredNumParallelNetworks < 0 || desiredNumCarsInNetwork < 0 ||
+        desiredNumRequests == 0 || desiredOverallTimespanInSeconds <= 0) {
+        cerr << "--networks and --cars can't be negative, and --requests and --duration must be positive" << endl;
+        exit(1);
+    }
+    timeBetweenRequestsInSeconds = requestInterval >= 0 ? requestInterval :
+        desiredOverallTimespanInSeconds / desiredNumRequests - 1;
+    if (timeBetweenRequestsInSeconds <= 0) {
+        cerr << "Trips must be requested less often than once a second" << endl;
+        exit(1);
+    }
+}
+
+/**
+ * Return the most memory this process has had resident, in bytes, or 0
+ * where that isn't known.
+ */
+static U64 peakResidentBytes() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#   ifdef __APPLE__
+    return U64(usage.ru_maxrss);
+#   else
+    return U64(usage.ru_maxrss) * 1024;
+#   endif
+#endif
+}
+
+/** Write a string as a JSON string. */
+static void jsonStringWritten(std::ostream& out, const string& s) {
+    out << '"';
+    for (const auto c : s) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+/** Write a number as JSON, where there's no NaN or infinity. */
+static void jsonNumberWritten(std::ostream& out, const double x) {
+    if (std::isfinite(x)) {
+        out << x;
+    } else {
+        out << "null";
+    }
+}
+
+/**
+ * Write the name of the activity manager, its number of workers, and
+ * the number of activity runs it has made, which the summary counts as
+ * events. Runs that the optimistic manager rolled back aren't counted, so
+ * every manager counts the same runs for the same simulation.
+ */
+static void managerSummaryWritten(std::ostream& out, const Ptr<ActivityManager>& mgr, const double wallSeconds) {
+    string name = "sequential";
+    unsigned long workers = 1;
+    U64 events = 0;
+    if (const auto sequential = dynamic_cast<SequentialManager*>(mgr.ptr())) {
+        events = sequential->runCount();
+    } else if (const auto calendar = dynamic_cast<CalendarManager*>(mgr.ptr())) {
+        name = "calendar";
+        events = calendar->runCount();
+    } else if (const auto parallel = dynamic_cast<ParallelManager*>(mgr.ptr())) {
+        name = "parallel";
+        workers = parallel->workerCount();
+        events = parallel->runCount();
+    } else if (const auto batch = dynamic_cast<BatchManager*>(mgr.ptr())) {
+        name = "batch";
+        workers = batch->workerCount();
+        events = batch->runCount();
+    } else if (const auto optimistic = dynamic_cast<OptimisticManager*>(mgr.ptr())) {
+        name = "optimistic";
+        workers = optimistic->workerCount();
+        events = optimistic->commitCount();
+    }
+
+    out << "\"manager\":\"" << name << "\",\"workers\":" << workers
+        << ",\"events\":" << events << ",\"eventsPerSecond\":";
+    jsonNumberWritten(out, double(events) / wallSeconds);
+}
+
+/**
+ * Write the run's summary as one line of JSON: the scenario, the seconds
+ * of wall-clock time the simulation took, its throughput in events and
+ * trips requested per wall-clock second, percentiles of the trips' wait,
+ * duration and dispatch latency in simulated seconds, and the process's
+ * peak resident memory.
+ */
+static void summaryWritten(std::ostream& out, const unsigned int simNum, const Ptr<ActivityManager>& mgr,
+                           const Ptr<TravelNetwork>& tn, const double wallSeconds) {
+    const auto stats = tn->stats("stats");
+    out << "{\"sim\":" << simNum << ",\"seed\":" << randomSeed
+        << ",\"locations\":" << allLocationNames.size()
+        << ",\"cars\":" << desiredNumCarsInNetwork
+        << ",\"requestInterval\":" << timeBetweenRequestsInSeconds
+        << ",\"duration\":" << desiredOverallTimespanInSeconds << ',';
+    managerSummaryWritten(out, mgr, wallSeconds);
+    out << ",\"wallSeconds\":" << wallSeconds
+        << ",\"trips\":" << stats->numTrips()
+        << ",\"completedTrips\":" << stats->numCompletedTrips()
+        << ",\"tripsPerSecond\":";
+    jsonNumberWritten(out, double(stats->numTrips()) / wallSeconds);
+    for (const auto metric : { "waitTime", "tripDuration", "dispatchLatency" }) {
+        out << ",\"" << metric << "\":{";
+        const char* sep = "";
+        for (const auto stat : { "mean", "p50", "p90", "p99", "max" }) {
+            out << sep << '"' << stat << "\":";
+            jsonNumberWritten(out, stats->statistic(string(metric) + "." + stat));
+            sep = ",";
+        }
+        out << '}';
+    }
+    out << ",\"peakResidentBytes\":" << peakResidentBytes() << '}' << endl;
+}
+
+/** Return the argument quoted for the shell. */
+static string shellQuoted(const string& arg) {
+#ifdef _WIN32
+    return '"' + arg + '"';
+#else
+    string quoted = "'";
+    for (const auto c : arg) {
+        quoted += c == '\'' ? string("'\\''") : string(1, c);
+    }
+    return quoted + "'";
+#endif
+}
+
+/**
+ * Run each configuration in the sweep file as a batch run of this program
+ * in its own process, up to jobs at once, and print their summaries in
+ * the order of the file. Each line of the file holds the options of one
+ * configuration, which override the sweep's own options, and blank lines
+ * and # comments are skipped, e.g.,
+ *
+ *     --networks=4 --cars=40
+ *     --networks=16 --cars=160
+ *     --networks=16 --cars=160 --manager=batch
+ *
+ * A configuration that fails prints a summary with its error instead.
+ * Return the number of configurations that failed.
+ */
+static unsigned long sweepRun(const string& program, const vector<string>& args,
+                              const string& file, const unsigned long jobs) {
+    ifstream in(file);
+    if (!in) {
+        cerr << "Can't read sweep " << file << endl;
+        exit(1);
+    }
+
+    string common = shellQuoted(program) + " --batch";
+    for (const auto& arg : args) {
+        if (arg.compare(0, 8, "--sweep=") != 0 && arg.compare(0, 7, "--jobs=") != 0) {
+            common += " " + shellQuoted(arg);
+        }
+    }
+
+    vector<string> configs;
+    string line;
+    while (std::getline(in, line)) {
+        if (optionFromLine(line).empty()) {
+            continue;
+        }
+        std::istringstream words(line);
+        string config;
+        vector<string> options;
+        string word;
+        while (words >> word && word[0] != '#') {
+            options.push_back(optionFromLine(word));
+            config += (config.empty() ? "" : " ") + options.back();
+        }
+        if (!optionsChecked(options)) {
+            cerr << "in sweep " << file << ": " << line << endl;
+            usagePrinted();
+            exit(1);
+        }
+        configs.push_back(config);
+    }
+
+    // Children start in order and are read in order, so at most jobs run
+    // at once and the summaries come out in the order of the file.
+    std::deque<std::pair<string, FILE*>> running;
+    unsigned long failures = 0;
+    auto next = configs.begin();
+    while (next != configs.end() || !running.empty()) {
+        while (next != configs.end() && running.size() < std::max(jobs, 1ul)) {
+            string command = common;
+            std::istringstream words(*next);
+            string word;
+            while (words >> word) {
+                command += " " + shellQuoted(word);
+            }
+            running.push_back(std::make_pair(*next, popen(command.c_str(), "r")));
+            ++next;
+        }
+
+        const auto child = running.front();
+        running.pop_front();
+        string output;
+        int status = -1;
+        if (child.second != null) {
+            char buffer[4096];
+            while (fgets(buffer, sizeof(buffer), child.second) != null) {
+                output += buffer;
+            }
+            status = pclose(child.second);
+#ifndef _WIN32
+            if (status != -1 && WIFEXITED(status)) {
+                status = WEXITSTATUS(status);
+            }
+#endif
+        }
+        if (status == 0 && !output.empty()) {
+            cout << output << std::flush;
+            continue;
+        }
+
+        ++failures;
+        cout << "{\"config\":";
+        jsonStringWritten(cout, child.first);
+        cout << ",\"error\":\"exit status " << status << "\"}" << endl;
+    }
+    return failures;
+}
+
 /**
  * Main program creates a travel network, service simulation, and trip request simulation, and
  * then runs the simulation for a fixed period of time.
+ *
+ * The simulation is chosen interactively unless it is given with --sim=N.
+ * --batch runs without asking or printing a report: the scenario comes
+ * from the options (see scenarioIs), sim 3 by default, the log is off,
+ * and the only output is the summary line of summaryWritten. --sweep=FILE
+ * runs the configurations in FILE as batch runs, --jobs=N at once
+ * (default one per hardware thread). An unknown option, or a value that
+ * isn't a number where one is needed, prints the usage and exits with
+ * status 1, as does one in a sweep file before any configuration runs.
  */
 int main(int argc, char *argv[]) {
-    printChooser();
-    unsigned int simNum;
-    while (true) {
-        cin >> simNum;
-        if (simNum > 0 && simNum <= maxSimNum) break;
-        cout << "You must choose an integer between 1 and " << maxSimNum << endl;
+    const auto args = optionsFromCommandLine(argc, argv);
+    if (!optionsChecked(args)) {
+        usagePrinted();
+        return 1;
+    }
+    unsigned int simNum = 0;
+    string sweepFile;
+    unsigned long jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    for (const auto& arg : args) {
+        if (arg.compare(0, 6, "--sim=") == 0) {
+            simNum = unsigned(std::stoul(arg.substr(6)));
+            if (simNum == 0 || simNum > maxSimNum) {
+                cerr << "--sim must be between 1 and " << maxSimNum << endl;
+                return 1;
+            }
+        } else if (arg == "--batch") {
+            batchMode = true;
+        } else if (arg.compare(0, 8, "--sweep=") == 0) {
+            sweepFile = arg.substr(8);
+        } else if (arg.compare(0, 7, "--jobs=") == 0) {
+            jobs = std::stoul(arg.substr(7));
+        }
+    }
+    if (!sweepFile.empty()) {
+        return sweepRun(argv[0], args, sweepFile, jobs) == 0 ? 0 : 1;
+    }
+
+    // A batch run writes nothing but its summary
+    std::streambuf* const stdoutBuf = cout.rdbuf();
+    NullBuf nullBuf;
+    if (batchMode) {
+        cout.rdbuf(&nullBuf);
+        if (simNum == 0) {
+            simNum = maxSimNum;
+        }
+    }
+
+    if (simNum == 0) {
+        printChooser();
+        while (true) {
+            cin >> simNum;
+            if (simNum > 0 && simNum <= maxSimNum) break;
+            cout << "You must choose an integer between 1 and " << maxSimNum << endl;
+        }
     }
     setSimulationVars(simNum);
+    scenarioIs(args);
 
 
     // Set up activity manager
-    const auto mgr = SequentialManager::instance();
-    const auto startTime = time(SystemTime::now());
+    const auto mgr = activityManagerNew(args);
+    optionsIs(args, mgr);
+    if (batchMode) {
+        Log::instance()->levelIs(Log::off);
+    }
+
+    // Send the rest of the output through the log, so it stays in order
+    Log::instance()->asyncIs(asyncLogging);
+    Log::instance()->coutCapturedIs(!batchMode);
+    Timer::enabledIs(timersEnabled);
+    Profiler::enabledIs(!profileFile.empty());
+
+    // A replayed run starts at the recorded start time
+    auto startTime = time(SystemTime::now());
+    if (replayLog != null) {
+        startTime = replayLog->draw(startTime.value());
+    }
     mgr->nowIs(startTime);
 
     // Setup TravelNetwork and TripRequester
     const Ptr<TravelNetwork> tn = TravelNetwork::instanceNew("tn");
+    tn->stats("stats")->clockIs(mgr);
+    Ptr<TripTracer> tripTracer;
+    if (tripTrace != null) {
+        tripTracer = TripTracer::instanceNew(mgr, tn);
+    }
     const Ptr<ServiceSim> serviceSim = ServiceSim::instanceNew(mgr, tn);
     setupNetwork(tn, simNum);
     const Ptr<TripRequesterSim> tripRequesterSim = TripRequesterSim::instanceNew(mgr, tn, simNum);
+    Ptr<RebalancerSim> rebalancerSim;
+    if (rebalancePeriodInSeconds > 0) {
+        rebalancerSim = RebalancerSim::instanceNew(mgr, tn, serviceSim);
+    }
 
     // Start Running Simulation
-    logEntryNew(startTime, "\n****************************************\n"
+    logEntryNew(mainLog, Log::info, startTime, "\n****************************************\n"
                             "*********[Starting Simulation]**********\n"
                             "****************************************\n");
-    mgr->nowIs(startTime + desiredOverallTimespanInSeconds);
+    const auto wallStart = SystemTime::nanoseconds();
+    try {
+        mgr->nowIs(startTime + desiredOverallTimespanInSeconds);
+    } catch (const ReplayException& e) {
+        cout.rdbuf(stdoutBuf);
+        cerr << "Replay diverged from the log: " << e.what() << endl;
+        return 1;
+    }
+    const auto wallSeconds = double(SystemTime::nanoseconds() - wallStart) / 1e9;
     tripRequesterSim->activityDel();
     serviceSim->activityDel();
-    logEntryNew(mgr->now(), "\n****************************************\n"
+    if (rebalancerSim != null) {
+        rebalancerSim->activityDel();
+    }
+    logEntryNew(mainLog, Log::info, mgr->now(), "\n****************************************\n"
                             "*********[Finished Simulation]**********\n"
                             "****************************************\n");
 
-    // Print statistics
-    printTripStatistics(tn);
-    cout << "Feel free to run another simulation!" << endl;
+    // Print statistics, or a batch run's summary
+    if (batchMode) {
+        cout.rdbuf(stdoutBuf);
+        summaryWritten(cout, simNum, mgr, tn, wallSeconds);
+    } else {
+        printTripStatistics(tn);
+        if (rebalancerSim != null) {
+            cout << "numRebalancingMoves:\t" << rebalancerSim->numMoves() << endl;
+        }
+        printManagerStatistics(mgr);
+    }
+    std::ostream& report = batchMode ? std::cerr : cout;
+    if (timersEnabled) {
+        Timer::enabledIs(false);
+        Timer::reportWritten(report);
+    }
+    if (!profileFile.empty()) {
+        Profiler::enabledIs(false);
+        std::ofstream folded(profileFile);
+        Profiler::foldedStacksWritten(folded);
+        if (!folded) {
+            cerr << "Can't write profile " << profileFile << endl;
+        }
+        Profiler::reportWritten(report);
+    }
+
+    // Release the trip trace so its last rows are written out
+    tripTracer = null;
+    tripTrace = null;
+
+    // Release the replay log so a recording is written out
+    if (replayLog != null) {
+        Ptr<SequentialManager>(dynamic_cast<SequentialManager*>(mgr.ptr()))->replayLogIs(null);
+        replayLog = null;
+    }
+    if (!batchMode) {
+        cout << "Feel free to run another simulation!" << endl;
+    }
     
     return 0;
 }
\ No newline at end of file